@@ -21,62 +21,112 @@
 #include <stdio.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "vsftp_filesystem.h"
 #include "vsftp_server.h"
 #include "config.h"
+#include "io.h"
 #include "vsftp_commands.h"
 
 #define DIM(_a)                     (sizeof((_a)) / sizeof(*(_a)))
 #define STRLEN(_a)                  ((sizeof((_a)) / sizeof(*(_a))) - 1)
 
-#define FTP_COMMAND_USER            "USER"
-#define FTP_COMMAND_SYST            "SYST"
-#define FTP_COMMAND_PASV            "PASV"
-#define FTP_COMMAND_NLST            "NLST"
-#define FTP_COMMAND_PWD             "PWD"
-#define FTP_COMMAND_CWD             "CWD"
-#define FTP_COMMAND_RETR            "RETR"
-#define FTP_COMMAND_SIZE            "SIZE"
-#define FTP_COMMAND_TYPE            "TYPE"
-#define FTP_COMMAND_HELP            "HELP"
-#define FTP_COMMAND_QUIT            "QUIT"
-
-typedef int (* CommandHandle)(const char *args, size_t len);
+/* The commands: X(verb, the letters of the verb, handler, allowed during a transfer).
+ * The command table and the dispatch switch of FindCommand() are generated from this list, so adding a command does
+ * not make dispatching slower. Commands that are allowed during a transfer must not yield.
+ */
+#define FTP_COMMANDS(X) \
+    X(USER, 'U', 'S', 'E', 'R',  CommandHandlerUser, false) \
+    X(SYST, 'S', 'Y', 'S', 'T',  CommandHandlerSyst, false) \
+    X(PASV, 'P', 'A', 'S', 'V',  CommandHandlerPasv, false) \
+    X(NLST, 'N', 'L', 'S', 'T',  CommandHandlerNlst, false) \
+    X(PWD,  'P', 'W', 'D', '\0', CommandHandlerPwd,  false) \
+    X(CWD,  'C', 'W', 'D', '\0', CommandHandlerCwd,  false) \
+    X(RETR, 'R', 'E', 'T', 'R',  CommandHandlerRetr, false) \
+    X(SIZE, 'S', 'I', 'Z', 'E',  CommandHandlerSize, false) \
+    X(TYPE, 'T', 'Y', 'P', 'E',  CommandHandlerType, false) \
+    X(HELP, 'H', 'E', 'L', 'P',  CommandHandlerHelp, false) \
+    X(QUIT, 'Q', 'U', 'I', 'T',  CommandHandlerQuit, false) \
+    X(NOOP, 'N', 'O', 'O', 'P',  CommandHandlerNoop, true)  \
+    X(ABOR, 'A', 'B', 'O', 'R',  CommandHandlerAbor, true)  \
+    X(STAT, 'S', 'T', 'A', 'T',  CommandHandlerStat, true)  \
+    X(SITE, 'S', 'I', 'T', 'E',  CommandHandlerSite, false) \
+    X(REST, 'R', 'E', 'S', 'T',  CommandHandlerRest, false) \
+    X(RANG, 'R', 'A', 'N', 'G',  CommandHandlerRang, false) \
+    X(FEAT, 'F', 'E', 'A', 'T',  CommandHandlerFeat, false)
+
+/* The key of a verb: its (upper case) letters packed in a uint32_t, a 3 letter verb ends in a 0. */
+#define VERB_KEY(_a, _b, _c, _d)    (((uint32_t)(_a) << 24U) | ((uint32_t)(_b) << 16U) | ((uint32_t)(_c) << 8U) | \
+                                     (uint32_t)(_d))
+#define VERB_LEN_MIN                3U
+#define VERB_LEN_MAX                4U
+
+#define TELNET_IAC                  ((char)0xFF)
+
+#define REPLY_LOCAL_ERROR           "451 Requested action aborted: Local error in processing."
 
 typedef struct {
     const char *name;
     size_t nameLen;
     CommandHandle handle;
+    bool isAllowedDuringTransfer;
 }Command_s;
 
-static int CommandHandlerUser(const char *args, size_t len);
-static int CommandHandlerSyst(const char *args, size_t len);
-static int CommandHandlerPasv(const char *args, size_t len);
-static int CommandHandlerNlst(const char *args, size_t len);
-static int CommandHandlerPwd(const char *args, size_t len);
-static int CommandHandlerCwd(const char *args, size_t len);
-static int CommandHandlerRetr(const char *args, size_t len);
-static int CommandHandlerSize(const char *args, size_t len);
-static int CommandHandlerType(const char *args, size_t len);
-static int CommandHandlerHelp(const char *args, size_t len);
-static int CommandHandlerQuit(const char *args, size_t len);
-
-static Command_s commands[] = {
-        { FTP_COMMAND_USER, STRLEN(FTP_COMMAND_USER), CommandHandlerUser },
-        { FTP_COMMAND_SYST, STRLEN(FTP_COMMAND_SYST), CommandHandlerSyst },
-        { FTP_COMMAND_PASV, STRLEN(FTP_COMMAND_PASV), CommandHandlerPasv },
-        { FTP_COMMAND_NLST, STRLEN(FTP_COMMAND_NLST), CommandHandlerNlst },
-        { FTP_COMMAND_PWD, STRLEN(FTP_COMMAND_PWD), CommandHandlerPwd },
-        { FTP_COMMAND_CWD, STRLEN(FTP_COMMAND_CWD), CommandHandlerCwd },
-        { FTP_COMMAND_RETR, STRLEN(FTP_COMMAND_RETR), CommandHandlerRetr },
-        { FTP_COMMAND_SIZE, STRLEN(FTP_COMMAND_SIZE), CommandHandlerSize },
-        { FTP_COMMAND_TYPE, STRLEN(FTP_COMMAND_TYPE), CommandHandlerType },
-        { FTP_COMMAND_HELP, STRLEN(FTP_COMMAND_HELP), CommandHandlerHelp },
-        { FTP_COMMAND_QUIT, STRLEN(FTP_COMMAND_QUIT), CommandHandlerQuit }
+#define COMMAND_ID(_verb, ...)      COMMAND_ID_##_verb,
+
+typedef enum {
+    FTP_COMMANDS(COMMAND_ID)
+    COMMANDS_LEN
+} vsftpCommandId_e;
+
+static int CommandHandlerUser(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerSyst(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerPasv(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerNlst(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerPwd(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerCwd(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerRetr(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerSize(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerType(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerHelp(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerQuit(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerNoop(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerAbor(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerStat(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerSite(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerSiteMstat(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerRest(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerRang(vsftpSession_s *session, const char *args, size_t len);
+static int CommandHandlerFeat(vsftpSession_s *session, const char *args, size_t len);
+
+static void SkipTelnetCommands(const char **buffer, size_t *len);
+static const Command_s *FindCommand(const char *buffer, size_t len);
+static size_t ParseOffset(const char *buffer, size_t len, uint64_t *offset);
+
+static int WorkNlstResolve(vsftpSession_s *session);
+static int WorkNlstRead(vsftpSession_s *session);
+static int WorkCwd(vsftpSession_s *session);
+static int WorkRetrOpen(vsftpSession_s *session);
+static int WorkSize(vsftpSession_s *session);
+static bool NextMstatPath(vsftpCommandState_s *state, const char **path, size_t *pathLen);
+static int FormatMstatLine(vsftpCommandState_s *state, const char *name, size_t nameLen, const struct stat *st);
+static void StatMstatPath(vsftpSession_s *session, const char *path, size_t pathLen);
+static int WorkMstatRead(vsftpSession_s *session);
+
+#define COMMAND_ENTRY(_verb, _a, _b, _c, _d, _handle, _isAllowedDuringTransfer) \
+    { #_verb, STRLEN(#_verb), _handle, _isAllowedDuringTransfer },
+
+/* The verbs as listed by HELP, the reply is a string literal. */
+#define HELP_VERB(_verb, ...)       " " #_verb
+
+/* Indexed by vsftpCommandId_e. */
+static const Command_s commands[COMMANDS_LEN] = {
+    FTP_COMMANDS(COMMAND_ENTRY)
 };
 
-static int CommandHandlerUser(const char *args, size_t len)
+static int CommandHandlerUser(vsftpSession_s *session, const char *args, size_t len)
 {
     const char user[] = "anonymous";
     size_t lLen = STRLEN(user);
@@ -85,43 +135,43 @@ static int CommandHandlerUser(const char *args, size_t len)
     /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
 
     if ((len == lLen) && (strncmp(user, args, lLen) == 0)) {
-        retval = VSFTPServerSendReply("230 User logged in, proceed.");
+        retval = VSFTP_SEND_REPLY(session, "230 User logged in, proceed.");
     } else {
-        retval = VSFTPServerSendReply("530 Login incorrect.");
-        (void)VSFTPServerClientDisconnect();
+        retval = VSFTP_SEND_REPLY(session, "530 Login incorrect.");
+        (void)VSFTPServerClientDisconnect(session);
     }
 
     return retval;
 }
 
-static int CommandHandlerSyst(const char *args, size_t len)
+static int CommandHandlerSyst(vsftpSession_s *session, const char *args, size_t len)
 {
     /* args and len not used. */
     (void)args;
     (void)len;
 
-    return VSFTPServerSendReply("215 UNIX Type: L8");
+    return VSFTP_SEND_REPLY(session, "215 UNIX Type: L8");
 }
 
-static int CommandHandlerPasv(const char *args, size_t len)
+static int CommandHandlerPasv(vsftpSession_s *session, const char *args, size_t len)
 {
     int retval = -1;
     char ipAddrBuf[INET_ADDRSTRLEN];
     size_t ipAddrLen = 0;
     uint8_t p1 = 0;
     uint8_t p2 = 0;
-    uint16_t portNumber = PASV_PORT_NUMBER;
+    uint16_t portNumber = 0;
 
     /* args and len not used. */
     (void)args;
     (void)len;
 
     /* Close a socket if it is still open (could be happening with unsupported reception of list command). */
-    (void)VSFTPServerCloseTransferClientSocket();
-    (void)VSFTPServerCloseTransferSocket();
+    (void)VSFTPServerCloseTransferClientSocket(session);
+    (void)VSFTPServerCloseTransferSocket(session);
 
-    /* Create a new transfer socket connection. */
-    retval = VSFTPServerCreateTransferSocket(portNumber);
+    /* Lease a transfer socket from the passive port pool. */
+    retval = VSFTPServerCreateTransferSocket(session, &portNumber);
 
     /* Transmit socket to client. */
     if (retval == 0) {
@@ -141,104 +191,193 @@ static int CommandHandlerPasv(const char *args, size_t len)
 
     if (retval == 0) {
         /* (h1,h2,h3,h4,p1,p2) */
-        retval = VSFTPServerSendReply("227 Entering Passive Mode (%s,%d,%d).", ipAddrBuf, p1, p2);
+        retval = VSFTPServerSendReply(session, "227 Entering Passive Mode (%s,%d,%d).", ipAddrBuf, p1, p2);
     } else {
-        retval = VSFTPServerSendReply("425 Cannot open data connection.");
+        retval = VSFTP_SEND_REPLY(session, "425 Cannot open data connection.");
     }
 
     return retval;
 }
 
-static int CommandHandlerNlst(const char *args, size_t len)
+/*!
+ * \brief Resolve the directory to list.
+ * \details
+ *      Blocking, runs on an offload thread.
+ * \param session
+ *      The session that runs NLST with an argument.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkNlstResolve(vsftpSession_s *session)
 {
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    char realPath[PATH_LEN_MAX];
+    size_t realPathLen = 0;
     int retval = -1;
+
+    retval = VSFTPServerServerPathToRealPath(session, state->args, state->argsLen, realPath, sizeof(realPath),
+                                             &realPathLen);
+
+    if (retval == 0) {
+        retval = VSFTPFilesystemIsDir(realPath, realPathLen);
+    }
+
+    /* Make sure the new path is not above the root path. */
+    if (retval == 0) {
+        retval = VSFTPServerAbsPathIsNotAboveRootPath(realPath, realPathLen);
+    }
+
+    if (retval == 0) {
+        (void)strncpy(state->path, realPath, sizeof(state->path));
+        state->pathLen = realPathLen;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Read the next part of the directory listing into the listing buffer.
+ * \details
+ *      Blocking, runs on an offload thread. The listing is empty once the whole directory has been read.
+ * \param session
+ *      The session that runs NLST.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkNlstRead(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
     char buf[PATH_LEN_MAX];
     size_t bufLen = 0;
-    char realPath[PATH_LEN_MAX];
-    size_t realPathLen = 0;
-    char cwd[PATH_LEN_MAX];
-    size_t cwdLen = 0;
     char serverPath[PATH_LEN_MAX];
     size_t serverPathLen = 0;
-    void *d = NULL;
-    const char *lpath = 0;
-    size_t llen = 0;
+    int written = 0;
+    int retval = 0;
 
-    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+    state->listingLen = 0;
 
-    /* Get cwd. */
-    retval = VSFTPServerGetCwd(cwd, sizeof(cwd), &cwdLen);
+    /* The entry that did not fit in the previous part goes first. */
+    if (state->lineLen > 0) {
+        (void)memcpy(state->listing, state->line, state->lineLen);
+        state->listingLen = state->lineLen;
+        state->lineLen = 0;
+    }
 
-    if (retval == 0) {
-        lpath = cwd;
-        llen = cwdLen;
+    while ((retval == 0) && (state->isEndOfDir == false) && (state->lineLen == 0)) {
+        retval = VSFTPFilesystemListDirPerLine(state->path, state->pathLen, buf, sizeof(buf), &bufLen,
+                                               state->prependDir, &state->dirCookie);
+        if ((retval == 0) && (state->dirCookie == NULL)) {
+            /* End of directory. */
+            state->isEndOfDir = true;
+            break;
+        }
 
-        if (len != 0) {
-            /* Get requested dir. */
-            retval = VSFTPServerServerPathToRealPath(args, len, realPath, sizeof(realPath), &realPathLen);
+        /* Remove the root path from the CWD. */
+        if ((retval == 0) && (state->prependDir == true)) {
+            retval = VSFTPServerRealPathToServerPath(buf, bufLen, serverPath, sizeof(serverPath), &serverPathLen);
+        } else if (retval == 0) {
+            (void)strncpy(serverPath, buf, sizeof(serverPath));
+            serverPathLen = bufLen;
+        }
 
-            if (retval == 0) {
-                retval = VSFTPFilesystemIsDir(realPath, realPathLen);
+        if (retval == 0) {
+            written = snprintf(state->line, sizeof(state->line), "%s\r\n", serverPath);
+            if ((written >= 0) && ((size_t)written < sizeof(state->line))) {
+                state->lineLen = (size_t)written;
+            } else {
+                retval = -1;
             }
+        }
 
-            /* Make sure the new path is not above the root path. */
-            if (retval == 0) {
-                retval = VSFTPServerAbsPathIsNotAboveRootPath(realPath, realPathLen);
-            }
+        if ((retval == 0) && (state->lineLen <= (sizeof(state->listing) - state->listingLen))) {
+            (void)memcpy(&state->listing[state->listingLen], state->line, state->lineLen);
+            state->listingLen += state->lineLen;
+            state->lineLen = 0;
+        } /* Else: keep it for the next part. */
+    }
 
-            if (retval == 0) {
-                lpath = realPath;
-                llen = realPathLen;
-            }
+    return retval;
+}
+
+static int CommandHandlerNlst(vsftpSession_s *session, const char *args, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+
+    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+    (void)args;
+
+    COROUTINE_BEGIN(&state->coroutine);
+
+    state->dirCookie = NULL;
+    state->isEndOfDir = false;
+    state->lineLen = 0;
+    state->prependDir = (len != 0);
+
+    /* Get cwd. */
+    state->retval = VSFTPServerGetCwd(session, state->path, sizeof(state->path), &state->pathLen);
+
+    if ((state->retval == 0) && (len != 0)) {
+        /* Get requested dir. */
+        state->retval = VSFTPServerOffload(session, WorkNlstResolve);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
         }
     }
 
-    if (retval == 0) {
-        retval = VSFTPServerAcceptTransferClientConnection();
+    if (state->retval == 0) {
+        /* Wait for the client to connect. */
+        state->retval = VSFTPServerAcceptTransferClientConnection(session);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerAcceptTransferClientConnection(session);
+        }
     }
 
-    if (retval == 0) {
-        retval = VSFTPServerSendReply("150 Here comes the directory listing.");
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "150 Here comes the directory listing.");
     }
 
-    if (retval == 0) {
-        /* List dirs and files of given dir. */
-        do {
-            retval = VSFTPFilesystemListDirPerLine(lpath, llen, buf, sizeof(buf), &bufLen, (len != 0), &d);
-            if (retval != 0) {
-                break;
-            }
+    /* List dirs and files of given dir, a buffer full at a time. */
+    while (state->retval == 0) {
+        state->retval = VSFTPServerOffload(session, WorkNlstRead);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
+        }
 
-            /* Remove the root path from the CWD. */
-            if (len != 0) {
-                retval = VSFTPServerRealPathToServerPath(buf, sizeof(buf), serverPath, sizeof(serverPath),
-                                                         &serverPathLen);
-                if (retval == 0) {
-                    retval = VSFTPServerSendReplyOwnBufTransfer(serverPath, sizeof(serverPath), serverPathLen);
-                }
-            } else {
-                retval = VSFTPServerSendReplyOwnBufTransfer(buf, sizeof(buf), bufLen);
-            }
+        if ((state->retval != 0) || (state->listingLen == 0)) {
+            /* Error or end of directory. */
+            break;
+        }
 
-            if (retval != 0) {
-                break;
-            }
-        } while(d != NULL);
+        state->listingSent = 0;
+        state->retval = VSFTPServerSendTransfer(session, state->listing, state->listingLen, &state->listingSent);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerSendTransfer(session, state->listing, state->listingLen,
+                                                    &state->listingSent);
+        }
     }
 
-    (void)VSFTPServerCloseTransferClientSocket();
-    (void)VSFTPServerCloseTransferSocket();
+    VSFTPFilesystemListDirClose(&state->dirCookie);
+    (void)VSFTPServerCloseTransferClientSocket(session);
+    (void)VSFTPServerCloseTransferSocket(session);
 
-    if (retval == 0) {
-        retval = VSFTPServerSendReply("226 Directory send OK.");
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "226 Directory send OK.");
+    } else if (state->retval == ECANCELED) {
+        state->retval = VSFTP_SEND_REPLY(session, "426 Connection closed; transfer aborted.");
+    } else if (state->retval == ETIMEDOUT) {
+        state->retval = VSFTP_SEND_REPLY(session, "425 Cannot open data connection.");
     } else {
-        retval = VSFTPServerSendReply("550 Permission Denied.");
+        state->retval = VSFTP_SEND_REPLY(session, "550 Permission Denied.");
     }
 
-    return retval;
+    COROUTINE_END(&state->coroutine);
+
+    return state->retval;
 }
 
-static int CommandHandlerPwd(const char *args, size_t len)
+static int CommandHandlerPwd(vsftpSession_s *session, const char *args, size_t len)
 {
     char cwd[PATH_LEN_MAX];
     char serverPath[PATH_LEN_MAX];
@@ -250,7 +389,7 @@ static int CommandHandlerPwd(const char *args, size_t len)
     (void)args;
     (void)len;
 
-    retval = VSFTPServerGetCwd(cwd, sizeof(cwd), &cwdLen);
+    retval = VSFTPServerGetCwd(session, cwd, sizeof(cwd), &cwdLen);
 
     /* Remove the root path from the CWD. */
     if (retval == 0) {
@@ -258,125 +397,205 @@ static int CommandHandlerPwd(const char *args, size_t len)
     }
 
     if (retval == 0) {
-        retval = VSFTPServerSendReply("257 \"%s\"", serverPath);
+        retval = VSFTPServerSendReply(session, "257 \"%s\"", serverPath);
     } else {
-        retval = VSFTPServerSendReply("550 Failed to get directory.");
+        retval = VSFTP_SEND_REPLY(session, "550 Failed to get directory.");
     }
 
     return retval;
 }
 
-static int CommandHandlerCwd(const char *args, size_t len)
+/*!
+ * \brief Resolve the requested directory and make it the CWD.
+ * \details
+ *      Blocking, runs on an offload thread.
+ * \param session
+ *      The session that runs CWD.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkCwd(vsftpSession_s *session)
 {
-    int retval = -1;
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
     char realPath[PATH_LEN_MAX];
     size_t realPathLen = 0;
+    int retval = -1;
+
+    retval = VSFTPServerServerPathToRealPath(session, state->args, state->argsLen, realPath, sizeof(realPath),
+                                             &realPathLen);
+
+    if (retval == 0) {
+        retval = VSFTPServerSetCwd(session, realPath, realPathLen);
+    }
+
+    return retval;
+}
+
+static int CommandHandlerCwd(vsftpSession_s *session, const char *args, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
 
     /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+    (void)args;
+
+    COROUTINE_BEGIN(&state->coroutine);
+
+    state->retval = -1;
 
     if (len > 0) {
-        retval = VSFTPServerServerPathToRealPath(args, len, realPath, sizeof(realPath), &realPathLen);
+        state->retval = VSFTPServerOffload(session, WorkCwd);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
+        }
+    }
+
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "250 Directory successfully changed.");
+    } else {
+        state->retval = VSFTP_SEND_REPLY(session, "550 Failed to change directory.");
     }
 
+    COROUTINE_END(&state->coroutine);
+
+    return state->retval;
+}
+
+/*!
+ * \brief Resolve the requested file and open it for the transfer.
+ * \details
+ *      Blocking, runs on an offload thread.
+ * \param session
+ *      The session that runs RETR.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkRetrOpen(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    char realPath[PATH_LEN_MAX];
+    size_t realPathLen = 0;
+    int retval = -1;
+
+    retval = VSFTPServerServerPathToRealPath(session, state->args, state->argsLen, realPath, sizeof(realPath),
+                                             &realPathLen);
+
     if (retval == 0) {
-        retval = VSFTPServerSetCwd(realPath, realPathLen);
+        retval = VSFTPFilesystemIsFile(realPath, realPathLen);
+    }
+
+    if (retval != 0) {
+        state->isFileError = true;
     }
 
     if (retval == 0) {
-        retval = VSFTPServerSendReply("250 Directory successfully changed.");
+        retval = VSFTPServerOpenTransferFile(session, realPath, realPathLen);
+        state->isRangeError = (retval == ERANGE);
     } else {
-        retval = VSFTPServerSendReply("550 Failed to change directory.");
+        /* The range is for this file only. */
+        (void)VSFTPServerSetTransferRange(session, 0, UINT64_MAX);
     }
 
     return retval;
 }
 
-static int CommandHandlerRetr(const char *args, size_t len)
+static int CommandHandlerRetr(vsftpSession_s *session, const char *args, size_t len)
 {
-    int retval = -1;
-    char realPath[PATH_LEN_MAX];
-    size_t realPathLen = 0;
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
     bool isBinary = false;
-    const char *fileNotFound = "551 File not found.";
-    const char *localError = "451 Requested action aborted: Local error in processing.";
-    bool isFileError = false;
 
     /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
 
+    COROUTINE_BEGIN(&state->coroutine);
+
+    state->retval = -1;
+    state->isFileError = false;
+    state->isRangeError = false;
+
     if (len > 0) {
-        retval = VSFTPServerServerPathToRealPath(args, len, realPath, sizeof(realPath), &realPathLen);
-        if (retval != 0) {
-            isFileError = true;
+        state->retval = VSFTPServerOffload(session, WorkRetrOpen);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
         }
     }
 
-    if (retval == 0) {
-        retval = VSFTPFilesystemIsFile(realPath, realPathLen);
-        if (retval != 0) {
-            isFileError = true;
+    if (state->retval == 0) {
+        /* Wait for the client to connect. */
+        state->retval = VSFTPServerAcceptTransferClientConnection(session);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerAcceptTransferClientConnection(session);
         }
     }
 
-    if (retval == 0) {
-        retval = VSFTPServerAcceptTransferClientConnection();
+    if (state->retval == 0) {
+        state->retval = VSFTPServerGetTransferMode(session, &isBinary);
     }
 
-    if (retval == 0) {
-        retval = VSFTPServerGetTransferMode(&isBinary);
-    }
-
-    if (retval == 0) {
+    if (state->retval == 0) {
         if (isBinary == true) {
-            retval = VSFTPServerSendReply("150 BINARY mode data connection for %s.", args);
+            state->retval = VSFTPServerSendReply(session, "150 BINARY mode data connection for %s.", args);
         } else {
-            retval = VSFTPServerSendReply("150 ASCII mode data connection for %s.", args);
+            state->retval = VSFTPServerSendReply(session, "150 ASCII mode data connection for %s.", args);
         }
     }
 
-    if (retval == 0) {
-        retval = VSFTPServerSendfileTransfer(realPath, realPathLen);
+    if (state->retval == 0) {
+        /* One chunk at a time, the control connection is served in between. */
+        state->retval = VSFTPServerSendfileTransfer(session);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerSendfileTransfer(session);
+        }
     }
 
-    (void)VSFTPServerCloseTransferClientSocket();
-    (void)VSFTPServerCloseTransferSocket();
-
-    if (retval == 0) {
-        retval = VSFTPServerSendReply("226 Transfer Complete.");
+    VSFTPServerCloseTransferFile(session);
+    (void)VSFTPServerCloseTransferClientSocket(session);
+    (void)VSFTPServerCloseTransferSocket(session);
+
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "226 Transfer Complete.");
+    } else if (state->retval == ECANCELED) {
+        state->retval = VSFTP_SEND_REPLY(session, "426 Connection closed; transfer aborted.");
+    } else if (state->retval == ETIMEDOUT) {
+        state->retval = VSFTP_SEND_REPLY(session, "425 Cannot open data connection.");
+    } else if (state->isFileError == true) {
+        state->retval = VSFTP_SEND_REPLY(session, "551 File not found.");
+    } else if (state->isRangeError == true) {
+        state->retval = VSFTP_SEND_REPLY(session, "554 Requested action not taken: invalid REST parameter.");
     } else {
-        retval = VSFTPServerSendReply(isFileError == true ? fileNotFound : localError);
+        state->retval = VSFTP_SEND_REPLY(session, REPLY_LOCAL_ERROR);
     }
 
-    return retval;
+    COROUTINE_END(&state->coroutine);
+
+    return state->retval;
 }
 
-static int CommandHandlerSize(const char *args, size_t len)
+/*!
+ * \brief Resolve the requested file and get its size.
+ * \details
+ *      Blocking, runs on an offload thread.
+ * \param session
+ *      The session that runs SIZE.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkSize(vsftpSession_s *session)
 {
-    int retval = -1;
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
     char realPath[PATH_LEN_MAX];
     size_t realPathLen = 0;
     struct stat filestats;
-    const char *fileNotFound = "550 File not found.";
-    const char *localError = "451 Requested action aborted: Local error in processing.";
-    bool isFileError = false;
-
-    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+    int retval = -1;
 
-    if (len > 0) {
-        retval = 0;
-    }
+    retval = VSFTPServerServerPathToRealPath(session, state->args, state->argsLen, realPath, sizeof(realPath),
+                                             &realPathLen);
 
     if (retval == 0) {
-        retval = VSFTPServerServerPathToRealPath(args, len, realPath, sizeof(realPath), &realPathLen);
-        if (retval != 0) {
-            isFileError = true;
-        }
+        retval = VSFTPFilesystemIsFile(realPath, realPathLen);
     }
 
-    if (retval == 0) {
-        retval = VSFTPFilesystemIsFile(realPath, realPathLen);
-        if (retval != 0) {
-            isFileError = true;
-        }
+    if (retval != 0) {
+        state->isFileError = true;
     }
 
     if (retval == 0) {
@@ -384,39 +603,126 @@ static int CommandHandlerSize(const char *args, size_t len)
     }
 
     if (retval == 0) {
-        retval = VSFTPServerSendReply("213 %llu", (unsigned long long int)filestats.st_size);
-    } else {
-        retval = VSFTPServerSendReply(isFileError == true ? fileNotFound : localError);
+        state->fileSize = filestats.st_size;
     }
 
     return retval;
 }
 
-static int CommandHandlerType(const char *args, size_t len)
+static int CommandHandlerSize(vsftpSession_s *session, const char *args, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+
+    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+    (void)args;
+
+    COROUTINE_BEGIN(&state->coroutine);
+
+    state->retval = -1;
+    state->isFileError = false;
+
+    if (len > 0) {
+        state->retval = VSFTPServerOffload(session, WorkSize);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
+        }
+    }
+
+    if (state->retval == 0) {
+        state->retval = VSFTPServerSendReply(session, "213 %llu", (unsigned long long int)state->fileSize);
+    } else if (state->isFileError == true) {
+        state->retval = VSFTP_SEND_REPLY(session, "550 File not found.");
+    } else {
+        state->retval = VSFTP_SEND_REPLY(session, REPLY_LOCAL_ERROR);
+    }
+
+    COROUTINE_END(&state->coroutine);
+
+    return state->retval;
+}
+
+static int CommandHandlerType(vsftpSession_s *session, const char *args, size_t len)
 {
     int retval = -1;
 
     if ((len == 1) && ((args[0] == 'I') || (args[0] == 'i'))) {
-        retval = VSFTPServerSendReply("200 Switching to Binary mode.");
+        retval = VSFTP_SEND_REPLY(session, "200 Switching to Binary mode.");
         if (retval == 0) {
-            retval = VSFTPServerSetTransferMode(true);
+            retval = VSFTPServerSetTransferMode(session, true);
         }
     } else if ((len == 1) && ((args[0] == 'A') || (args[0] == 'a'))) {
         /* Type A must be always accepted according to RFC, but we do not support it. */
-        retval = VSFTPServerSendReply("200 Switching to ASCII mode.");
+        retval = VSFTP_SEND_REPLY(session, "200 Switching to ASCII mode.");
         if (retval == 0) {
-            retval = VSFTPServerSetTransferMode(false);
+            retval = VSFTPServerSetTransferMode(session, false);
+        }
+    } else {
+        retval = VSFTP_SEND_REPLY(session, "504 Command not implemented for that parameter.");
+    }
+
+    return retval;
+}
+
+static int CommandHandlerHelp(vsftpSession_s *session, const char *args, size_t len)
+{
+    /* args and len not used. */
+    (void)args;
+    (void)len;
+
+    return VSFTP_SEND_REPLY(session, "214-The following commands are recognized.\r\n" FTP_COMMANDS(HELP_VERB)
+                            "\r\n214 Help OK.");
+}
+
+static int CommandHandlerQuit(vsftpSession_s *session, const char *args, size_t len)
+{
+    /* args and len not used. */
+    (void)args;
+    (void)len;
+
+    return VSFTP_SEND_REPLY(session, "221 Bye.");
+}
+
+static int CommandHandlerNoop(vsftpSession_s *session, const char *args, size_t len)
+{
+    /* args and len not used. */
+    (void)args;
+    (void)len;
+
+    return VSFTP_SEND_REPLY(session, "200 NOOP ok.");
+}
+
+static int CommandHandlerAbor(vsftpSession_s *session, const char *args, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    int retval = -1;
+
+    /* args and len not used. */
+    (void)args;
+    (void)len;
+
+    if (COROUTINE_IS_RUNNING(&state->coroutine) == true) {
+        /* Close the data connection and let the transfer command reply (426) before we do. */
+        retval = VSFTPServerAbortTransfer(session);
+        if ((retval == 0) && (VSFTPCommandsResume(session) == COROUTINE_YIELDED)) {
+            /* The command waits for a job on another thread, it replies once that is back. */
+            state->isAbortReplyPending = true;
+        } else if (retval == 0) {
+            retval = VSFTP_SEND_REPLY(session, "226 Abort successful.");
         }
     } else {
-        retval = VSFTPServerSendReply("504 Command not implemented for that parameter.");
+        retval = VSFTP_SEND_REPLY(session, "225 No transfer to abort.");
     }
 
     return retval;
 }
 
-static int CommandHandlerHelp(const char *args, size_t len)
+static int CommandHandlerStat(vsftpSession_s *session, const char *args, size_t len)
 {
-    char buf[HELP_LEN_MAX];
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    char buf[RESPONSE_LEN_MAX];
+    size_t sent = 0;
+    size_t size = 0;
     int written = 0;
     int retval = -1;
 
@@ -424,68 +730,597 @@ static int CommandHandlerHelp(const char *args, size_t len)
     (void)args;
     (void)len;
 
-    written = snprintf(buf, sizeof(buf), "214-The following commands are recognized.\r\n");
-    if ((written >= 0) && ((size_t)written < sizeof(buf))) {
-        retval = 0;
+    if (VSFTPServerGetTransferProgress(session, &sent, &size) == 0) {
+        written = snprintf(buf, sizeof(buf), "211-Status of vs-ftp:\r\n Transferring, %llu of %llu bytes sent.\r\n"
+                           "211 End of status.", (unsigned long long)sent, (unsigned long long)size);
+        if ((written >= 0) && ((size_t)written < sizeof(buf))) {
+            retval = VSFTPServerSendReplyOwnBuf(session, buf, sizeof(buf), (size_t)written);
+        }
+    } else if (COROUTINE_IS_RUNNING(&state->coroutine) == true) {
+        retval = VSFTP_SEND_REPLY(session, "211-Status of vs-ftp:\r\n Transfer in progress.\r\n211 End of status.");
+    } else {
+        retval = VSFTP_SEND_REPLY(session, "211-Status of vs-ftp:\r\n Connected, no transfer in progress.\r\n"
+                                  "211 End of status.");
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get the next path of the SITE MSTAT arguments.
+ * \details
+ *      The paths are separated by spaces. Without paths the current directory is listed, as "." of which the entries
+ *      are listed by their name only.
+ * \param state
+ *      The state of the command, 'argsOffset' is moved past the path.
+ * \param[out] path
+ *      A pointer to the storage location for the path, it is not terminated.
+ * \param[out] pathLen
+ *      A pointer to the storage location for the length of 'path'.
+ * \returns true when there is a next path or false when all paths are listed.
+ */
+static bool NextMstatPath(vsftpCommandState_s *state, const char **path, size_t *pathLen)
+{
+    static const char currentDir[] = ".";
+    size_t start = 0;
+    bool isFound = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if (state->prependDir == false) {
+        /* 'argsOffset' only counts the current directory then. */
+        if (state->argsOffset == 0) {
+            *path = currentDir;
+            *pathLen = STRLEN(currentDir);
+            state->argsOffset = 1;
+            isFound = true;
+        }
+    } else {
+        while ((state->argsOffset < state->argsLen) && (state->args[state->argsOffset] == ' ')) {
+            state->argsOffset++;
+        }
+
+        start = state->argsOffset;
+        while ((state->argsOffset < state->argsLen) && (state->args[state->argsOffset] != ' ')) {
+            state->argsOffset++;
+        }
+
+        if (state->argsOffset > start) {
+            *path = &state->args[start];
+            *pathLen = state->argsOffset - start;
+            isFound = true;
+        }
+    }
+
+    return isFound;
+}
+
+/*!
+ * \brief Format the SITE MSTAT line of a file or directory.
+ * \details
+ *      The line holds the facts like MLSD does (RFC 3659), followed by the directory being listed (if any) and the
+ *      name: "type=file;size=1024;modify=20200101120000; dir/name".
+ * \param state
+ *      The state of the command, the line is formatted in 'line'.
+ * \param name
+ *      The name of the entry, or the path as given by the client.
+ * \param nameLen
+ *      The length of 'name'.
+ * \param st
+ *      The status of the entry.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int FormatMstatLine(vsftpCommandState_s *state, const char *name, const size_t nameLen, const struct stat *st)
+{
+    const char *type = "other";
+    const char *separator = "";
+    char modify[sizeof("YYYYMMDDHHMMSS")];
+    struct tm tm;
+    int written = 0;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    if (S_ISREG(st->st_mode)) {
+        type = "file";
+    } else if (S_ISDIR(st->st_mode)) {
+        type = "dir";
+    }
+
+    if ((state->pathLen > 0) && (state->path[state->pathLen - 1U] != '/')) {
+        separator = "/";
+    }
+
+    if ((gmtime_r(&st->st_mtime, &tm) != NULL) && (strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm) > 0)) {
+        written = snprintf(state->line, sizeof(state->line), "type=%s;size=%llu;modify=%s; %.*s%s%.*s\r\n", type,
+                           (unsigned long long)st->st_size, modify, (int)state->pathLen, state->path, separator,
+                           (int)nameLen, name);
+        if ((written >= 0) && ((size_t)written < sizeof(state->line))) {
+            state->lineLen = (size_t)written;
+            retval = 0;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Start listing a path of SITE MSTAT.
+ * \details
+ *      Blocking, runs on an offload thread. A file gets its line right away, a directory is opened so that its entries
+ *      are listed next. Paths that do not exist or are above the root path are left out of the listing.
+ * \param session
+ *      The session that runs SITE MSTAT.
+ * \param path
+ *      The path as given by the client.
+ * \param pathLen
+ *      The length of 'path'.
+ */
+static void StatMstatPath(vsftpSession_s *session, const char *path, const size_t pathLen)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    char serverPath[PATH_LEN_MAX];
+    char realPath[PATH_LEN_MAX];
+    size_t realPathLen = 0;
+    struct stat st;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    state->pathLen = 0;
+
+    if (pathLen < sizeof(serverPath)) {
+        (void)memcpy(serverPath, path, pathLen);
+        serverPath[pathLen] = '\0';
+        retval = VSFTPServerServerPathToRealPath(session, serverPath, pathLen, realPath, sizeof(realPath),
+                                                 &realPathLen);
     }
 
+    /* Make sure the path is not above the root path. */
     if (retval == 0) {
-        for (unsigned long i = 0; i < DIM(commands); i++) {
-            written += snprintf(&buf[written], sizeof(buf) - written, " %s", commands[i].name);
-            if ((written < 0) || ((size_t)written >= sizeof(buf))) {
-                retval = -1;
-                break;
+        retval = VSFTPServerAbsPathIsNotAboveRootPath(realPath, realPathLen);
+    }
+
+    if (retval == 0) {
+        retval = VSFTPFilesystemStat(realPath, realPathLen, &st);
+    }
+
+    if ((retval == 0) && (S_ISDIR(st.st_mode))) {
+        retval = VSFTPFilesystemOpenDir(realPath, realPathLen, &state->dirCookie);
+        if ((retval == 0) && (state->prependDir == true)) {
+            /* Its entries are listed as the path given. */
+            (void)memcpy(state->path, path, pathLen);
+            state->pathLen = pathLen;
+        }
+    } else if (retval == 0) {
+        (void)FormatMstatLine(state, path, pathLen, &st);
+    }
+}
+
+/*!
+ * \brief Read the next part of the SITE MSTAT listing into the listing buffer.
+ * \details
+ *      Blocking, runs on an offload thread. The listing is empty once all paths have been listed.
+ * \param session
+ *      The session that runs SITE MSTAT.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkMstatRead(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    char name[PATH_LEN_MAX];
+    size_t nameLen = 0;
+    const char *path = NULL;
+    size_t pathLen = 0;
+    struct stat st;
+    int retval = 0;
+
+    state->listingLen = 0;
+
+    /* The entry that did not fit in the previous part goes first. */
+    if (state->lineLen > 0) {
+        (void)memcpy(state->listing, state->line, state->lineLen);
+        state->listingLen = state->lineLen;
+        state->lineLen = 0;
+    }
+
+    while ((retval == 0) && (state->isEndOfDir == false) && (state->lineLen == 0)) {
+        if (state->dirCookie != NULL) {
+            retval = VSFTPFilesystemStatDirEntry(&state->dirCookie, name, sizeof(name), &nameLen, &st);
+            if ((retval == 0) && (state->dirCookie != NULL) && (FormatMstatLine(state, name, nameLen, &st) != 0)) {
+                /* Like a path that can not be listed, the entry is left out instead of failing the listing. */
+                FTPLOG("SITE MSTAT leaves out %.*s/%.*s, it does not fit in a line\n", (int)state->pathLen,
+                       state->path, (int)nameLen, name);
             }
+        } else if (NextMstatPath(state, &path, &pathLen) == true) {
+            StatMstatPath(session, path, pathLen);
+        } else {
+            state->isEndOfDir = true;
         }
+
+        if ((retval == 0) && (state->lineLen <= (sizeof(state->listing) - state->listingLen))) {
+            (void)memcpy(&state->listing[state->listingLen], state->line, state->lineLen);
+            state->listingLen += state->lineLen;
+            state->lineLen = 0;
+        } /* Else: keep it for the next part. */
     }
 
-    if (retval == 0) {
-        written += snprintf(&buf[written], sizeof(buf) - written, "\r\n214 Help OK.");
-        if ((written < 0) || ((size_t)written >= sizeof(buf))) {
-            retval = -1;
+    return retval;
+}
+
+/*!
+ * \brief Parse a byte offset.
+ * \param buffer
+ *      The text, the offset is at its start.
+ * \param len
+ *      The length of 'buffer'.
+ * \param[out] offset
+ *      A pointer to the storage location for the offset.
+ * \returns The number of digits parsed, 0 when 'buffer' does not start with an offset or it does not fit.
+ */
+static size_t ParseOffset(const char *buffer, const size_t len, uint64_t *offset)
+{
+    size_t i = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    *offset = 0;
+    while ((i < len) && (buffer[i] >= '0') && (buffer[i] <= '9')) {
+        if (*offset > ((UINT64_MAX - (uint64_t)(buffer[i] - '0')) / 10U)) {
+            i = 0;
+            break;
         }
+        *offset = (*offset * 10U) + (uint64_t)(buffer[i] - '0');
+        i++;
+    }
+
+    return i;
+}
+
+static int CommandHandlerRest(vsftpSession_s *session, const char *args, size_t len)
+{
+    uint64_t offset = 0;
+    int retval = -1;
+
+    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. */
+
+    if ((len > 0) && (ParseOffset(args, len, &offset) == len)) {
+        /* Replaces a range of RANG. */
+        retval = VSFTPServerSetTransferRange(session, offset, UINT64_MAX);
     }
 
     if (retval == 0) {
-        retval = VSFTPServerSendReplyOwnBuf(buf, sizeof(buf), (size_t)written);
+        retval = VSFTPServerSendReply(session, "350 Restarting at %llu. Send STORE or RETRIEVE to initiate transfer.",
+                                      (unsigned long long)offset);
+    } else {
+        retval = VSFTP_SEND_REPLY(session, "501 Syntax error in parameters or arguments.");
     }
 
     return retval;
 }
 
-static int CommandHandlerQuit(const char *args, size_t len)
+static int CommandHandlerRang(vsftpSession_s *session, const char *args, size_t len)
+{
+    uint64_t start = 0;
+    uint64_t end = 0;
+    size_t used = 0;
+    int retval = -1;
+
+    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. Both bytes of the range are included. */
+
+    used = ParseOffset(args, len, &start);
+    if ((used > 0) && (used < len) && (args[used] == ' ') &&
+        (ParseOffset(&args[used + 1U], len - used - 1U, &end) == (len - used - 1U)) && (len > (used + 1U))) {
+        retval = 0;
+    }
+
+    if ((retval == 0) && (start == 1) && (end == 0)) {
+        /* "RANG 1 0" resets the range. */
+        (void)VSFTPServerSetTransferRange(session, 0, UINT64_MAX);
+        retval = VSFTP_SEND_REPLY(session, "350 Resetting RANG.");
+    } else if ((retval == 0) && (VSFTPServerSetTransferRange(session, start, end) == 0)) {
+        retval = VSFTPServerSendReply(session, "350 Restarting at %llu. End byte range at %llu.",
+                                      (unsigned long long)start, (unsigned long long)end);
+    } else {
+        retval = VSFTP_SEND_REPLY(session, "501 Syntax error in parameters or arguments.");
+    }
+
+    return retval;
+}
+
+static int CommandHandlerFeat(vsftpSession_s *session, const char *args, size_t len)
 {
     /* args and len not used. */
     (void)args;
     (void)len;
 
-    return VSFTPServerSendReply("221 Bye.");
+    return VSFTP_SEND_REPLY(session, "211-Features:\r\n SIZE\r\n REST STREAM\r\n RANG STREAM\r\n211 End");
 }
 
-int VSFTPCommandsParse(const char *buffer, size_t len)
+static int CommandHandlerSite(vsftpSession_s *session, const char *args, size_t len)
 {
-    bool commandFound = false;
-    int retval = ENOTSUP;
+    const char mstat[] = "MSTAT";
+    int retval = -1;
 
-    for (unsigned long i = 0; i < DIM(commands); i++) {
-        if (strncmp(buffer, commands[i].name, commands[i].nameLen) == 0) {
-            if (len > commands[i].nameLen) {
-                /* Commands and their arguments are separated by a ' ', pass the handler the argument. */
-                retval = commands[i].handle(&buffer[commands[i].nameLen + 1], len - commands[i].nameLen - 1);
-            } else {
-                retval = commands[i].handle(NULL, 0);
-            }
+    /* (args != NULL) when len > 0 is guaranteed by caller, len may be 0. The command is dispatched again when it is
+     * resumed, with the same arguments.
+     */
+    if ((len >= STRLEN(mstat)) && (strncasecmp(args, mstat, STRLEN(mstat)) == 0) &&
+        ((len == STRLEN(mstat)) || (args[STRLEN(mstat)] == ' '))) {
+        retval = CommandHandlerSiteMstat(session, args, len);
+    } else {
+        retval = VSFTP_SEND_REPLY(session, "504 Command not implemented for that parameter.");
+    }
+
+    return retval;
+}
+
+static int CommandHandlerSiteMstat(vsftpSession_s *session, const char *args, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    const char mstat[] = "MSTAT";
+
+    /* args holds "MSTAT" followed by the paths, if any. */
+    (void)args;
+
+    COROUTINE_BEGIN(&state->coroutine);
+
+    state->dirCookie = NULL;
+    state->isEndOfDir = false;
+    state->lineLen = 0;
+    state->pathLen = 0;
+    state->argsOffset = STRLEN(mstat);
+    while ((state->argsOffset < len) && (state->args[state->argsOffset] == ' ')) {
+        state->argsOffset++;
+    }
+    state->prependDir = (state->argsOffset < len);
+    if (state->prependDir == false) {
+        state->argsOffset = 0;
+    }
+
+    /* Wait for the client to connect. */
+    state->retval = VSFTPServerAcceptTransferClientConnection(session);
+    while (state->retval == EAGAIN) {
+        COROUTINE_YIELD(&state->coroutine);
+        state->retval = VSFTPServerAcceptTransferClientConnection(session);
+    }
 
-            commandFound = true;
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "150 Here comes the metadata listing.");
+    }
+
+    /* Stat all paths, a buffer full at a time. */
+    while (state->retval == 0) {
+        state->retval = VSFTPServerOffload(session, WorkMstatRead);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerGetOffloadResult(session);
+        }
+
+        if ((state->retval != 0) || (state->listingLen == 0)) {
+            /* Error or all paths listed. */
             break;
         }
+
+        state->listingSent = 0;
+        state->retval = VSFTPServerSendTransfer(session, state->listing, state->listingLen, &state->listingSent);
+        while (state->retval == EAGAIN) {
+            COROUTINE_YIELD(&state->coroutine);
+            state->retval = VSFTPServerSendTransfer(session, state->listing, state->listingLen,
+                                                    &state->listingSent);
+        }
+    }
+
+    VSFTPFilesystemListDirClose(&state->dirCookie);
+    (void)VSFTPServerCloseTransferClientSocket(session);
+    (void)VSFTPServerCloseTransferSocket(session);
+
+    if (state->retval == 0) {
+        state->retval = VSFTP_SEND_REPLY(session, "226 Metadata send OK.");
+    } else if (state->retval == ECANCELED) {
+        state->retval = VSFTP_SEND_REPLY(session, "426 Connection closed; transfer aborted.");
+    } else if (state->retval == ETIMEDOUT) {
+        state->retval = VSFTP_SEND_REPLY(session, "425 Cannot open data connection.");
+    } else {
+        state->retval = VSFTP_SEND_REPLY(session, REPLY_LOCAL_ERROR);
+    }
+
+    COROUTINE_END(&state->coroutine);
+
+    return state->retval;
+}
+
+/*!
+ * \brief Skip the Telnet commands at the start of a received command.
+ * \details
+ *      F.e. the Interrupt Process and Synch that precede ABOR.
+ * \param[in,out] buffer
+ *      A pointer to the received command, it is moved past the Telnet commands.
+ * \param[in,out] len
+ *      A pointer to the length of the received command, it is reduced by the Telnet commands.
+ */
+static void SkipTelnetCommands(const char **buffer, size_t *len)
+{
+    /* Argument checks are performed by the caller. */
+
+    while ((*len >= 2) && ((*buffer)[0] == TELNET_IAC)) {
+        *buffer += 2;
+        *len -= 2;
+    }
+}
+
+/*!
+ * \brief Find the command of a received command line.
+ * \details
+ *      The verb must be followed by a space or the end of the line, f.e. "PWDX" is not PWD. The verb is case folded
+ *      into its key (see VERB_KEY()), which is dispatched with a switch that is generated from FTP_COMMANDS(). The
+ *      compiler turns it into a jump table or a binary search, and refuses verbs that are in the list twice.
+ * \param buffer
+ *      The received command, without Telnet commands and \r\n.
+ * \param len
+ *      The length of 'buffer'.
+ * \returns The command, or NULL when the verb is not implemented.
+ */
+static const Command_s *FindCommand(const char *buffer, const size_t len)
+{
+    const Command_s *command = NULL;
+    uint32_t key = 0;
+    size_t verbLen = 0;
+    char letter = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    while ((verbLen < len) && (verbLen <= VERB_LEN_MAX) && (buffer[verbLen] != ' ')) {
+        verbLen++;
+    }
+
+    if ((verbLen >= VERB_LEN_MIN) && (verbLen <= VERB_LEN_MAX)) {
+        for (size_t i = 0; i < VERB_LEN_MAX; i++) {
+            letter = (i < verbLen) ? buffer[i] : '\0';
+            if ((letter >= 'a') && (letter <= 'z')) {
+                letter = (char)(letter - 'a' + 'A');
+            }
+            key = (key << 8U) | (uint8_t)letter;
+        }
+
+#define COMMAND_CASE(_verb, _a, _b, _c, _d, ...) \
+        case VERB_KEY(_a, _b, _c, _d): command = &commands[COMMAND_ID_##_verb]; break;
+
+        switch (key) {
+            FTP_COMMANDS(COMMAND_CASE)
+            default:
+                break;
+        }
+
+#undef COMMAND_CASE
+    }
+
+    return command;
+}
+
+/*!
+ * \brief Check if a received command can be handled now.
+ * \details
+ *      While a command is in progress, only the commands that do not interfere with it (f.e. ABOR) are handled right
+ *      away. The others have to wait until it is done, so pipelined commands are handled (and replied to) in order.
+ * \param session
+ *      The session the command was received on.
+ * \param buffer
+ *      The received command, without \r\n.
+ * \param len
+ *      The length of 'buffer'.
+ * \returns true if the command can be handled now, false if it has to wait (or in case of an error).
+ */
+bool VSFTPCommandsIsRunnable(vsftpSession_s *session, const char *buffer, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    const Command_s *command = NULL;
+    bool isRunnable = false;
+
+    if ((state != NULL) && (buffer != NULL)) {
+        isRunnable = (state->handle == NULL);
     }
 
-    if (commandFound == false) {
+    if ((state != NULL) && (buffer != NULL) && (isRunnable == false)) {
+        SkipTelnetCommands(&buffer, &len);
+        command = FindCommand(buffer, len);
+        isRunnable = (command != NULL) && (command->isAllowedDuringTransfer == true);
+    }
+
+    return isRunnable;
+}
+
+/*!
+ * \brief Parse a received command and run its handler.
+ * \param session
+ *      The session the command was received on.
+ * \param buffer
+ *      The received command, without \r\n.
+ * \param len
+ *      The length of 'buffer'.
+ * \returns 0 in case of successful completion, COROUTINE_YIELDED in case the handler yielded (see
+ *      VSFTPCommandsResume()) or any other value in case of an error.
+ */
+int VSFTPCommandsParse(vsftpSession_s *session, const char *buffer, size_t len)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    const Command_s *command = NULL;
+    int retval = ENOTSUP;
+
+    SkipTelnetCommands(&buffer, &len);
+    command = FindCommand(buffer, len);
+
+    if (command == NULL) {
         /* If a command was not found, the return value should be -1. Do not overwrite this with the following call. */
-        (void)VSFTPServerSendReply("502 Command not implemented.");
+        (void)VSFTP_SEND_REPLY(session, "502 Command not implemented.");
+    } else if (state->handle != NULL) {
+        /* Another command is in progress, only commands that do not interfere with it are handled. */
+        if (command->isAllowedDuringTransfer == true) {
+            retval = command->handle(session, NULL, 0);
+        } else {
+            retval = VSFTP_SEND_REPLY(session, "503 Transfer in progress, command not allowed.");
+        }
+    } else {
+        COROUTINE_RESET(&state->coroutine);
+        state->handle = command->handle;
+        state->isAbortReplyPending = false;
+        state->argsLen = 0;
+
+        if (len > command->nameLen) {
+            /* Commands and their arguments are separated by a ' ', the handler gets a copy of the argument that
+             * remains valid while it yields.
+             */
+            state->argsLen = len - command->nameLen - 1;
+            (void)memcpy(state->args, &buffer[command->nameLen + 1], state->argsLen);
+        }
+        state->args[state->argsLen] = '\0';
+
+        retval = VSFTPCommandsResume(session);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Continue the command handler of a session that yielded.
+ * \param session
+ *      The session with the command in progress.
+ * \returns 0 in case of successful completion, COROUTINE_YIELDED in case the handler yielded again or any other
+ *      value in case of an error.
+ */
+int VSFTPCommandsResume(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+    int retval = -1;
+
+    if ((state != NULL) && (state->handle != NULL)) {
+        retval = state->handle(session, (state->argsLen > 0) ? state->args : NULL, state->argsLen);
+        if (retval != COROUTINE_YIELDED) {
+            state->handle = NULL;
+        }
+
+        if ((retval != COROUTINE_YIELDED) && (state->isAbortReplyPending == true)) {
+            /* The aborted command has replied, now the ABOR that was received meanwhile. */
+            state->isAbortReplyPending = false;
+            (void)VSFTP_SEND_REPLY(session, "226 Abort successful.");
+        }
     }
 
     return retval;
 }
 
+/*!
+ * \brief Release the resources of the command in progress of a session, if any.
+ * \param session
+ *      The session that is being disconnected.
+ */
+void VSFTPCommandsCleanup(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = VSFTPServerGetCommandState(session);
+
+    if ((state != NULL) && (COROUTINE_IS_RUNNING(&state->coroutine) == true)) {
+        VSFTPFilesystemListDirClose(&state->dirCookie);
+        COROUTINE_RESET(&state->coroutine);
+        state->handle = NULL;
+    }
+}
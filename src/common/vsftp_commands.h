@@ -17,7 +17,51 @@
 #ifndef VSFTP_COMMANDS_H__
 #define VSFTP_COMMANDS_H__
 
-extern int VSFTPCommandsParse(const char *buffer, size_t len);
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "vsftp_server.h"
+#include "vsftp_coroutine.h"
+#include "config.h"
+
+typedef int (* CommandHandle)(vsftpSession_s *session, const char *args, size_t len);
+
+/* The state of the command in progress of a session.
+ * Command handlers are coroutines, everything they need after a yield is kept here. While a handler waits for an
+ * offloaded job (see VSFTPServerOffload()) the job owns this state.
+ */
+struct vsftpCommandState_s {
+    vsftpCoroutine_s coroutine;
+    CommandHandle handle;
+    char args[REQUEST_LEN_MAX];
+    size_t argsLen;
+    int retval;
+    bool isFileError;
+    bool isRangeError;          /* RETR: the restart offset lies beyond the end of the file. */
+    bool isAbortReplyPending;
+    off_t fileSize;
+
+    /* Directory listing. */
+    char path[PATH_LEN_MAX];
+    size_t pathLen;
+    bool prependDir;
+    void *dirCookie;
+    bool isEndOfDir;
+    char line[MSTAT_FACTS_LEN_MAX + PATH_LEN_MAX + 2U]; /* Including \r\n, an entry that did not fit in 'listing'
+                                                         * anymore. */
+    size_t lineLen;
+    char listing[LISTING_BUF_SIZE];
+    size_t listingLen;
+    size_t listingSent;
+    size_t argsOffset;          /* SITE MSTAT: the next path in 'args' to list. */
+};
+
+typedef struct vsftpCommandState_s vsftpCommandState_s;
+
+extern bool VSFTPCommandsIsRunnable(vsftpSession_s *session, const char *buffer, size_t len);
+extern int VSFTPCommandsParse(vsftpSession_s *session, const char *buffer, size_t len);
+extern int VSFTPCommandsResume(vsftpSession_s *session);
+extern void VSFTPCommandsCleanup(vsftpSession_s *session);
 
 #endif /* VSFTP_COMMANDS_H__ */
 
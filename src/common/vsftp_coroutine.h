@@ -0,0 +1,64 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_COROUTINE_H__
+#define VSFTP_COROUTINE_H__
+
+#include <errno.h>
+
+/*
+ * Stackless (protothread style) coroutines.
+ *
+ * A coroutine is a function that returns COROUTINE_YIELDED when it cannot continue without blocking. The scheduler
+ * calls it again once it can continue, and execution resumes right after the COROUTINE_YIELD() it returned from.
+ * Only the resume point is saved, so local variables do not survive a yield. Anything that has to, must be kept in
+ * storage that outlives the call (f.e. the session). A coroutine must not use 'switch' statements itself, since the
+ * resume point is implemented as a case label.
+ *
+ * int Handler(vsftpCoroutine_s *cr, ...)
+ * {
+ *     COROUTINE_BEGIN(cr);
+ *     while (WouldBlock() == true) {
+ *         COROUTINE_YIELD(cr);
+ *     }
+ *     COROUTINE_END(cr);
+ *
+ *     return 0;
+ * }
+ */
+
+/* The value a coroutine returns when it yields. */
+#define COROUTINE_YIELDED       EINPROGRESS
+
+typedef struct {
+    unsigned int resumePoint;   /* 0 when the coroutine is not started or has run to completion. */
+} vsftpCoroutine_s;
+
+#define COROUTINE_RESET(_cr)        do { (_cr)->resumePoint = 0U; } while (0)
+
+#define COROUTINE_IS_RUNNING(_cr)   ((_cr)->resumePoint != 0U)
+
+#define COROUTINE_BEGIN(_cr)        switch ((_cr)->resumePoint) { case 0U:
+
+#define COROUTINE_YIELD(_cr)        do {                                        \
+                                        (_cr)->resumePoint = __LINE__;          \
+                                        return COROUTINE_YIELDED;               \
+                                        case __LINE__:;                         \
+                                    } while (0)
+
+#define COROUTINE_END(_cr)          } COROUTINE_RESET(_cr)
+
+#endif /* VSFTP_COROUTINE_H__ */
@@ -23,11 +23,36 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "config.h"
 #include "vsftp_filesystem.h"
 
+/* A file that is open for one or more transfers, f.e. the segments of a file that a client downloads over several
+ * connections at once. A 'users' of 0 marks a free entry.
+ */
+typedef struct {
+    vsftpFileId_s id;
+    int fd;
+    unsigned int users;
+} vsftpOpenFile_s;
+
+/* The files open for transfers, shared by all workers and offload threads.
+ * Open addressing with linear probing on the device and inode. The table is twice the size of the session slab and a
+ * session has one transfer at a time, so it never fills up.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    vsftpOpenFile_s entries[OPEN_FILE_TABLE_LEN];
+    vsftpOpenFileStatistics_s statistics;
+} vsftpOpenFileTable_s;
+
+static vsftpOpenFileTable_s openFiles = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
 static int ConcatCwdAndPath(const char *cwd, size_t cwdLen, const char *path, size_t pathLen,
                             char *concatPath, size_t size, size_t *concatPathLen);
+static size_t HashFileId(const vsftpFileId_s *id);
+static size_t FindOpenFile(const vsftpFileId_s *id);
+static void RemoveOpenFile(size_t i);
 
 /*!
  * \brief Concatenate 'cwd' and 'path'.
@@ -165,6 +190,125 @@ int VSFTPFilesystemListDirPerLine(const char *path, size_t pathLen, char *buf, s
     return retval;
 }
 
+/*!
+ * \brief Stop iterating through a directory before all files/directories have been passed.
+ * \param[in,out] cookie
+ *      A pointer to a pointer to a storage location indicating where in the directory listing we were.
+ *      It is set to NULL.
+ */
+void VSFTPFilesystemListDirClose(void **cookie)
+{
+    if ((cookie != NULL) && (*cookie != NULL)) {
+        (void)closedir(*cookie);
+        *cookie = NULL;
+    }
+}
+
+/*!
+ * \brief Open a directory to iterate through its entries with VSFTPFilesystemStatDirEntry().
+ * \param dir
+ *      The path of the directory.
+ * \param dirLen
+ *      The length of 'dir'.
+ * \param[out] cookie
+ *      A pointer to a pointer to a storage location indicating where in the directory we are, close it with
+ *      VSFTPFilesystemListDirClose() when not all entries are passed.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPFilesystemOpenDir(const char *dir, const size_t dirLen, void **cookie)
+{
+    int retval = -1;
+
+    if ((dir != NULL) && (dirLen > 0) && (cookie != NULL)) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        *cookie = opendir(dir);
+        if (*cookie == NULL) {
+            retval = -1;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get the name and the status of the next entry of a directory.
+ * \details
+ *      The entry is stat'ed relative to the directory (fstatat()), so its path is not resolved again. Symbolic links
+ *      are not followed, '.', '..' and entries that vanished meanwhile are skipped.
+ * \param[in,out] cookie
+ *      A pointer to a pointer to a storage location indicating where in the directory we are, see
+ *      VSFTPFilesystemOpenDir(). It is set to NULL when all entries have been passed.
+ * \param[out] name
+ *      A pointer to the storage location for the name of the entry.
+ * \param size
+ *      The size of 'name'.
+ * \param[out] nameLen
+ *      A pointer to the storage location for the length of 'name'.
+ * \param[out] st
+ *      A pointer to the storage location for the status of the entry.
+ * \returns 0 in case of successful (partial) completion or any other value in case of an error.
+ */
+int VSFTPFilesystemStatDirEntry(void **cookie, char *name, const size_t size, size_t *nameLen, struct stat *st)
+{
+    struct dirent *ldir = NULL;
+    size_t len = 0;
+    int retval = -1;
+    DIR *d = NULL;
+
+    if ((cookie != NULL) && (*cookie != NULL) && (name != NULL) && (size > 0) && (nameLen != NULL) &&
+        (st != NULL)) {
+        d = *cookie;
+        retval = 0;
+    }
+
+    while ((retval == 0) && ((ldir = readdir(d)) != NULL)) {
+        if ((strcmp(ldir->d_name, ".") == 0) || (strcmp(ldir->d_name, "..") == 0) ||
+            (fstatat(dirfd(d), ldir->d_name, st, AT_SYMLINK_NOFOLLOW) != 0)) {
+            continue;
+        }
+
+        len = strlen(ldir->d_name);
+        if (len < size) {
+            (void)memcpy(name, ldir->d_name, len + 1U);
+            *nameLen = len;
+        } else {
+            /* name too small to contain the entry. */
+            retval = -1;
+        }
+        break;
+    }
+
+    if ((retval != 0) || (ldir == NULL)) {
+        VSFTPFilesystemListDirClose(cookie);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get the status of a file or directory.
+ * \param path
+ *      The path to get the status of.
+ * \param pathLen
+ *      The length of 'path'.
+ * \param[out] st
+ *      A pointer to the storage location for the status.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPFilesystemStat(const char *path, const size_t pathLen, struct stat *st)
+{
+    int retval = -1;
+
+    if ((path != NULL) && (pathLen > 0) && (st != NULL)) {
+        retval = stat(path, st);
+    }
+
+    return retval;
+}
+
 /*!
  * \brief Check if the given path is a path to a directory.
  * \param dir
@@ -298,24 +442,93 @@ int VSFTPFilesystemGetRealPath(const char *cwd, const size_t cwdLen, const char
 }
 
 /*!
- * \brief Open a file.
+ * \brief Get the preferred entry of a file in the open file table.
+ * \param id
+ *      The file.
+ * \returns The index of the entry.
+ */
+static size_t HashFileId(const vsftpFileId_s *id)
+{
+    const uint32_t key = (uint32_t)id->ino ^ (uint32_t)((uint64_t)id->ino >> 32U) ^ ((uint32_t)id->dev << 16U);
+
+    /* Argument checks are performed by the caller. */
+
+    /* Fibonacci hashing, spreads neighbouring inodes over the table. */
+    return (size_t)((uint32_t)(key * 2654435761U) >> (32U - OPEN_FILE_TABLE_BITS));
+}
+
+/*!
+ * \brief Find a file in the open file table, the caller holds the mutex of the table.
+ * \param id
+ *      The file.
+ * \returns The index of the entry of the file, or of the free entry where it would be added.
+ */
+static size_t FindOpenFile(const vsftpFileId_s *id)
+{
+    size_t i = HashFileId(id);
+
+    /* Argument checks are performed by the caller. */
+
+    while ((openFiles.entries[i].users != 0) &&
+           ((openFiles.entries[i].id.dev != id->dev) || (openFiles.entries[i].id.ino != id->ino))) {
+        i = (i + 1U) & (OPEN_FILE_TABLE_LEN - 1U);
+    }
+
+    return i;
+}
+
+/*!
+ * \brief Free an entry of the open file table, the caller holds the mutex of the table.
+ * \details
+ *      The entries that follow it are moved back where needed, so every entry stays reachable from its preferred
+ *      index without gaps.
+ * \param i
+ *      The index of the entry, it must have no users left.
+ */
+static void RemoveOpenFile(size_t i)
+{
+    size_t j = (i + 1U) & (OPEN_FILE_TABLE_LEN - 1U);
+    size_t home = 0;
+
+    while (openFiles.entries[j].users != 0) {
+        home = HashFileId(&openFiles.entries[j].id);
+        /* Move the entry into the gap, unless its preferred index lies (cyclically) between the gap and itself. */
+        if (((j - home) & (OPEN_FILE_TABLE_LEN - 1U)) >= ((j - i) & (OPEN_FILE_TABLE_LEN - 1U))) {
+            openFiles.entries[i] = openFiles.entries[j];
+            openFiles.entries[j].users = 0;
+            i = j;
+        }
+        j = (j + 1U) & (OPEN_FILE_TABLE_LEN - 1U);
+    }
+}
+
+/*!
+ * \brief Open a file for reading.
+ * \details
+ *      A file that is already open (f.e. for the other segments of a parallel download) is shared: the transfers read
+ *      it at their own offset, so they can share the descriptor. It is closed once its last user closes it.
  * \param absPath
  *      The absolute path to the file, including the filename.
  *      This does not have to be a real path, symbolic links are automatically dereferenced.
  * \param absPathLen
  *      The length of 'absPath'.
  * \param[out] fd
- *      A pointer to the storage location for the file descriptor.
+ *      A pointer to the storage location for the file descriptor, it must only be used with an offset (pread(),
+ *      sendfile(), mmap()).
  * \param size
  *      The size of the opened file.
+ * \param[out] id
+ *      A pointer to the storage location for the identity of the file, for VSFTPFilesystemCloseFile().
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPFilesystemOpenFile(const char *absPath, const size_t absPathLen, int *fd, size_t *size)
+int VSFTPFilesystemOpenFile(const char *absPath, const size_t absPathLen, int *fd, size_t *size, vsftpFileId_s *id)
 {
     int retval = -1;
     struct stat stat_buf;
+    int newFd = -1;
+    size_t i = 0;
 
-    if ((absPath != NULL) && (absPathLen > 0) && (fd != NULL) && (size != NULL)) {
+    if ((absPath != NULL) && (absPathLen > 0) && (fd != NULL) && (size != NULL) && (id != NULL)) {
         retval = 0;
     }
 
@@ -324,31 +537,116 @@ int VSFTPFilesystemOpenFile(const char *absPath, const size_t absPathLen, int *f
     }
 
     if (retval == 0) {
-        *fd = open(absPath, O_RDONLY);
-        if (*fd == -1) {
-            retval = -1;
-        } else {
-            retval = fstat(*fd, &stat_buf);
-        }
+        retval = stat(absPath, &stat_buf);
     }
 
     if (retval == 0) {
+        id->dev = stat_buf.st_dev;
+        id->ino = stat_buf.st_ino;
         *size = (size_t)stat_buf.st_size;
+
+        (void)pthread_mutex_lock(&openFiles.mutex);
+        i = FindOpenFile(id);
+        if (openFiles.entries[i].users != 0) {
+            openFiles.entries[i].users++;
+            *fd = openFiles.entries[i].fd;
+            openFiles.statistics.shared++;
+            if (openFiles.entries[i].users > openFiles.statistics.usersMax) {
+                openFiles.statistics.usersMax = openFiles.entries[i].users;
+            }
+            newFd = *fd;
+        }
+        (void)pthread_mutex_unlock(&openFiles.mutex);
+    }
+
+    if ((retval == 0) && (newFd == -1)) {
+        /* Not open yet. Opened outside of the lock, the file may have been replaced meanwhile. */
+        newFd = open(absPath, O_RDONLY | O_CLOEXEC);
+        if (newFd == -1) {
+            retval = -1;
+        } else {
+            retval = fstat(newFd, &stat_buf);
+        }
+
+        if (retval == 0) {
+            id->dev = stat_buf.st_dev;
+            id->ino = stat_buf.st_ino;
+            *size = (size_t)stat_buf.st_size;
+
+            (void)pthread_mutex_lock(&openFiles.mutex);
+            i = FindOpenFile(id);
+            if (openFiles.entries[i].users == 0) {
+                openFiles.entries[i].id = *id;
+                openFiles.entries[i].fd = newFd;
+                openFiles.statistics.opened++;
+            } else {
+                /* Opened by another thread in the meantime, share that one. */
+                (void)close(newFd);
+                newFd = openFiles.entries[i].fd;
+                openFiles.statistics.shared++;
+            }
+            openFiles.entries[i].users++;
+            if (openFiles.entries[i].users > openFiles.statistics.usersMax) {
+                openFiles.statistics.usersMax = openFiles.entries[i].users;
+            }
+            (void)pthread_mutex_unlock(&openFiles.mutex);
+            *fd = newFd;
+        } else if (newFd != -1) {
+            (void)close(newFd);
+        }
     }
 
     return retval;
 }
 
 /*!
- * \brief Close a file.
+ * \brief Close a file opened with VSFTPFilesystemOpenFile().
+ * \details
+ *      The file descriptor is only closed when no other transfer uses it anymore.
  * \param fd
  *      The file descriptor.
+ * \param id
+ *      The identity of the file, as returned by VSFTPFilesystemOpenFile().
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPFilesystemCloseFile(const int fd)
+int VSFTPFilesystemCloseFile(const int fd, const vsftpFileId_s *id)
 {
-    /* Checks are performed in callee. */
+    int closeFd = -1;
+    size_t i = 0;
+    int retval = -1;
+
+    if (id != NULL) {
+        (void)pthread_mutex_lock(&openFiles.mutex);
+        i = FindOpenFile(id);
+        if ((openFiles.entries[i].users != 0) && (openFiles.entries[i].fd == fd)) {
+            openFiles.entries[i].users--;
+            if (openFiles.entries[i].users == 0) {
+                closeFd = fd;
+                RemoveOpenFile(i);
+            }
+            retval = 0;
+        }
+        (void)pthread_mutex_unlock(&openFiles.mutex);
+    }
+
+    if (closeFd != -1) {
+        retval = close(closeFd);
+    }
+
+    return retval;
+}
 
-    return close(fd);
+/*!
+ * \brief Get a snapshot of the open file statistics.
+ * \param[out] statistics
+ *      A pointer to the storage location for the statistics.
+ */
+void VSFTPFilesystemGetOpenFileStatistics(vsftpOpenFileStatistics_s *statistics)
+{
+    if (statistics != NULL) {
+        (void)pthread_mutex_lock(&openFiles.mutex);
+        *statistics = openFiles.statistics;
+        (void)pthread_mutex_unlock(&openFiles.mutex);
+    }
 }
 
@@ -18,16 +18,36 @@
 #define VSFTP_FILESYSTEM_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Identifies a file opened with VSFTPFilesystemOpenFile(), it has to be passed back to VSFTPFilesystemCloseFile(). */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} vsftpFileId_s;
+
+typedef struct {
+    uint64_t opened;            /* Files opened. */
+    uint64_t shared;            /* Opens that shared a file that was already open. */
+    unsigned int usersMax;      /* Most users of one open file at a time. */
+} vsftpOpenFileStatistics_s;
 
 extern int VSFTPFilesystemIsAbsPath(const char *path);
 extern int VSFTPFilesystemListDirPerLine(const char *path, size_t pathLen, char *buf, size_t size, size_t *bufLen,
                                          bool prependDir, void **cookie);
+extern void VSFTPFilesystemListDirClose(void **cookie);
+extern int VSFTPFilesystemOpenDir(const char *dir, size_t dirLen, void **cookie);
+extern int VSFTPFilesystemStatDirEntry(void **cookie, char *name, size_t size, size_t *nameLen, struct stat *st);
+extern int VSFTPFilesystemStat(const char *path, size_t pathLen, struct stat *st);
 extern int VSFTPFilesystemIsDir(const char *dir, size_t dirLen);
 extern int VSFTPFilesystemIsFile(const char *file, size_t fileLen);
 extern int VSFTPFilesystemGetRealPath(const char *cwd, size_t cwdLen, const char *path, size_t pathLen,
                                       char *realPath, size_t size, size_t *realPathLen);
-extern int VSFTPFilesystemOpenFile(const char *absPath, size_t absPathLen, int *fd, size_t *size);
-extern int VSFTPFilesystemCloseFile(int fd);
+extern int VSFTPFilesystemOpenFile(const char *absPath, size_t absPathLen, int *fd, size_t *size, vsftpFileId_s *id);
+extern int VSFTPFilesystemCloseFile(int fd, const vsftpFileId_s *id);
+extern void VSFTPFilesystemGetOpenFileStatistics(vsftpOpenFileStatistics_s *statistics);
 
 #endif /* VSFTP_FILESYSTEM_H__ */
 
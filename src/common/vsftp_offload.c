@@ -0,0 +1,439 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "config.h"
+#include "io.h"
+#include "vsftp_offload.h"
+
+/* From <linux/ioprio.h>, which older kernel headers do not provide. */
+#define IOPRIO_CLASS_SHIFT  13U
+#define IOPRIO_CLASS_BE     2U  /* Best-effort, the class with priority levels every thread may use. */
+#define IOPRIO_WHO_PROCESS  1
+
+/* A bounded FIFO of jobs served by a fixed set of threads.
+ * Submitting never blocks: when the queue is full the job is refused and the caller runs it itself.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t jobAvailable;
+    vsftpOffloadJob_s *queue[OFFLOAD_QUEUE_LEN];
+    size_t head;
+    size_t count;
+    pthread_t threads[OFFLOAD_THREADS_MAX];
+    unsigned int threadCount;
+    bool isRunning;
+    vsftpOffloadStatistics_s statistics;
+} vsftpOffloadData_s;
+
+static vsftpOffloadData_s offloadData = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .jobAvailable = PTHREAD_COND_INITIALIZER
+};
+
+static uint64_t ElapsedUs(const struct timespec *from, const struct timespec *to);
+static vsftpOffloadJob_s *TakeJob(void);
+static void *OffloadThread(void *arg);
+
+/*!
+ * \brief Get the time elapsed between two monotonic timestamps.
+ * \param from
+ *      The earlier timestamp.
+ * \param to
+ *      The later timestamp.
+ * \returns The elapsed time in microseconds.
+ */
+static uint64_t ElapsedUs(const struct timespec *from, const struct timespec *to)
+{
+    int64_t us = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    us = ((int64_t)(to->tv_sec - from->tv_sec) * 1000000) + ((to->tv_nsec - from->tv_nsec) / 1000);
+
+    return (us > 0) ? (uint64_t)us : 0U;
+}
+
+/*!
+ * \brief Take the next job from the queue, wait for one if the queue is empty.
+ * \returns A pointer to the job or NULL when the pool is stopped and the queue is drained.
+ */
+static vsftpOffloadJob_s *TakeJob(void)
+{
+    vsftpOffloadJob_s *job = NULL;
+
+    (void)pthread_mutex_lock(&offloadData.mutex);
+
+    while ((offloadData.count == 0) && (offloadData.isRunning == true)) {
+        (void)pthread_cond_wait(&offloadData.jobAvailable, &offloadData.mutex);
+    }
+
+    if (offloadData.count > 0) {
+        job = offloadData.queue[offloadData.head];
+        offloadData.head = (offloadData.head + 1U) % OFFLOAD_QUEUE_LEN;
+        offloadData.count--;
+        offloadData.statistics.queueDepth = offloadData.count;
+    }
+
+    (void)pthread_mutex_unlock(&offloadData.mutex);
+
+    if (job != NULL) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &job->started);
+    }
+
+    return job;
+}
+
+/*!
+ * \brief Entry point of the offload threads.
+ * \details
+ *      Runs jobs until the pool is stopped, jobs that are still queued at that moment are run first.
+ * \param arg
+ *      Not used.
+ * \returns NULL.
+ */
+static void *OffloadThread(void *arg)
+{
+    vsftpOffloadJob_s *job = NULL;
+    struct timespec now;
+    uint64_t waitTimeUs = 0;
+    uint64_t runTimeUs = 0;
+
+    (void)arg;
+
+    /* The jobs are filesystem calls that commands wait for, they go before the reads of bulk transfers. */
+    if (VSFTPOffloadSetIoPriority(IO_PRIORITY_SHORT) != 0) {
+        FTPLOG("Could not set the I/O priority of an offload thread, error %d\n", errno);
+    }
+
+    while ((job = TakeJob()) != NULL) {
+        job->result = job->work(job->arg);
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &now);
+        waitTimeUs = ElapsedUs(&job->submitted, &job->started);
+        runTimeUs = ElapsedUs(&job->started, &now);
+
+        (void)pthread_mutex_lock(&offloadData.mutex);
+        offloadData.statistics.completed++;
+        offloadData.statistics.waitTimeTotalUs += waitTimeUs;
+        offloadData.statistics.runTimeTotalUs += runTimeUs;
+        if (waitTimeUs > offloadData.statistics.waitTimeMaxUs) {
+            offloadData.statistics.waitTimeMaxUs = waitTimeUs;
+        }
+        if (runTimeUs > offloadData.statistics.runTimeMaxUs) {
+            offloadData.statistics.runTimeMaxUs = runTimeUs;
+        }
+        (void)pthread_mutex_unlock(&offloadData.mutex);
+
+        /* The job belongs to the submitter again after this call. */
+        job->complete(job);
+    }
+
+    return NULL;
+}
+
+/*!
+ * \brief Start the offload threads.
+ * \param threads
+ *      The number of threads to start, 0 disables offloading (every job is refused).
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPOffloadStart(const unsigned int threads)
+{
+    int retval = -1;
+
+    if ((threads <= OFFLOAD_THREADS_MAX) && (offloadData.threadCount == 0)) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        (void)pthread_mutex_lock(&offloadData.mutex);
+        offloadData.head = 0;
+        offloadData.count = 0;
+        (void)memset(&offloadData.statistics, 0, sizeof(offloadData.statistics));
+        offloadData.isRunning = (threads > 0);
+        (void)pthread_mutex_unlock(&offloadData.mutex);
+
+        for (unsigned int i = 0; i < threads; i++) {
+            retval = pthread_create(&offloadData.threads[i], NULL, OffloadThread, NULL);
+            if (retval != 0) {
+                FTPLOG("Could not create offload thread %u, error %d\n", i, retval);
+                break;
+            }
+            offloadData.threadCount++;
+        }
+    }
+
+    if (retval == 0) {
+        FTPLOG("Started %u offload thread(s)\n", threads);
+    } else {
+        VSFTPOffloadStop();
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Stop the offload threads.
+ * \details
+ *      Jobs that are already queued are run (and completed) before this call returns.
+ */
+void VSFTPOffloadStop(void)
+{
+    (void)pthread_mutex_lock(&offloadData.mutex);
+    offloadData.isRunning = false;
+    (void)pthread_cond_broadcast(&offloadData.jobAvailable);
+    (void)pthread_mutex_unlock(&offloadData.mutex);
+
+    for (unsigned int i = 0; i < offloadData.threadCount; i++) {
+        (void)pthread_join(offloadData.threads[i], NULL);
+    }
+
+    offloadData.threadCount = 0;
+}
+
+/*!
+ * \brief Queue a job to be run by an offload thread.
+ * \details
+ *      Once the job has run, its 'complete' callback is called from the offload thread.
+ * \param job
+ *      The job to queue, 'work' and 'complete' must be set.
+ * \returns 0 in case of successful completion, EBUSY when the queue is full or the pool is not running (the caller
+ *      keeps the job and may run it itself) or any other value in case of an error.
+ */
+int VSFTPOffloadSubmit(vsftpOffloadJob_s *job)
+{
+    int retval = -1;
+
+    if ((job != NULL) && (job->work != NULL) && (job->complete != NULL)) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+        job->next = NULL;
+
+        (void)pthread_mutex_lock(&offloadData.mutex);
+
+        if ((offloadData.isRunning == false) || (offloadData.count == OFFLOAD_QUEUE_LEN)) {
+            offloadData.statistics.rejected++;
+            retval = EBUSY;
+        } else {
+            offloadData.queue[(offloadData.head + offloadData.count) % OFFLOAD_QUEUE_LEN] = job;
+            offloadData.count++;
+            offloadData.statistics.submitted++;
+            offloadData.statistics.queueDepth = offloadData.count;
+            if (offloadData.count > offloadData.statistics.queueDepthMax) {
+                offloadData.statistics.queueDepthMax = offloadData.count;
+            }
+            (void)pthread_cond_signal(&offloadData.jobAvailable);
+        }
+
+        (void)pthread_mutex_unlock(&offloadData.mutex);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get a snapshot of the offload statistics.
+ * \param[out] statistics
+ *      A pointer to the storage location for the statistics.
+ */
+void VSFTPOffloadGetStatistics(vsftpOffloadStatistics_s *statistics)
+{
+    if (statistics != NULL) {
+        (void)pthread_mutex_lock(&offloadData.mutex);
+        *statistics = offloadData.statistics;
+        (void)pthread_mutex_unlock(&offloadData.mutex);
+    }
+}
+
+/*!
+ * \brief Get the number of jobs that are queued but not picked up yet.
+ * \returns The queue depth.
+ */
+size_t VSFTPOffloadGetQueueDepth(void)
+{
+    size_t depth = 0;
+
+    (void)pthread_mutex_lock(&offloadData.mutex);
+    depth = offloadData.count;
+    (void)pthread_mutex_unlock(&offloadData.mutex);
+
+    return depth;
+}
+
+/*!
+ * \brief Set the I/O priority of the calling thread.
+ * \details
+ *      The priority only matters to I/O schedulers that support it (f.e. BFQ), the reads of a thread with a lower
+ *      level are served first.
+ * \param level
+ *      The best-effort priority level, 0 (highest) to 7 (lowest).
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPOffloadSetIoPriority(const unsigned int level)
+{
+    int retval = -1;
+
+    if (level <= 7U) {
+        /* Who 0 is the calling thread. */
+        retval = (int)syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                              (int)((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level));
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Initialize an empty deque.
+ * \param deque
+ *      The deque to initialize.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPOffloadDequeInitialize(vsftpOffloadDeque_s *deque)
+{
+    int retval = -1;
+
+    if (deque != NULL) {
+        deque->top = NULL;
+        deque->bottom = NULL;
+        deque->count = 0;
+        retval = pthread_mutex_init(&deque->mutex, NULL);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Push a job at the bottom of a deque.
+ * \details
+ *      To be called by the owner of the deque only.
+ * \param deque
+ *      The deque to push to.
+ * \param job
+ *      The job to push, it stays owned by the caller but must remain valid until it is taken from the deque.
+ */
+void VSFTPOffloadDequePush(vsftpOffloadDeque_s *deque, vsftpOffloadJob_s *job)
+{
+    if ((deque != NULL) && (job != NULL)) {
+        (void)pthread_mutex_lock(&deque->mutex);
+
+        job->next = NULL;
+        job->prev = deque->bottom;
+        if (deque->bottom != NULL) {
+            deque->bottom->next = job;
+        } else {
+            deque->top = job;
+        }
+        deque->bottom = job;
+        deque->count++;
+
+        (void)pthread_mutex_unlock(&deque->mutex);
+    }
+}
+
+/*!
+ * \brief Take the newest job from the bottom of a deque.
+ * \details
+ *      To be called by the owner of the deque only.
+ * \param deque
+ *      The deque to take from.
+ * \returns A pointer to the job or NULL when the deque is empty.
+ */
+vsftpOffloadJob_s *VSFTPOffloadDequePop(vsftpOffloadDeque_s *deque)
+{
+    vsftpOffloadJob_s *job = NULL;
+
+    if (deque != NULL) {
+        (void)pthread_mutex_lock(&deque->mutex);
+
+        job = deque->bottom;
+        if (job != NULL) {
+            deque->bottom = job->prev;
+            if (deque->bottom != NULL) {
+                deque->bottom->next = NULL;
+            } else {
+                deque->top = NULL;
+            }
+            deque->count--;
+        }
+
+        (void)pthread_mutex_unlock(&deque->mutex);
+    }
+
+    return job;
+}
+
+/*!
+ * \brief Take the oldest job from the top of a deque.
+ * \details
+ *      To be called by any thread but the owner of the deque.
+ * \param deque
+ *      The deque to take from.
+ * \returns A pointer to the job or NULL when the deque is empty.
+ */
+vsftpOffloadJob_s *VSFTPOffloadDequeSteal(vsftpOffloadDeque_s *deque)
+{
+    vsftpOffloadJob_s *job = NULL;
+
+    if (deque != NULL) {
+        (void)pthread_mutex_lock(&deque->mutex);
+
+        job = deque->top;
+        if (job != NULL) {
+            deque->top = job->next;
+            if (deque->top != NULL) {
+                deque->top->prev = NULL;
+            } else {
+                deque->bottom = NULL;
+            }
+            deque->count--;
+        }
+
+        (void)pthread_mutex_unlock(&deque->mutex);
+    }
+
+    return job;
+}
+
+/*!
+ * \brief Get the number of jobs in a deque.
+ * \param deque
+ *      The deque.
+ * \returns The number of jobs, or 0 in case of an error.
+ */
+size_t VSFTPOffloadDequeGetCount(vsftpOffloadDeque_s *deque)
+{
+    size_t count = 0;
+
+    if (deque != NULL) {
+        (void)pthread_mutex_lock(&deque->mutex);
+        count = deque->count;
+        (void)pthread_mutex_unlock(&deque->mutex);
+    }
+
+    return count;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_OFFLOAD_H__
+#define VSFTP_OFFLOAD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct vsftpOffloadJob_s vsftpOffloadJob_s;
+
+typedef int (* OffloadWork)(void *arg);
+typedef void (* OffloadComplete)(vsftpOffloadJob_s *job);
+
+/* A blocking call that is run by one of the offload threads.
+ * The storage is owned by the submitter and must remain valid until 'complete' has been called.
+ */
+struct vsftpOffloadJob_s {
+    OffloadWork work;           /* Runs on an offload thread. */
+    OffloadComplete complete;   /* Runs on the same offload thread after 'work', it hands the job back. */
+    void *arg;                  /* Passed to 'work'. */
+    int result;                 /* The value returned by 'work'. */
+    struct timespec submitted;
+    struct timespec started;
+    vsftpOffloadJob_s *next;    /* Free for use by the submitter once the job is complete, or while it is in a deque. */
+    vsftpOffloadJob_s *prev;
+};
+
+typedef struct {
+    uint64_t submitted;         /* Jobs queued. */
+    uint64_t completed;         /* Jobs run to completion. */
+    uint64_t rejected;          /* Jobs refused because the queue was full (or the pool not started). */
+    size_t queueDepth;          /* Jobs currently queued, not yet picked up. */
+    size_t queueDepthMax;
+    uint64_t waitTimeTotalUs;   /* Time between submission and start. */
+    uint64_t waitTimeMaxUs;
+    uint64_t runTimeTotalUs;    /* Time spent in 'work'. */
+    uint64_t runTimeMaxUs;
+} vsftpOffloadStatistics_s;
+
+/* A double ended queue of jobs that are not run by the offload threads but by the threads that use the deque.
+ * The owner pushes and pops at the bottom (newest first), other threads steal from the top (oldest first).
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    vsftpOffloadJob_s *top;
+    vsftpOffloadJob_s *bottom;
+    size_t count;
+} vsftpOffloadDeque_s;
+
+extern int VSFTPOffloadStart(unsigned int threads);
+extern void VSFTPOffloadStop(void);
+extern int VSFTPOffloadSubmit(vsftpOffloadJob_s *job);
+extern void VSFTPOffloadGetStatistics(vsftpOffloadStatistics_s *statistics);
+extern size_t VSFTPOffloadGetQueueDepth(void);
+extern int VSFTPOffloadSetIoPriority(unsigned int level);
+
+extern int VSFTPOffloadDequeInitialize(vsftpOffloadDeque_s *deque);
+extern void VSFTPOffloadDequePush(vsftpOffloadDeque_s *deque, vsftpOffloadJob_s *job);
+extern vsftpOffloadJob_s *VSFTPOffloadDequePop(vsftpOffloadDeque_s *deque);
+extern vsftpOffloadJob_s *VSFTPOffloadDequeSteal(vsftpOffloadDeque_s *deque);
+extern size_t VSFTPOffloadDequeGetCount(vsftpOffloadDeque_s *deque);
+
+#endif /* VSFTP_OFFLOAD_H__ */
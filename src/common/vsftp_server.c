@@ -20,65 +20,539 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include "vsftp_server.h"
 #include "vsftp_commands.h"
 #include "vsftp_filesystem.h"
+#include "vsftp_transfer.h"
+#include "vsftp_offload.h"
+#include "vsftp_timer.h"
+#include "vsftp_shaper.h"
+#include "vsftp_uring.h"
 #include "config.h"
 #include "io.h"
 
+#define HANDOFF_ACK     'A'      /* Sent by the new process once it took over the listeners. */
+#define TELNET_IAC      ((char)0xFF) /* Starts the Telnet commands that mark urgent commands, f.e. ABOR. */
+#define REPLY_END       "\r\n"   /* Ends every reply. */
+#define STRLEN(_a)      ((sizeof((_a)) / sizeof(*(_a))) - 1)
+
+typedef enum {
+    EVENT_SOURCE_LISTENER = 0,
+    EVENT_SOURCE_CONTROL,
+    EVENT_SOURCE_TRANSFER,
+    EVENT_SOURCE_MAILBOX,
+    EVENT_SOURCE_HANDOFF,
+    EVENT_SOURCE_HANDOFF_ACK,
+    EVENT_SOURCE_DATA_LISTENER
+} vsftpEventSourceType_e;
+
+typedef enum {
+    ADMISSION_ACCEPTED = 0,
+    ADMISSION_SERVER_FULL,      /* The server is at its session limit. */
+    ADMISSION_CLIENT_FULL       /* The client address is at its session limit. */
+} vsftpAdmission_e;
+
+/* Shortest job first: the transfer chunks of a worker are queued per class, short transfers go first. */
+typedef enum {
+    TRANSFER_CLASS_SHORT = 0,   /* At most TRANSFER_SHORT_SIZE bytes left, f.e. a small file or the end of a large. */
+    TRANSFER_CLASS_BULK,
+    TRANSFER_CLASSES
+} vsftpTransferClass_e;
+
+/* Socket options per kind of connection, see ApplySocketProfile(). */
+typedef enum {
+    SOCKET_PROFILE_CONTROL = 0,
+    SOCKET_PROFILE_DATA_LAN,    /* Data connections until their transfer is tuned, see AutotuneTransferClientSocket(). */
+    SOCKET_PROFILE_DATA_WAN,
+    SOCKET_PROFILES
+} vsftpSocketProfile_e;
+
 typedef struct {
-    /* Configuration data. */
+    const char *name;
+    bool isNoDelay;             /* TCP_NODELAY, small writes are sent right away. */
+    bool isData;                /* Uses the congestion control of the options. */
+    unsigned int notSentLowat;  /* TCP_NOTSENT_LOWAT, 0 for the kernel default. */
+    bool isPaced;               /* The kernel paces at the rate TCP computes itself. */
+} vsftpSocketProfile_s;
+
+/* The struct tcp_info of Linux (linux/tcp.h) up to the delivery rate (Linux 4.9). The struct of glibc stops at
+ * 'totalRetrans' and can not be included together with linux/tcp.h, so the layout is copied. The kernel only appends
+ * to it, so the offsets are fixed.
+ */
+typedef struct {
+    uint8_t state;
+    uint8_t caState;
+    uint8_t retransmits;
+    uint8_t probes;
+    uint8_t backoff;
+    uint8_t options;
+    uint8_t wscale;             /* Send and receive window scale, 4 bits each. */
+    uint8_t flags;
+    uint32_t rto;
+    uint32_t ato;
+    uint32_t sndMss;
+    uint32_t rcvMss;
+    uint32_t unacked;
+    uint32_t sacked;
+    uint32_t lost;
+    uint32_t retrans;
+    uint32_t fackets;
+    uint32_t lastDataSent;
+    uint32_t lastAckSent;
+    uint32_t lastDataRecv;
+    uint32_t lastAckRecv;
+    uint32_t pmtu;
+    uint32_t rcvSsthresh;
+    uint32_t rtt;               /* Microseconds. */
+    uint32_t rttvar;
+    uint32_t sndSsthresh;
+    uint32_t sndCwnd;           /* Segments. */
+    uint32_t advmss;
+    uint32_t reordering;
+    uint32_t rcvRtt;
+    uint32_t rcvSpace;
+    uint32_t totalRetrans;
+    uint64_t pacingRate;
+    uint64_t maxPacingRate;
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+    uint32_t segsOut;
+    uint32_t segsIn;
+    uint32_t notSentBytes;
+    uint32_t minRtt;
+    uint32_t dataSegsIn;
+    uint32_t dataSegsOut;
+    uint64_t deliveryRate;      /* Bytes per second. */
+} vsftpTcpInfo_s;
+
+_Static_assert(offsetof(vsftpTcpInfo_s, rtt) == offsetof(struct tcp_info, tcpi_rtt), "tcp_info layout mismatch");
+_Static_assert(offsetof(vsftpTcpInfo_s, pacingRate) == 104U, "tcp_info layout mismatch");
+_Static_assert(offsetof(vsftpTcpInfo_s, deliveryRate) == 160U, "tcp_info layout mismatch");
+
+typedef struct vsftpWorker_s vsftpWorker_s;
+
+/* A client connection accepted by the acceptor thread, on its way to a worker. */
+typedef struct {
+    int sock;
+    struct sockaddr_in client;
+    struct timespec acceptedAt;
+} vsftpAcceptedClient_s;
+
+/* Single producer (the acceptor), single consumer (a worker) ring of accepted client connections.
+ * 'head' and 'tail' only increase, each is written by one side and read by the other, so no lock is needed.
+ */
+typedef struct {
+    vsftpAcceptedClient_s clients[ACCEPT_RING_LEN];
+    size_t head;    /* Next client to take, written by the worker. */
+    size_t tail;    /* Next free slot, written by the acceptor. */
+} vsftpAcceptRing_s;
+
+/* Every socket registered with epoll carries a pointer to one of these as its event data. */
+typedef struct {
+    vsftpEventSourceType_e type;
+    vsftpSession_s *session;
+} vsftpEventSource_s;
+
+/* A listener on a passive port, bound once and leased to one session at a time. */
+typedef struct vsftpPasvListener_s {
+    int sock;
     uint16_t port;
-    char rootPath[PATH_LEN_MAX];
-    char ipAddr[INET_ADDRSTRLEN];
-    size_t ipAddrLen;
-    size_t rootPathLen;
+    volatile bool isLeased;     /* Also read by worker 0, to tell the next process which ports are still in use. */
+    bool isReserved;            /* Still leased by the previous process, left out of the pool. */
+    struct vsftpPasvListener_s *nextFree;
+} vsftpPasvListener_s;
 
-    /* Internal data. */
+/* Sent to the next process together with the listeners (SCM_RIGHTS). Only 'count' is required, the passive ports are
+ * left out by a process that does not know about them.
+ */
+typedef struct {
+    uint32_t count;             /* Listeners sent along. */
+    uint32_t leasedLen;         /* Passive ports the sessions still lease, the next process must not listen on them. */
+    uint32_t isSharedPortBusy;  /* Sessions may still wait on the shared passive port, the next process must not
+                                 * listen on it until it is closed. */
+    uint16_t leased[PASV_PORTS_MAX];
+} vsftpHandoffMessage_s;
+
+typedef enum {
+    DATA_WAITER_IDLE = 0,
+    DATA_WAITER_WAITING,        /* Queued for a data connection from the client address. */
+    DATA_WAITER_DELIVERED       /* Matched, the data connection waits for the worker of the session to take it. */
+} vsftpDataWaiterState_e;
+
+/* A session waiting for its data connection on the shared passive port, protected by the mutex of the demultiplexer.
+ * Except for a waiter that is idle, only the worker of the session uses it then.
+ */
+typedef struct vsftpDataWaiter_s {
+    struct vsftpDataWaiter_s *prev;
+    struct vsftpDataWaiter_s *next;
+    vsftpSession_s *session;
+    uint32_t addr;
+    int sock;
+    vsftpDataWaiterState_e state;
+} vsftpDataWaiter_s;
+
+typedef struct {
+    vsftpDataWaiter_s *head;
+    vsftpDataWaiter_s *tail;
+} vsftpDataWaiterList_s;
+
+struct vsftpSession_s {
+    vsftpEventSource_s controlEvent;
+    vsftpEventSource_s transferEvent;
+    vsftpWorker_s *worker;
+    vsftpCommandState_s command;
     char cwd[PATH_LEN_MAX];
     size_t cwdLen;
-    int serverSock;
     int clientSock;
-    int transferSock;
+    char requests[REQUEST_RING_SIZE]; /* Received control data that is not handled yet, see HandleRequests(). */
+    size_t requestsHead;        /* Offset in 'requests' of the first byte not handled yet. */
+    size_t requestsLen;         /* Bytes in 'requests' not handled yet. */
+    bool isRequestTooLong;      /* The rest of a line longer than REQUEST_LEN_MAX is discarded. */
+    bool isReceivePaused;       /* 'requests' is full, the control socket is not read until a command is handled. */
+    struct iovec receiveIov[2]; /* The free space of 'requests' for a receive through the ring of the worker. */
+    struct msghdr receiveMsg;
+    int received;               /* Result of that receive, see ReceiveWorkerRequests(). */
+    bool isReceived;            /* 'received' is not handled yet. */
+    char replies[REPLY_BUF_SIZE]; /* Replies not sent yet, see FlushReplies(). */
+    size_t repliesLen;
+    bool isFlushQueued;         /* In the flush list of the worker, it has replies to send. */
+    vsftpSession_s *prevFlush;
+    vsftpSession_s *nextFlush;
+    int transferSock;           /* The socket of 'pasvListener' while it is leased. */
     int transferClientSock;
-    struct sockaddr_in server;
     struct sockaddr_in client;
-    struct sockaddr_in transfer;
+    vsftpPasvListener_s *pasvListener;
+    bool isAcceptPending;       /* A command waits for the client to open the data connection. */
+    vsftpDataWaiter_s dataWaiter;
+    bool isDataWaiterQueued;    /* Waits for its data connection on the shared passive port. */
     bool transferModeBinary;
+    uint64_t rangeStart;        /* The range of the file the next RETR sends, see VSFTPServerSetTransferRange(). */
+    uint64_t rangeEnd;
+    vsftpTransfer_s transfer;
+    bool isTransferAborted;
+    bool isTransferTimedOut;    /* The client did not open the data connection in time. */
+    vsftpTimer_s idleTimer;     /* Disconnects the session when it sends no commands. */
+    bool isDrainServed;         /* Ran a command since the server started draining, see DrainWorker(). */
+    vsftpTimer_s transferTimer; /* Fails the transfer when the data connection is not opened or stalls. */
+    vsftpOffloadJob_s offloadJob;
+    SessionWork offloadWork;
+    bool isOffloadPending;      /* The job owns the command state and the transfer until it is finished. */
+    bool isDisconnectPending;   /* Disconnected while the job was pending, released once it is finished. */
+    bool isChunkQueued;         /* The job sends a chunk of the transfer, its result is not collected yet. */
+    size_t chunkSent;           /* Bytes sent by the last chunk. */
+    size_t chunkLimit;          /* Bytes the last chunk was allowed to send by the bandwidth limits. */
+    size_t transferProgress;    /* Bytes of the transfer sent before the pending chunk. */
+    vsftpTokenBucket_s bucket;  /* The bandwidth limit of the session. */
+    vsftpShaperFlow_s flow;     /* Its turn for the bandwidth it shares with other sessions. */
+    size_t sharedTokens;        /* Granted by the shared bandwidth limits, not sent yet. */
+    vsftpTimer_s shaperTimer;   /* Resumes a transfer that waits for bandwidth. */
+    bool isKernelPaced;         /* The kernel paces the data connection to the session limit. */
+    bool isTransferTuned;       /* The data connection got its profile from its TCP_INFO. */
+
+    bool isInUse;
+    vsftpSession_s *nextFree;
+};
+
+/* A worker owns a listener on the (shared) server port, an epoll instance and a slice of the session slab.
+ * Workers share nothing but the read-only configuration, so they rarely have to synchronize with each other. The
+ * exceptions are the mailbox, through which completed jobs are handed back, and the deques of transfer chunks that are
+ * ready to be sent, from which idle workers steal.
+ */
+struct vsftpWorker_s {
+    unsigned int id;
+    pthread_t thread;
+    int epollFd;
+    int serverSock;
+    struct sockaddr_in server;
+    vsftpEventSource_s serverEvent;
+    vsftpSession_s *sessions;
+    size_t sessionsLen;
+    vsftpSession_s *freeSessions;
+    vsftpSession_s *flushList;      /* Sessions with replies to send at the end of the iteration. */
+    vsftpPasvListener_s *freePasvListeners;
+    int dataSock;                   /* Listener on the shared passive port, when used. */
+    vsftpEventSource_s dataEvent;
+    vsftpTimer_s dataSockTimer;     /* Retries the shared passive port while the previous process listens on it. */
+    size_t sessionCount;            /* Also read by the acceptor, to find the least loaded worker. */
+    vsftpAcceptRing_s acceptRing;   /* Connections handed over by the acceptor. */
+    uint64_t handOvers;
+    uint64_t handOverTimeTotalUs;   /* Time between accepting a connection and setting up its session. */
+    uint64_t handOverTimeMaxUs;
+    int mailboxFd;                  /* eventfd, readable when the mailbox holds completed jobs. */
+    vsftpEventSource_s mailboxEvent;
+    pthread_mutex_t mailboxMutex;
+    vsftpOffloadJob_s *mailbox;     /* Completed jobs, protected by 'mailboxMutex'. */
+    size_t offloadsPending;         /* Jobs of this worker's sessions that are not yet handled from the mailbox. */
+    vsftpOffloadDeque_s chunks[TRANSFER_CLASSES]; /* Transfer chunks of its sessions that are ready to be sent. */
+    struct timespec bulkServedAt;   /* The last time bulk chunks were sent, or there were none. */
+    vsftpTransferClass_e ioClass;   /* The class the I/O priority of the thread is set for. */
+    vsftpTimerWheel_s timers;       /* The timeouts of the sessions. */
+    volatile bool isWaiting;        /* Waiting for events, so it has time to steal chunks from others. */
+    uint64_t chunksSent;            /* Chunks of its own sessions sent by this worker. */
+    uint64_t chunksStolen;          /* Chunks of other workers' sessions sent by this worker. */
+    uint64_t bulkAged;              /* Times bulk chunks were sent before short ones because they waited too long. */
+    uint64_t transfers[TRANSFER_PATHS]; /* Transfers of its sessions, by how they were sent. */
+    uint64_t zerocopyBytes;         /* Bytes of MSG_ZEROCOPY transfers the kernel sent without copying. */
+    uint64_t copiedBytes;           /* Bytes of MSG_ZEROCOPY transfers the kernel copied after all. */
+    uint64_t loopTimeUs;            /* Moving average of the time an iteration spends on its events and chunks. */
+    uint64_t refused;               /* Connections refused because of the session limits. */
+    uint64_t shed;                  /* Connections refused because the server was overloaded. */
+    vsftpUring_s ring;              /* Batches the receives, the replies and the transfer chunks of an iteration. */
+    bool hasRing;
+    char copyBufs[URING_COPY_BUFFERS][TRANSFER_CHUNK_SIZE]; /* Copied chunks on the ring are read into these. */
+    unsigned int copyBufsUsed;
+    vsftpOffloadJob_s *ringChunksDone; /* Chunks reaped from the ring, their commands are not resumed yet. */
+    uint64_t ringChunks;            /* Chunks of its own sessions sent through the ring. */
+    bool isDrainStarted;            /* The listeners are closed and the sessions were told about the drain. */
+
+    bool isStarted;
+    bool isThreadCreated;
+    volatile bool isRunning;
+};
+
+/* The dedicated acceptor thread, only used with the 'useAcceptor' option. */
+typedef struct {
+    int serverSock;
+    struct sockaddr_in server;
+    pthread_t thread;
+    bool isThreadCreated;
+    volatile bool isRunning;
+    uint64_t accepted;
+    uint64_t refused;               /* Connections refused because the rings of all workers were full. */
+    size_t batchMax;                /* Most connections accepted in one go. */
+    size_t queueDepthMax;           /* Most connections seen waiting in the kernel's accept queue. */
+} vsftpAcceptor_s;
+
+/* The number of sessions and the bandwidth per client address, shared by all workers.
+ * Open addressing with linear probing, an address of 0 marks a free entry. The table is twice the size of the session
+ * slab, so it never fills up.
+ */
+typedef struct {
+    uint32_t addr;
+    uint32_t count;
+    vsftpTokenBucket_s bucket;      /* The bandwidth limit of the client address. */
+} vsftpClientEntry_s;
 
-    bool isConnected;
-    bool isServerSocketCreated;
+typedef struct {
+    pthread_mutex_t mutex;
+    vsftpClientEntry_s entries[CLIENT_TABLE_LEN];
+    size_t total;                   /* Sessions of all clients. */
+    vsftpTokenBucket_s bucket;      /* The bandwidth limit of all sessions. */
+    vsftpShaperQueue_s queue;       /* Sessions waiting for their turn for the shared bandwidth. */
+    vsftpShaperQueue_s ready[WORKERS_MAX];  /* Per worker, sessions that got their turn while they waited. */
+} vsftpClientTable_s;
+
+/* Matches the connections on the shared passive port to the sessions waiting for them, shared by all workers.
+ * Waiters are queued per client address (hashed like the client table) in the order of their PASV. A matched
+ * connection is moved to the delivered list of the worker of its session, which takes it from there.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    vsftpDataWaiterList_s waiting[CLIENT_TABLE_LEN];
+    vsftpDataWaiterList_s delivered[WORKERS_MAX];
+} vsftpDataDemux_s;
+
+typedef struct {
+    /* Configuration data. */
+    uint16_t port;
+    char rootPath[PATH_LEN_MAX];
+    char ipAddr[INET_ADDRSTRLEN];
+    size_t ipAddrLen;
+    size_t rootPathLen;
+    vsftpServerOptions_s options;
+
+    /* Internal data. */
+    vsftpWorker_s workers[WORKERS_MAX];
+    vsftpAcceptor_s acceptor;
+    vsftpClientTable_s clients;
+    vsftpDataDemux_s dataDemux;
+    size_t pasvListenersLen;        /* Ports in the passive port pool. */
+    int handoffSock;                /* Listens for the next process, handled by worker 0. */
+    vsftpEventSource_s handoffEvent;
+    int handoffConn;                /* The next process the listeners were sent to, -1 when none. */
+    vsftpEventSource_s handoffConnEvent;
+    vsftpTimer_s handoffTimer;      /* Gives up on the next process when it does not acknowledge in time. */
+    uint32_t handoffCount;          /* Listeners sent to the next process. */
+    int inheritedSocks[WORKERS_MAX];    /* Listeners taken over from the previous process, -1 once used. */
+    unsigned int inheritedCount;
+    volatile bool isHandingOff;     /* The listeners are sent to the next process, no passive ports are leased. */
+    volatile bool isSharedPortBusy; /* The previous process still listens on the shared passive port. */
+    volatile bool isDraining;       /* The listeners are handed over, finish the sessions and stop. */
+    bool isStarted;
 } vsftpServerData_s;
 
-static vsftpServerData_s serverData;
+static vsftpServerData_s serverData = {
+    .acceptor = { .serverSock = -1 },
+    .handoffSock = -1,
+    .handoffConn = -1,
+    .clients = { .mutex = PTHREAD_MUTEX_INITIALIZER },
+    .dataDemux = { .mutex = PTHREAD_MUTEX_INITIALIZER }
+};
 
-static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockaddr_in *sockData);
-static int WaitForIncomingConnection(void);
-static int HandleConnection(void);
+/* Indexed by vsftpSocketProfile_e. Replies are already sent once per iteration, so the control connection does not
+ * need Nagle. Data connections that cross a WAN keep more unsent data queued and are paced to avoid bursts.
+ */
+static const vsftpSocketProfile_s socketProfiles[SOCKET_PROFILES] = {
+    { "control",  true,  false, 0,                      false },
+    { "data-lan", false, true,  DATA_LAN_NOTSENT_LOWAT, false },
+    { "data-wan", false, true,  DATA_WAN_NOTSENT_LOWAT, true  }
+};
+
+/* Indexed by vsftpTransferPath_e, for the logs. */
+static const char *const transferPathNames[TRANSFER_PATHS] = { "sendfile", "read/write", "zerocopy" };
+
+/* Preallocated session slab, each worker hands out sessions from (and returns them to) its own slice of it. */
+static vsftpSession_s sessions[SESSIONS_MAX];
+
+/* Passive port listeners, indexed by port number relative to the first port of the pool. */
+static vsftpPasvListener_s pasvListeners[PASV_PORTS_MAX];
+
+static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockaddr_in *sockData, bool blocking,
+                               int backlog);
+static uint64_t ElapsedUs(const struct timespec *from, const struct timespec *to);
+static void InitializeSessionPool(vsftpWorker_s *worker);
+static vsftpSession_s *AllocateSession(vsftpWorker_s *worker);
+static void ReleaseSession(vsftpSession_s *session);
+static size_t FirstPooledPasvPort(void);
+static void CreatePasvListeners(vsftpWorker_s *worker);
+static void ClosePasvListeners(vsftpWorker_s *worker);
+static vsftpPasvListener_s *LeasePasvListener(vsftpWorker_s *worker);
+static void ReturnPasvListener(vsftpWorker_s *worker, vsftpPasvListener_s *listener);
+static void AppendDataWaiter(vsftpDataWaiterList_s *list, vsftpDataWaiter_s *waiter);
+static void RemoveDataWaiter(vsftpDataWaiterList_s *list, vsftpDataWaiter_s *waiter);
+static bool QueueDataWaiter(vsftpSession_s *session);
+static void CancelDataWaiter(vsftpSession_s *session);
+static vsftpWorker_s *MatchDataConnection(int sock, const struct sockaddr_in *client);
+static void AcceptDataConnections(vsftpWorker_s *worker);
+static bool IsSharedPasvPortFree(void);
+static int OpenSharedPasvPort(vsftpWorker_s *worker);
+static void SharedPasvPortTimeout(vsftpTimer_s *timer);
+static void TakeDataConnections(vsftpWorker_s *worker);
+static size_t HashClientAddress(uint32_t addr);
+static size_t FindClient(uint32_t addr);
+static vsftpAdmission_e AdmitClient(const struct sockaddr_in *client);
+static void ReleaseClient(const struct sockaddr_in *client);
+static bool IsOverloaded(const vsftpWorker_s *worker);
+static void OpenSession(vsftpWorker_s *worker, int sock, const struct sockaddr_in *client);
+static int AcceptIncomingConnections(vsftpWorker_s *worker);
+static bool PushAcceptedClient(vsftpAcceptRing_s *ring, const vsftpAcceptedClient_s *client);
+static bool PopAcceptedClient(vsftpAcceptRing_s *ring, vsftpAcceptedClient_s *client);
+static void TakeHandedOverConnections(vsftpWorker_s *worker);
+static vsftpWorker_s *GetLeastLoadedWorker(void);
+static void HandOverConnections(void);
+static void *AcceptorThread(void *arg);
+static int StartAcceptor(void);
+static void StopAcceptor(void);
+static void CloseServerSocket(int *sock);
+static int TakeInheritedSocket(unsigned int index);
+static void CloseInheritedSockets(void);
+static int TakeOverListeners(void);
+static int StartHandoff(void);
+static void StopHandoff(void);
+static void HandOffListeners(vsftpWorker_s *worker);
+static void CloseHandoffConnection(vsftpWorker_s *worker);
+static void ReceiveHandoffAck(vsftpWorker_s *worker);
+static void HandoffTimeout(vsftpTimer_s *timer);
+static bool HasPendingData(const vsftpSession_s *session);
+static void DrainWorker(vsftpWorker_s *worker);
+static int HandleConnection(vsftpSession_s *session);
+static size_t GetRequestsSpace(vsftpSession_s *session, struct iovec *iov);
+static int ReceiveRequests(vsftpSession_s *session, size_t *received);
+static bool PeekRequest(const vsftpSession_s *session, size_t offset, char *line, size_t *lineLen, size_t *size);
+static void DropRequest(vsftpSession_s *session, size_t offset, size_t size);
+static bool TakeUrgentRequest(vsftpSession_s *session, size_t offset, char *line, size_t *lineLen);
+static void PauseRequests(vsftpSession_s *session, bool isPaused);
+static void HandleRequests(vsftpSession_s *session);
+static int HandleCommandResult(vsftpSession_s *session, int result);
+static int ResumeCommand(vsftpSession_s *session);
+static int WaitForTransfer(vsftpSession_s *session, int sock, uint32_t events);
+static int AcceptDataConnection(vsftpSession_s *session);
+static int HandleTransfer(vsftpSession_s *session);
+static void StartTransferTimer(vsftpSession_s *session, unsigned int timeoutS);
+static unsigned int GetIdleTimeoutMs(void);
+static void IdleTimeout(vsftpTimer_s *timer);
+static void TransferTimeout(vsftpTimer_s *timer);
+static void PrepareOffload(vsftpSession_s *session, SessionWork work);
+static int RunOffloadWork(void *arg);
+static void CompleteOffload(vsftpOffloadJob_s *job);
+static void FinishOffload(vsftpWorker_s *worker, vsftpOffloadJob_s *job);
+static void HandleMailbox(vsftpWorker_s *worker);
+static int SendTransferChunk(vsftpSession_s *session);
+static int QueueTransferChunk(vsftpSession_s *session);
+static void SelectTransferPath(vsftpSession_s *session);
+static bool HasSharedRateLimit(void);
+static size_t TakeSharedTokens(vsftpSession_s *session);
+static void ResumeShapedTransfers(vsftpWorker_s *worker);
+static void ReleaseSharedTokens(vsftpSession_s *session);
+static size_t TakeTransferTokens(vsftpSession_s *session, unsigned int *waitMs);
+static void ReturnTransferTokens(vsftpSession_s *session);
+static int ShapeTransferChunk(vsftpSession_s *session);
+static void ShaperTimeout(vsftpTimer_s *timer);
+static void PaceTransferClientSocket(vsftpSession_s *session);
+static void ApplySocketProfile(int sock, vsftpSocketProfile_e profile, bool isKernelPaced);
+static void PrepareTransferClientSocket(vsftpSession_s *session);
+static void AutotuneTransferClientSocket(vsftpSession_s *session);
+static void WakeIdleWorker(const vsftpWorker_s *worker);
+static size_t GetQueuedChunks(vsftpWorker_s *worker);
+static void RunChunk(vsftpWorker_s *worker, vsftpOffloadJob_s *job, vsftpTransferClass_e class);
+static bool QueueRingChunk(vsftpWorker_s *worker, vsftpSession_s *session);
+static void CompleteRingChunk(vsftpWorker_s *worker, vsftpSession_s *session, int result);
+static bool FinishRingChunks(vsftpWorker_s *worker);
+static void RunOwnChunks(vsftpWorker_s *worker, vsftpTransferClass_e class);
+static void RunTransferChunks(vsftpWorker_s *worker);
+static void CancelTransferChunks(vsftpWorker_s *worker);
 static int SendOwnSock(int sock, const char *buf, size_t size, size_t *send);
-static int ReceiveOwnSock(int sock, char *buf, size_t size, size_t *received);
-static int CloseClientSocket(void);
+static void QueueReplies(vsftpSession_s *session);
+static void UnqueueReplies(vsftpSession_s *session);
+static int FlushReplies(vsftpSession_s *session, bool isMore);
+static int CompleteFlush(vsftpSession_s *session, ssize_t sent, int error);
+static void SubmitWorkerRing(vsftpWorker_s *worker, bool isReceive);
+static void ReceiveWorkerRequests(vsftpWorker_s *worker, const struct epoll_event *events, int numEvents);
+static void FlushWorkerReplies(vsftpWorker_s *worker);
+static int AppendReply(vsftpSession_s *session, const char *reply, size_t len);
+static int CloseClientSocket(vsftpSession_s *session);
+static int StartWorker(vsftpWorker_s *worker);
+static void StopWorker(vsftpWorker_s *worker);
+static int WorkerHandler(vsftpWorker_s *worker);
+static void PinWorker(const vsftpWorker_s *worker);
+static void *WorkerThread(void *arg);
 
 /*!
  * \brief Create a passive socket.
  * \details
- *      Passive, blocking, re-using port.
+ *      Passive, re-using port.
  * \param portNum
  *      The port number to create a socket with.
  * \param[out] sock
  *      A pointer to the storage location for the created socket.
  * \param sockData
  *      A pointer to information for binding the socket.
+ * \param blocking
+ *      A boolean indicating if the socket should be blocking (true) or non-blocking (false).
+ * \param backlog
+ *      The number of connections the kernel may queue for the socket before they are accepted.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockaddr_in *sockData)
+static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockaddr_in *sockData, const bool blocking,
+                               const int backlog)
 {
     int retval = -1;
     int option = 1;
+    int flags = 0;
 
     /* Argument checks are performed by the caller. */
 
@@ -91,16 +565,25 @@ static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockadd
     }
 
     if (retval == 0) {
-        /* The socket is blocking. */
-        retval = fcntl(*sock, F_SETFL, fcntl(*sock, F_GETFL, 0));
+        flags = fcntl(*sock, F_GETFL, 0);
+        if (blocking == true) {
+            flags &= ~O_NONBLOCK;
+        } else {
+            flags |= O_NONBLOCK;
+        }
+        retval = fcntl(*sock, F_SETFL, flags);
         if (retval != 0) {
             FTPLOG("Socket fcntl failed with error %d\n", retval);
         }
     }
 
     if (retval == 0) {
-        /* Change the socket options. */
+        /* Change the socket options. With SO_REUSEADDR the connections accepted on the port do not keep it from being
+         * bound, only the listener does, see IsSharedPasvPortFree(). */
         retval = setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, (char *)&option, sizeof(option));
+        if (retval == 0) {
+            retval = setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, (char *)&option, sizeof(option));
+        }
         if (retval != 0) {
             FTPLOG("Socket setsockopt failed with error %d\n", retval);
         }
@@ -116,7 +599,7 @@ static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockadd
 
     if (retval == 0) {
         /* Mark the socket as a passive socket. */
-        retval = listen(*sock, 1);
+        retval = listen(*sock, backlog);
         if (retval != 0) {
             FTPLOG("Socket listen failed with error %d\n", retval);
         }
@@ -134,96 +617,4221 @@ static int CreatePassiveSocket(uint16_t portNum, int *sock, const struct sockadd
 }
 
 /*!
- * \brief Wait for a client connection.
+ * \brief Get the time elapsed between two monotonic timestamps.
+ * \param from
+ *      The earlier timestamp.
+ * \param to
+ *      The later timestamp.
+ * \returns The elapsed time in microseconds.
+ */
+static uint64_t ElapsedUs(const struct timespec *from, const struct timespec *to)
+{
+    int64_t us = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    us = ((int64_t)(to->tv_sec - from->tv_sec) * 1000000) + ((to->tv_nsec - from->tv_nsec) / 1000);
+
+    return (us > 0) ? (uint64_t)us : 0U;
+}
+
+/*!
+ * \brief Initialize the session pool of a worker.
  * \details
- *      This is a synchronous call.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ *      Chains all sessions of the worker's slice of the slab into its free-list.
+ * \param worker
+ *      The worker to initialize the session pool for.
  */
-static int WaitForIncomingConnection(void)
+static void InitializeSessionPool(vsftpWorker_s *worker)
 {
-    int c = 0;
-    int retval = 0;
+    /* Argument checks are performed by the caller. */
+
+    worker->freeSessions = NULL;
+    worker->flushList = NULL;
+    __atomic_store_n(&worker->sessionCount, 0, __ATOMIC_RELAXED);
+
+    for (size_t i = worker->sessionsLen; i > 0; i--) {
+        worker->sessions[i - 1].isInUse = false;
+        worker->sessions[i - 1].clientSock = -1;
+        worker->sessions[i - 1].transferSock = -1;
+        worker->sessions[i - 1].transferClientSock = -1;
+        worker->sessions[i - 1].nextFree = worker->freeSessions;
+        worker->freeSessions = &worker->sessions[i - 1];
+    }
+}
+
+/*!
+ * \brief Take a session from the session pool of a worker.
+ * \param worker
+ *      The worker to take the session from.
+ * \returns A pointer to a reset session or NULL when the pool is exhausted.
+ */
+static vsftpSession_s *AllocateSession(vsftpWorker_s *worker)
+{
+    vsftpSession_s *session = worker->freeSessions;
 
     /* Argument checks are performed by the caller. */
 
-    /* Poll for an incoming connection and accept it when there is 1. */
-    c = sizeof(struct sockaddr_in);
-    serverData.clientSock = accept(serverData.serverSock,
-                                   (struct sockaddr *)&serverData.client,
-                                   (socklen_t *)&c);
-    if (serverData.clientSock >= 0) {
-        FTPLOG("Client socket %d connection accepted\n", serverData.clientSock);
+    if (session != NULL) {
+        worker->freeSessions = session->nextFree;
+        __atomic_store_n(&worker->sessionCount, worker->sessionCount + 1U, __ATOMIC_RELAXED);
+
+        (void)memset(session, 0, sizeof(*session));
+        session->controlEvent.type = EVENT_SOURCE_CONTROL;
+        session->controlEvent.session = session;
+        session->transferEvent.type = EVENT_SOURCE_TRANSFER;
+        session->transferEvent.session = session;
+        session->worker = worker;
+        VSFTPTimerInitialize(&session->idleTimer, IdleTimeout, session);
+        VSFTPTimerInitialize(&session->transferTimer, TransferTimeout, session);
+        VSFTPTimerInitialize(&session->shaperTimer, ShaperTimeout, session);
+        VSFTPTransferInitialize(&session->transfer);
+        VSFTPTokenBucketInitialize(&session->bucket, (uint64_t)serverData.options.rateLimitPerSession * 1024U);
+        session->flow.arg = session;
+        session->clientSock = -1;
+        session->transferSock = -1;
+        session->transferClientSock = -1;
+        session->transferModeBinary = true;
+        session->rangeEnd = UINT64_MAX;
+        session->isInUse = true;
+    }
 
-        /* Set cwd to rootdir. */
-        retval = VSFTPServerSetCwd(serverData.rootPath, serverData.rootPathLen);
-        if (retval == 0) {
-            retval = VSFTPServerSendReply("220 Service ready for new user.");
-            if (retval == 0) {
-                serverData.isConnected = true;
+    return session;
+}
+
+/*!
+ * \brief Return a session to the session pool of its worker.
+ * \param session
+ *      The session to return, all its sockets must have been closed.
+ */
+static void ReleaseSession(vsftpSession_s *session)
+{
+    vsftpWorker_s *worker = session->worker;
+
+    /* Argument checks are performed by the caller. */
+
+    session->isInUse = false;
+    session->nextFree = worker->freeSessions;
+    worker->freeSessions = session;
+    __atomic_store_n(&worker->sessionCount, worker->sessionCount - 1U, __ATOMIC_RELAXED);
+
+    ReleaseClient(&session->client);
+}
+
+/*!
+ * \brief Get the first port of the passive port pool.
+ * \returns The index of the port relative to the first passive port, 1 when the first one is the shared passive port.
+ */
+static size_t FirstPooledPasvPort(void)
+{
+    return (serverData.options.pasvShared == true) ? 1U : 0U;
+}
+
+/*!
+ * \brief Create the listeners of a worker's passive ports.
+ * \details
+ *      Every passive port gets a listener that stays bound and listening, so a PASV only leases one from the free-list.
+ *      Worker 'n' owns every n'th port of the pool. A port that can not be bound, or that is still leased by the
+ *      previous process, is left out of the pool.
+ * \param worker
+ *      The worker to create the listeners for.
+ */
+static void CreatePasvListeners(vsftpWorker_s *worker)
+{
+    vsftpPasvListener_s *listener = NULL;
+    struct sockaddr_in addr;
+    size_t created = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    worker->freePasvListeners = NULL;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    for (size_t i = FirstPooledPasvPort() + worker->id; i < serverData.pasvListenersLen;
+         i += serverData.options.workers) {
+        listener = &pasvListeners[i];
+        listener->port = (uint16_t)(serverData.options.pasvPortMin + i);
+        listener->isLeased = false;
+        addr.sin_port = htons(listener->port);
+        if (listener->isReserved == true) {
+            /* Connections to it must reach the previous process. */
+            listener->sock = -1;
+        } else if (CreatePassiveSocket(listener->port, &listener->sock, &addr, false, 1) == 0) {
+            listener->nextFree = worker->freePasvListeners;
+            worker->freePasvListeners = listener;
+            created++;
+        } else {
+            listener->sock = -1;
+        }
+    }
+
+    FTPLOG("Worker %u has %zu passive port(s)\n", worker->id, created);
+}
+
+/*!
+ * \brief Close the listeners of a worker's passive ports.
+ * \param worker
+ *      The worker to close the listeners for, none of them may be leased.
+ */
+static void ClosePasvListeners(vsftpWorker_s *worker)
+{
+    /* Argument checks are performed by the caller. */
+
+    for (size_t i = FirstPooledPasvPort() + worker->id; i < serverData.pasvListenersLen;
+         i += serverData.options.workers) {
+        if (pasvListeners[i].sock != -1) {
+            (void)close(pasvListeners[i].sock);
+            pasvListeners[i].sock = -1;
+        }
+    }
+
+    worker->freePasvListeners = NULL;
+}
+
+/*!
+ * \brief Lease a passive port listener from the free-list of a worker.
+ * \details
+ *      No listeners are leased while the listeners are handed over to the next process or after that.
+ * \param worker
+ *      The worker to lease the listener from.
+ * \returns A pointer to the listener or NULL when all passive ports of the worker are in use.
+ */
+static vsftpPasvListener_s *LeasePasvListener(vsftpWorker_s *worker)
+{
+    vsftpPasvListener_s *listener = worker->freePasvListeners;
+
+    /* Argument checks are performed by the caller. */
+
+    if (listener != NULL) {
+        /* Marked before the handoff is checked, worker 0 sets the handoff before it reads the marks, so either the
+         * port is refused here or the next process is told about it.
+         */
+        __atomic_store_n(&listener->isLeased, true, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&serverData.isHandingOff, __ATOMIC_SEQ_CST) == true) ||
+            (__atomic_load_n(&serverData.isDraining, __ATOMIC_SEQ_CST) == true)) {
+            __atomic_store_n(&listener->isLeased, false, __ATOMIC_RELEASE);
+            listener = NULL;
+        } else {
+            worker->freePasvListeners = listener->nextFree;
+        }
+    }
+
+    return listener;
+}
+
+/*!
+ * \brief Return a leased passive port listener to the free-list of its worker.
+ * \details
+ *      Connections that are still queued were meant for the previous lease, they are closed. While draining the
+ *      listener is closed instead, the next process serves the passive ports.
+ * \param worker
+ *      The worker that owns the listener.
+ * \param listener
+ *      The listener to return.
+ */
+static void ReturnPasvListener(vsftpWorker_s *worker, vsftpPasvListener_s *listener)
+{
+    int sock = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    /* The listener is reused by another session, it must not report events to this one anymore. */
+    (void)epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, listener->sock, NULL);
+
+    while ((sock = accept4(listener->sock, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        (void)close(sock);
+    }
+    __atomic_store_n(&listener->isLeased, false, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == true) {
+        (void)close(listener->sock);
+        listener->sock = -1;
+    } else {
+        listener->nextFree = worker->freePasvListeners;
+        worker->freePasvListeners = listener;
+    }
+}
+
+/*!
+ * \brief Add a data connection waiter at the end of a list.
+ * \param list
+ *      The list to add the waiter to.
+ * \param waiter
+ *      The waiter to add, it must not be part of a list.
+ */
+static void AppendDataWaiter(vsftpDataWaiterList_s *list, vsftpDataWaiter_s *waiter)
+{
+    /* Argument checks are performed by the caller. */
+
+    waiter->next = NULL;
+    waiter->prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->next = waiter;
+    } else {
+        list->head = waiter;
+    }
+    list->tail = waiter;
+}
+
+/*!
+ * \brief Remove a data connection waiter from the list it is part of.
+ * \param list
+ *      The list the waiter is part of.
+ * \param waiter
+ *      The waiter to remove.
+ */
+static void RemoveDataWaiter(vsftpDataWaiterList_s *list, vsftpDataWaiter_s *waiter)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (waiter->prev != NULL) {
+        waiter->prev->next = waiter->next;
+    } else {
+        list->head = waiter->next;
+    }
+    if (waiter->next != NULL) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        list->tail = waiter->prev;
+    }
+    waiter->next = NULL;
+    waiter->prev = NULL;
+}
+
+/*!
+ * \brief Queue a session for a data connection on the shared passive port.
+ * \details
+ *      Only one session per client address can wait on the shared passive port, the data connections of two sessions
+ *      from the same address can not be told apart.
+ * \param session
+ *      The session that issued the PASV.
+ * \returns true when the session is queued, false when another session of the client address already waits.
+ */
+static bool QueueDataWaiter(vsftpSession_s *session)
+{
+    vsftpDataDemux_s *demux = &serverData.dataDemux;
+    vsftpDataWaiter_s *waiter = &session->dataWaiter;
+    vsftpDataWaiterList_s *waiting = NULL;
+    vsftpDataWaiter_s *other = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    waiter->session = session;
+    waiter->addr = session->client.sin_addr.s_addr;
+    waiter->sock = -1;
+    waiting = &demux->waiting[HashClientAddress(waiter->addr)];
+
+    (void)pthread_mutex_lock(&demux->mutex);
+    for (other = waiting->head; (other != NULL) && (other->addr != waiter->addr); other = other->next) {
+        /* Another client with the same hash. */
+    }
+    if (other == NULL) {
+        AppendDataWaiter(waiting, waiter);
+        waiter->state = DATA_WAITER_WAITING;
+    }
+    (void)pthread_mutex_unlock(&demux->mutex);
+
+    session->isDataWaiterQueued = (other == NULL);
+
+    return session->isDataWaiterQueued;
+}
+
+/*!
+ * \brief Take a session out of the queue for a data connection on the shared passive port.
+ * \details
+ *      A data connection that was already matched to the session, but not taken yet, is closed.
+ * \param session
+ *      The session to take out of the queue.
+ */
+static void CancelDataWaiter(vsftpSession_s *session)
+{
+    vsftpDataDemux_s *demux = &serverData.dataDemux;
+    vsftpDataWaiter_s *waiter = &session->dataWaiter;
+    int sock = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&demux->mutex);
+    if (waiter->state == DATA_WAITER_WAITING) {
+        RemoveDataWaiter(&demux->waiting[HashClientAddress(waiter->addr)], waiter);
+    } else if (waiter->state == DATA_WAITER_DELIVERED) {
+        RemoveDataWaiter(&demux->delivered[session->worker->id], waiter);
+        sock = waiter->sock;
+    }
+    waiter->state = DATA_WAITER_IDLE;
+    (void)pthread_mutex_unlock(&demux->mutex);
+
+    if (sock != -1) {
+        (void)close(sock);
+    }
+
+    session->isDataWaiterQueued = false;
+}
+
+/*!
+ * \brief Match a data connection on the shared passive port to the session waiting for it.
+ * \details
+ *      The connection goes to the session of the same client address that waits on the shared passive port.
+ * \param sock
+ *      The data connection.
+ * \param client
+ *      The address of the peer.
+ * \returns A pointer to the worker of the matched session or NULL when no session waits for the connection.
+ */
+static vsftpWorker_s *MatchDataConnection(const int sock, const struct sockaddr_in *client)
+{
+    vsftpDataDemux_s *demux = &serverData.dataDemux;
+    vsftpDataWaiterList_s *waiting = &demux->waiting[HashClientAddress(client->sin_addr.s_addr)];
+    vsftpDataWaiter_s *waiter = NULL;
+    vsftpWorker_s *worker = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&demux->mutex);
+    for (waiter = waiting->head; (waiter != NULL) && (waiter->addr != client->sin_addr.s_addr);
+         waiter = waiter->next) {
+        /* Another client with the same hash. */
+    }
+    if (waiter != NULL) {
+        RemoveDataWaiter(waiting, waiter);
+        worker = waiter->session->worker;
+        waiter->sock = sock;
+        waiter->state = DATA_WAITER_DELIVERED;
+        AppendDataWaiter(&demux->delivered[worker->id], waiter);
+    }
+    (void)pthread_mutex_unlock(&demux->mutex);
+
+    return worker;
+}
+
+/*!
+ * \brief Accept the data connections on the shared passive port and hand them to their sessions.
+ * \details
+ *      Connections of sessions of other workers are handed over through the mailbox of that worker.
+ * \param worker
+ *      The worker whose listener on the shared passive port is readable.
+ */
+static void AcceptDataConnections(vsftpWorker_s *worker)
+{
+    struct sockaddr_in client;
+    socklen_t c = sizeof(client);
+    vsftpWorker_s *owner = NULL;
+    bool isOwnDelivered = false;
+    const uint64_t one = 1;
+    int sock = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    for (unsigned int i = 0; i < ACCEPT_BATCH_MAX; i++) {
+        c = sizeof(client);
+        sock = accept4(worker->dataSock, (struct sockaddr *)&client, &c, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if ((errno != ECONNABORTED) && (errno != EINTR)) {
+                /* No incoming connection (anymore), or an error that the next readable event retries. */
+                break;
             }
+            continue;
         }
+
+        owner = MatchDataConnection(sock, &client);
+        if (owner == NULL) {
+            FTPLOG("No session waits for a data connection from this client address\n");
+            (void)close(sock);
+        } else if (owner == worker) {
+            isOwnDelivered = true;
+        } else if (write(owner->mailboxFd, &one, sizeof(one)) != sizeof(one)) {
+            FTPLOG("Mailbox write failed with error %d\n", errno);
+        }
+    }
+
+    if (isOwnDelivered == true) {
+        TakeDataConnections(worker);
+    }
+}
+
+/*!
+ * \brief Check if no other process listens on the shared passive port.
+ * \details
+ *      A socket without SO_REUSEPORT can only listen on the port when no listener is left on it. Connections that were
+ *      accepted on it do not count, see CreatePassiveSocket().
+ * \returns true if the port is free, otherwise false.
+ */
+static bool IsSharedPasvPortFree(void)
+{
+    struct sockaddr_in addr;
+    const int option = 1;
+    bool isFree = false;
+    int sock = -1;
+
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(serverData.options.pasvPortMin);
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((sock != -1) && (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == 0)) {
+        /* With SO_REUSEADDR a listener on the port is only noticed by listen(). */
+        isFree = (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) && (listen(sock, 1) == 0);
+    }
+
+    if (sock != -1) {
+        (void)close(sock);
+    }
+
+    return isFree;
+}
+
+/*!
+ * \brief Create the listener of a worker on the shared passive port.
+ * \param worker
+ *      The worker to create the listener for.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int OpenSharedPasvPort(vsftpWorker_s *worker)
+{
+    struct sockaddr_in addr;
+    struct epoll_event event;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(serverData.options.pasvPortMin);
+    retval = CreatePassiveSocket(serverData.options.pasvPortMin, &worker->dataSock, &addr, false,
+                                 (int)serverData.options.backlog);
+    if (retval != 0) {
+        worker->dataSock = -1;
     } else {
-        if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
-            /* No incoming connection. */
+        event.events = EPOLLIN;
+        event.data.ptr = &worker->dataEvent;
+        retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->dataSock, &event);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Create the listener on the shared passive port once the previous process closed its listeners.
+ * \details
+ *      The previous process closes them once its sessions that wait on the port got their data connection or gave up,
+ *      which is at most PASV_SHARED_EXPIRY_S after the handoff. Until then PASV is served from the passive port pool,
+ *      so that no data connection is queued on a listener of the wrong process.
+ * \param timer
+ *      The timer of the worker that waits for the shared passive port.
+ */
+static void SharedPasvPortTimeout(vsftpTimer_s *timer)
+{
+    vsftpWorker_s *worker = timer->arg;
+
+    if ((__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == true) || (worker->dataSock != -1)) {
+        /* Handed over again meanwhile, or already open. */
+    } else if ((__atomic_load_n(&serverData.isSharedPortBusy, __ATOMIC_ACQUIRE) == true) &&
+               (IsSharedPasvPortFree() == false)) {
+        VSFTPTimerStart(&worker->timers, timer, PASV_SHARED_RETRY_MS);
+    } else {
+        /* Once free, the other workers bind it without checking, their listeners would make it look busy. */
+        __atomic_store_n(&serverData.isSharedPortBusy, false, __ATOMIC_RELEASE);
+        if (OpenSharedPasvPort(worker) == 0) {
+            FTPLOG("Worker %u took the shared passive port over from the previous process\n", worker->id);
         } else {
-            FTPLOG("Socket listen failed with error %d\n", errno);
-            (void)VSFTPServerStop();
+            FTPLOG("Worker %u could not listen on the shared passive port, error %d\n", worker->id, errno);
+            VSFTPTimerStart(&worker->timers, timer, PASV_SHARED_RETRY_MS);
         }
     }
+}
+
+/*!
+ * \brief Take the data connections that were matched to sessions of a worker.
+ * \details
+ *      A command that waits for its data connection is resumed, otherwise the connection is parked in the session.
+ * \param worker
+ *      The worker to take the data connections for.
+ */
+static void TakeDataConnections(vsftpWorker_s *worker)
+{
+    vsftpDataDemux_s *demux = &serverData.dataDemux;
+    vsftpDataWaiter_s *waiters = NULL;
+    vsftpDataWaiter_s *waiter = NULL;
+    vsftpSession_s *session = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&demux->mutex);
+    waiters = demux->delivered[worker->id].head;
+    demux->delivered[worker->id].head = NULL;
+    demux->delivered[worker->id].tail = NULL;
+    for (waiter = waiters; waiter != NULL; waiter = waiter->next) {
+        waiter->state = DATA_WAITER_IDLE;
+    }
+    (void)pthread_mutex_unlock(&demux->mutex);
+
+    /* Only this worker uses waiters that are not queued, the list stays intact without the lock. */
+    while (waiters != NULL) {
+        waiter = waiters;
+        waiters = waiter->next;
+        session = waiter->session;
+
+        session->isDataWaiterQueued = false;
+        session->transferClientSock = waiter->sock;
+        PrepareTransferClientSocket(session);
+        VSFTPTimerStop(&worker->timers, &session->transferTimer);
+        if ((session->isAcceptPending == true) && (session->isDisconnectPending == false)) {
+            session->isAcceptPending = false;
+            (void)ResumeCommand(session);
+        }
+    }
+}
+
+/*!
+ * \brief Get the preferred entry of a client address in the client table.
+ * \param addr
+ *      The client address.
+ * \returns The index of the entry.
+ */
+static size_t HashClientAddress(const uint32_t addr)
+{
+    /* Fibonacci hashing, spreads neighbouring addresses over the table. */
+    return (size_t)((uint32_t)(addr * 2654435761U) >> (32U - CLIENT_TABLE_BITS));
+}
+
+/*!
+ * \brief Find the entry of a client address in the client table, the caller holds the mutex of the table.
+ * \param addr
+ *      The client address.
+ * \returns The index of the entry of the address, or of the free entry where it would be added.
+ */
+static size_t FindClient(const uint32_t addr)
+{
+    const vsftpClientTable_s *table = &serverData.clients;
+    size_t i = HashClientAddress(addr);
+
+    while ((table->entries[i].addr != 0) && (table->entries[i].addr != addr)) {
+        i = (i + 1U) & (CLIENT_TABLE_LEN - 1U);
+    }
+
+    return i;
+}
+
+/*!
+ * \brief Count a new session of a client, unless that would exceed the session limits.
+ * \param client
+ *      The address of the client.
+ * \returns ADMISSION_ACCEPTED when the session is counted, otherwise the limit that would be exceeded.
+ */
+static vsftpAdmission_e AdmitClient(const struct sockaddr_in *client)
+{
+    vsftpClientTable_s *table = &serverData.clients;
+    const uint32_t addr = client->sin_addr.s_addr;
+    vsftpAdmission_e admission = ADMISSION_ACCEPTED;
+    size_t i = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&table->mutex);
+
+    i = FindClient(addr);
+
+    if ((serverData.options.maxClients > 0) && (table->total >= serverData.options.maxClients)) {
+        admission = ADMISSION_SERVER_FULL;
+    } else if ((serverData.options.maxClientsPerIp > 0) &&
+               (table->entries[i].count >= serverData.options.maxClientsPerIp)) {
+        admission = ADMISSION_CLIENT_FULL;
+    } else {
+        if (table->entries[i].count == 0) {
+            VSFTPTokenBucketInitialize(&table->entries[i].bucket, (uint64_t)serverData.options.rateLimitPerIp * 1024U);
+        }
+        table->entries[i].addr = addr;
+        table->entries[i].count++;
+        table->total++;
+    }
+
+    (void)pthread_mutex_unlock(&table->mutex);
+
+    return admission;
+}
+
+/*!
+ * \brief Uncount a session of a client.
+ * \details
+ *      When this was the last session of the client its entry is freed. The entries that follow it are moved back
+ *      where needed, so every entry stays reachable from its preferred index without gaps.
+ * \param client
+ *      The address of the client, it must have been admitted.
+ */
+static void ReleaseClient(const struct sockaddr_in *client)
+{
+    vsftpClientTable_s *table = &serverData.clients;
+    const uint32_t addr = client->sin_addr.s_addr;
+    size_t i = 0;
+    size_t j = 0;
+    size_t home = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&table->mutex);
+
+    i = FindClient(addr);
+
+    if (table->entries[i].addr == addr) {
+        table->total--;
+        table->entries[i].count--;
+    }
+
+    if ((table->entries[i].addr == addr) && (table->entries[i].count == 0)) {
+        table->entries[i].addr = 0;
+
+        j = (i + 1U) & (CLIENT_TABLE_LEN - 1U);
+        while (table->entries[j].addr != 0) {
+            home = HashClientAddress(table->entries[j].addr);
+            /* Move the entry into the gap, unless its preferred index lies (cyclically) between the gap and itself. */
+            if (((j - home) & (CLIENT_TABLE_LEN - 1U)) >= ((j - i) & (CLIENT_TABLE_LEN - 1U))) {
+                table->entries[i] = table->entries[j];
+                table->entries[j].addr = 0;
+                table->entries[j].count = 0;
+                i = j;
+            }
+            j = (j + 1U) & (CLIENT_TABLE_LEN - 1U);
+        }
+    }
+
+    (void)pthread_mutex_unlock(&table->mutex);
+}
+
+/*!
+ * \brief Check if a worker should refuse new sessions to keep serving its existing ones.
+ * \details
+ *      A worker is overloaded when its iterations take longer than the shedding latency on average, or when the
+ *      offload queue is filling up.
+ * \param worker
+ *      The worker.
+ * \returns true when the worker is overloaded or false otherwise.
+ */
+static bool IsOverloaded(const vsftpWorker_s *worker)
+{
+    bool isOverloaded = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((serverData.options.shedLatency > 0) &&
+        (worker->loopTimeUs > ((uint64_t)serverData.options.shedLatency * 1000U))) {
+        isOverloaded = true;
+    } else if ((serverData.options.offloadThreads > 0) && (VSFTPOffloadGetQueueDepth() >= SHED_QUEUE_DEPTH)) {
+        isOverloaded = true;
+    }
+
+    return isOverloaded;
+}
+
+/*!
+ * \brief Create a session for an accepted client connection.
+ * \details
+ *      The client is greeted when the session is set up, refused when the session pool is exhausted and disconnected
+ *      when anything else fails. Either way only this client is affected.
+ * \param worker
+ *      The worker to create the session on.
+ * \param sock
+ *      The non-blocking socket of the accepted client connection.
+ * \param client
+ *      A pointer to the address of the client.
+ */
+static void OpenSession(vsftpWorker_s *worker, const int sock, const struct sockaddr_in *client)
+{
+    struct epoll_event event;
+    vsftpSession_s *session = NULL;
+    vsftpAdmission_e admission = ADMISSION_ACCEPTED;
+    const char *refusal = NULL;
+    size_t sent = 0;
+    int option = 1;
+    int keepIdle = KEEPALIVE_IDLE_S;
+    int keepInterval = KEEPALIVE_INTERVAL_S;
+    int keepCount = KEEPALIVE_COUNT;
+    unsigned int userTimeout = USER_TIMEOUT_MS;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    FTPLOG("Client socket %d connection accepted by worker %u\n", sock, worker->id);
+
+    /* Refuse as early as possible, before anything is set up for the client. */
+    if (IsOverloaded(worker) == true) {
+        worker->shed++;
+        refusal = "421 Service not available, closing control connection.\r\n";
+    } else {
+        admission = AdmitClient(client);
+        if (admission == ADMISSION_SERVER_FULL) {
+            worker->refused++;
+            refusal = "421 Too many users.\r\n";
+        } else if (admission == ADMISSION_CLIENT_FULL) {
+            worker->refused++;
+            refusal = "421 Too many connections from your address.\r\n";
+        } else {
+            session = AllocateSession(worker);
+            if (session == NULL) {
+                ReleaseClient(client);
+                refusal = "421 Too many users.\r\n";
+            }
+        }
+    }
+
+    if (refusal != NULL) {
+        FTPLOG("Refusing client socket %d: %s", sock, refusal);
+        (void)SendOwnSock(sock, refusal, strlen(refusal), &sent);
+        (void)close(sock);
+    } else {
+        session->clientSock = sock;
+        session->client = *client;
+
+        /* ABOR is sent as urgent data (Telnet Synch), keep it in the stream so the command is received in full. */
+        retval = setsockopt(sock, SOL_SOCKET, SO_OOBINLINE, &option, sizeof(option));
+
+        /* Find out about peers that vanished without closing the connection, instead of keeping their session. */
+        if (retval == 0) {
+            retval = setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+        }
+        if (retval == 0) {
+            retval = setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(keepIdle));
+        }
+        if (retval == 0) {
+            retval = setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(keepInterval));
+        }
+        if (retval == 0) {
+            retval = setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(keepCount));
+        }
+        if (retval == 0) {
+            retval = setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+        }
+
+        if (retval == 0) {
+            ApplySocketProfile(sock, SOCKET_PROFILE_CONTROL, false);
+
+            event.events = EPOLLIN;
+            event.data.ptr = &session->controlEvent;
+            retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event);
+        }
+
+        /* Set cwd to rootdir. */
+        if (retval == 0) {
+            retval = VSFTPServerSetCwd(session, serverData.rootPath, serverData.rootPathLen);
+        }
+
+        if (retval == 0) {
+            retval = VSFTP_SEND_REPLY(session, "220 Service ready for new user.");
+        }
+
+        if ((retval == 0) && (GetIdleTimeoutMs() > 0)) {
+            VSFTPTimerStart(&worker->timers, &session->idleTimer, GetIdleTimeoutMs());
+        }
+
+        if (retval != 0) {
+            (void)VSFTPServerClientDisconnect(session);
+        }
+    }
+}
+
+/*!
+ * \brief Accept the client connections queued on the listening socket of a worker.
+ * \details
+ *      This is a non-blocking call, it is called when the listening socket of 'worker' is readable. At most
+ *      ACCEPT_BATCH_MAX connections are accepted, the listener stays readable when more are queued.
+ * \param worker
+ *      The worker that owns the listening socket.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int AcceptIncomingConnections(vsftpWorker_s *worker)
+{
+    struct sockaddr_in client;
+    socklen_t c = sizeof(client);
+    int sock = -1;
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    for (unsigned int i = 0; i < ACCEPT_BATCH_MAX; i++) {
+        c = sizeof(client);
+        sock = accept4(worker->serverSock, (struct sockaddr *)&client, &c, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock >= 0) {
+            OpenSession(worker, sock, &client);
+        } else if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+            /* No incoming connection (anymore). */
+            break;
+        } else if ((errno == ECONNABORTED) || (errno == EINTR)) {
+            /* This connection is gone, try the next. */
+        } else {
+            /* Restart this worker, the next iteration creates a new server socket. */
+            FTPLOG("Socket accept failed with error %d\n", errno);
+            StopWorker(worker);
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Queue an accepted client connection for a worker.
+ * \details
+ *      To be called by the acceptor thread only.
+ * \param ring
+ *      The ring of the worker.
+ * \param client
+ *      The accepted client connection.
+ * \returns true when the connection is queued or false when the ring is full.
+ */
+static bool PushAcceptedClient(vsftpAcceptRing_s *ring, const vsftpAcceptedClient_s *client)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    bool isPushed = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((tail - head) < ACCEPT_RING_LEN) {
+        ring->clients[tail % ACCEPT_RING_LEN] = *client;
+        /* Publish the entry before the worker can see the new tail. */
+        __atomic_store_n(&ring->tail, tail + 1U, __ATOMIC_RELEASE);
+        isPushed = true;
+    }
+
+    return isPushed;
+}
+
+/*!
+ * \brief Take the oldest accepted client connection queued for a worker.
+ * \details
+ *      To be called by the thread of the worker only.
+ * \param ring
+ *      The ring of the worker.
+ * \param[out] client
+ *      A pointer to the storage location for the accepted client connection.
+ * \returns true when a connection is taken or false when the ring is empty.
+ */
+static bool PopAcceptedClient(vsftpAcceptRing_s *ring, vsftpAcceptedClient_s *client)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    bool isPopped = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if (head != tail) {
+        *client = ring->clients[head % ACCEPT_RING_LEN];
+        /* Hand the slot back to the acceptor only after it has been copied. */
+        __atomic_store_n(&ring->head, head + 1U, __ATOMIC_RELEASE);
+        isPopped = true;
+    }
+
+    return isPopped;
+}
+
+/*!
+ * \brief Create sessions for the client connections the acceptor thread handed over to a worker.
+ * \details
+ *      The acceptor signals the worker's mailbox after queueing, so this is called whenever the mailbox is readable.
+ * \param worker
+ *      The worker to create the sessions on.
+ */
+static void TakeHandedOverConnections(vsftpWorker_s *worker)
+{
+    vsftpAcceptedClient_s client;
+    struct timespec now;
+    uint64_t handOverTimeUs = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    while (PopAcceptedClient(&worker->acceptRing, &client) == true) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &now);
+        handOverTimeUs = ElapsedUs(&client.acceptedAt, &now);
+        worker->handOvers++;
+        worker->handOverTimeTotalUs += handOverTimeUs;
+        if (handOverTimeUs > worker->handOverTimeMaxUs) {
+            worker->handOverTimeMaxUs = handOverTimeUs;
+        }
+
+        OpenSession(worker, client.sock, &client.client);
+    }
+}
+
+/*!
+ * \brief Find the worker a new client connection should be handed over to.
+ * \details
+ *      The load of a worker is the number of its sessions plus the connections still queued for it.
+ * \returns A pointer to the least loaded worker with room in its ring or NULL when all rings are full.
+ */
+static vsftpWorker_s *GetLeastLoadedWorker(void)
+{
+    vsftpWorker_s *leastLoaded = NULL;
+    vsftpWorker_s *worker = NULL;
+    size_t leastLoad = SIZE_MAX;
+    size_t queued = 0;
+    size_t load = 0;
+
+    for (unsigned int i = 0; i < serverData.options.workers; i++) {
+        worker = &serverData.workers[i];
+        queued = __atomic_load_n(&worker->acceptRing.tail, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&worker->acceptRing.head, __ATOMIC_RELAXED);
+        load = __atomic_load_n(&worker->sessionCount, __ATOMIC_RELAXED) + queued;
+        if ((queued < ACCEPT_RING_LEN) && (load < leastLoad)) {
+            leastLoaded = worker;
+            leastLoad = load;
+        }
+    }
+
+    return leastLoaded;
+}
+
+/*!
+ * \brief Accept the client connections queued on the acceptor's listening socket and hand them over to the workers.
+ * \details
+ *      At most ACCEPT_BATCH_MAX connections are accepted, every worker that received one is signalled once.
+ *      Connections that no worker has room for are refused.
+ */
+static void HandOverConnections(void)
+{
+    vsftpAcceptor_s *acceptor = &serverData.acceptor;
+    vsftpAcceptedClient_s client;
+    vsftpWorker_s *worker = NULL;
+    bool isSignalled[WORKERS_MAX] = { false };
+    const char tooManyUsers[] = "421 Too many users.\r\n";
+    struct tcp_info info;
+    socklen_t c = sizeof(client.client);
+    socklen_t infoLen = sizeof(info);
+    uint64_t signal = 1;
+    size_t sent = 0;
+    size_t batch = 0;
+
+    /* The kernel reports the length of a listener's accept queue as its unacknowledged segments. */
+    if ((getsockopt(acceptor->serverSock, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0) &&
+        (info.tcpi_unacked > acceptor->queueDepthMax)) {
+        acceptor->queueDepthMax = info.tcpi_unacked;
+    }
+
+    while (batch < ACCEPT_BATCH_MAX) {
+        c = sizeof(client.client);
+        client.sock = accept4(acceptor->serverSock, (struct sockaddr *)&client.client, &c,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client.sock >= 0) {
+            (void)clock_gettime(CLOCK_MONOTONIC, &client.acceptedAt);
+            acceptor->accepted++;
+            batch++;
+
+            worker = GetLeastLoadedWorker();
+            if ((worker != NULL) && (PushAcceptedClient(&worker->acceptRing, &client) == true)) {
+                isSignalled[worker->id] = true;
+            } else {
+                FTPLOG("No worker can take client socket %d, refusing it\n", client.sock);
+                acceptor->refused++;
+                (void)SendOwnSock(client.sock, tooManyUsers, sizeof(tooManyUsers) - 1, &sent);
+                (void)close(client.sock);
+            }
+        } else if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+            /* No incoming connection (anymore). */
+            break;
+        } else if ((errno == ECONNABORTED) || (errno == EINTR)) {
+            /* This connection is gone, try the next. */
+        } else {
+            /* F.e. out of file descriptors, back off instead of spinning on the readable listener. */
+            FTPLOG("Socket accept failed with error %d\n", errno);
+            (void)poll(NULL, 0, EPOLL_WAIT_TIMEOUT_MS);
+            break;
+        }
+    }
+
+    if (batch > acceptor->batchMax) {
+        acceptor->batchMax = batch;
+    }
+
+    for (unsigned int i = 0; i < serverData.options.workers; i++) {
+        if (isSignalled[i] == true) {
+            (void)write(serverData.workers[i].mailboxFd, &signal, sizeof(signal));
+        }
+    }
+}
+
+/*!
+ * \brief Entry point of the acceptor thread.
+ * \details
+ *      Waits (at most EPOLL_WAIT_TIMEOUT_MS at a time) for the listening socket to become readable and hands the
+ *      connections over to the workers, until the acceptor is stopped.
+ * \param arg
+ *      Not used.
+ * \returns NULL.
+ */
+static void *AcceptorThread(void *arg)
+{
+    struct pollfd listener;
+
+    (void)arg;
+
+    listener.fd = serverData.acceptor.serverSock;
+    listener.events = POLLIN;
+
+    while (serverData.acceptor.isRunning == true) {
+        /* Otherwise timed out (or interrupted), check if we should stop. */
+        if (poll(&listener, 1, EPOLL_WAIT_TIMEOUT_MS) > 0) {
+            HandOverConnections();
+        }
+    }
+
+    return NULL;
+}
+
+/*!
+ * \brief Start the acceptor thread.
+ * \details
+ *      Creates the single listening socket on the server port, the workers do not have one of their own.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int StartAcceptor(void)
+{
+    vsftpAcceptor_s *acceptor = &serverData.acceptor;
+    int retval = -1;
+
+    acceptor->server.sin_family = AF_INET;
+    acceptor->server.sin_addr.s_addr = INADDR_ANY;
+    acceptor->server.sin_port = htons(serverData.port);
+    acceptor->accepted = 0;
+    acceptor->refused = 0;
+    acceptor->batchMax = 0;
+    acceptor->queueDepthMax = 0;
+
+    acceptor->serverSock = TakeInheritedSocket(0);
+    if (acceptor->serverSock != -1) {
+        retval = 0;
+    } else {
+        retval = CreatePassiveSocket((in_port_t)serverData.port, &acceptor->serverSock, &acceptor->server, false,
+                                     (int)serverData.options.backlog);
+        if (retval != 0) {
+            acceptor->serverSock = -1;
+        }
+    }
+
+    if (retval == 0) {
+        acceptor->isRunning = true;
+        retval = pthread_create(&acceptor->thread, NULL, AcceptorThread, NULL);
+        if (retval == 0) {
+            acceptor->isThreadCreated = true;
+        } else {
+            FTPLOG("Could not create acceptor thread, error %d\n", retval);
+            acceptor->isRunning = false;
+        }
+    }
+
+    if (retval != 0) {
+        StopAcceptor();
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Stop the acceptor thread and close its listening socket.
+ * \details
+ *      Connections that are already handed over are served (or closed) by their worker.
+ */
+static void StopAcceptor(void)
+{
+    vsftpAcceptor_s *acceptor = &serverData.acceptor;
+
+    acceptor->isRunning = false;
+    if (acceptor->isThreadCreated == true) {
+        (void)pthread_join(acceptor->thread, NULL);
+        acceptor->isThreadCreated = false;
+
+        FTPLOG("Acceptor accepted %llu connections and refused %llu, batch max %zu, accept queue depth max %zu\n",
+               (unsigned long long)acceptor->accepted, (unsigned long long)acceptor->refused, acceptor->batchMax,
+               acceptor->queueDepthMax);
+    }
+
+    if (acceptor->serverSock != -1) {
+        CloseServerSocket(&acceptor->serverSock);
+    }
+}
+
+/*!
+ * \brief Close a listening socket on the server port.
+ * \details
+ *      Once the listeners are handed over to the next process they are shared with it, then the socket is only
+ *      closed, a shutdown would stop the listener for the next process too.
+ * \param[in,out] sock
+ *      A pointer to the socket to close, it is set to -1.
+ */
+static void CloseServerSocket(int *sock)
+{
+    /* Argument checks are performed by the caller. */
+
+    FTPLOG("Closing server socket %d\n", *sock);
+    if (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == false) {
+        (void)shutdown(*sock, SHUT_RDWR);
+    }
+    (void)close(*sock);
+    *sock = -1;
+}
+
+/*!
+ * \brief Take a listening socket that was handed over by the previous process.
+ * \param index
+ *      The index of the socket, the worker id (or 0 for the acceptor).
+ * \returns The socket, or -1 when there is no (unused) socket with this index.
+ */
+static int TakeInheritedSocket(const unsigned int index)
+{
+    int sock = -1;
+
+    if ((index < serverData.inheritedCount) && (serverData.inheritedSocks[index] != -1)) {
+        sock = serverData.inheritedSocks[index];
+        serverData.inheritedSocks[index] = -1;
+
+        /* Apply our own backlog, the socket keeps listening meanwhile. */
+        if (listen(sock, (int)serverData.options.backlog) != 0) {
+            FTPLOG("Socket listen failed with error %d\n", errno);
+        }
+        FTPLOG("Socket %d on port %d taken over from the previous process\n", sock, serverData.port);
+    }
+
+    return sock;
+}
+
+/*!
+ * \brief Close the listening sockets handed over by the previous process that are not used.
+ * \details
+ *      This happens when this process runs fewer workers than the previous one. Connections queued on them are lost.
+ */
+static void CloseInheritedSockets(void)
+{
+    for (unsigned int i = 0; i < serverData.inheritedCount; i++) {
+        if (serverData.inheritedSocks[i] != -1) {
+            FTPLOG("Closing unused server socket %d of the previous process\n", serverData.inheritedSocks[i]);
+            (void)close(serverData.inheritedSocks[i]);
+            serverData.inheritedSocks[i] = -1;
+        }
+    }
+
+    serverData.inheritedCount = 0;
+}
+
+/*!
+ * \brief Take the listening sockets over from the process that serves on the handoff socket.
+ * \details
+ *      The previous process sends its listeners (SCM_RIGHTS), we acknowledge them and it starts draining. Once it
+ *      closes the connection, it has removed its handoff socket and we can create ours. The passive ports its sessions
+ *      still lease are left out of our pool, so that their data connections reach the previous process. The same goes
+ *      for the shared passive port, until the previous process closed it, see SharedPasvPortTimeout().
+ *      When no process serves on the handoff socket, nothing is taken over and the listeners are created as usual.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int TakeOverListeners(void)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000U, (HANDOFF_TIMEOUT_MS % 1000U) * 1000U };
+    const size_t headerLen = offsetof(vsftpHandoffMessage_s, leased);
+    char control[CMSG_SPACE(sizeof(int) * WORKERS_MAX)];
+    vsftpHandoffMessage_s message;
+    struct cmsghdr *cmsg = NULL;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t numRecv = 0;
+    ssize_t rest = 0;
+    size_t messageLen = 0;
+    size_t reserved = 0;
+    size_t index = 0;
+    const char ack = HANDOFF_ACK;
+    char eof = 0;
+    int sock = -1;
+    int retval = -1;
+
+    for (size_t i = 0; i < PASV_PORTS_MAX; i++) {
+        pasvListeners[i].isReserved = false;
+    }
+    serverData.isSharedPortBusy = false;
+
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void)strncpy(addr.sun_path, serverData.options.handoffPath, sizeof(addr.sun_path) - 1);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        FTPLOG("Could not create handoff socket, error %d\n", errno);
+    } else if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        /* No previous process (anymore). */
+        retval = 1;
+    } else {
+        retval = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    if (retval == 0) {
+        (void)memset(&msg, 0, sizeof(msg));
+        (void)memset(&message, 0, sizeof(message));
+        iov.iov_base = &message;
+        iov.iov_len = sizeof(message);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        numRecv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (numRecv < (ssize_t)sizeof(message.count)) {
+            FTPLOG("Could not receive the listeners of the previous process, error %d\n", errno);
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) &&
+            (message.count <= WORKERS_MAX) && ((cmsg->cmsg_len - CMSG_LEN(0)) == (message.count * sizeof(int)))) {
+            (void)memcpy(serverData.inheritedSocks, CMSG_DATA(cmsg), message.count * sizeof(int));
+            serverData.inheritedCount = message.count;
+        } else {
+            FTPLOG("Invalid handoff message from the previous process\n");
+            retval = -1;
+        }
+    }
+
+    if ((retval == 0) && ((size_t)numRecv >= headerLen)) {
+        messageLen = headerLen + ((size_t)message.leasedLen * sizeof(uint16_t));
+        if (message.leasedLen > PASV_PORTS_MAX) {
+            messageLen = 0;
+        } else if ((size_t)numRecv < messageLen) {
+            /* The leased ports may arrive separately from the listeners. */
+            rest = recv(sock, (char *)&message + numRecv, messageLen - (size_t)numRecv, MSG_WAITALL);
+            numRecv += (rest > 0) ? rest : 0;
+        }
+
+        if ((size_t)numRecv != messageLen) {
+            FTPLOG("Invalid handoff message from the previous process\n");
+            retval = -1;
+        }
+    }
+
+    if ((retval == 0) && ((size_t)numRecv >= headerLen)) {
+        serverData.isSharedPortBusy = (message.isSharedPortBusy != 0) && (serverData.options.pasvShared == true);
+        for (size_t i = 0; i < message.leasedLen; i++) {
+            index = (size_t)message.leased[i] - serverData.options.pasvPortMin;
+            if ((message.leased[i] >= serverData.options.pasvPortMin) && (index < serverData.pasvListenersLen)) {
+                pasvListeners[index].isReserved = true;
+                reserved++;
+            }
+        }
+    }
+
+    if (retval == 0) {
+        if (send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) != (ssize_t)sizeof(ack)) {
+            FTPLOG("Could not acknowledge the handoff, error %d\n", errno);
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        /* Wait for the previous process to let go of the handoff socket. */
+        (void)recv(sock, &eof, sizeof(eof), 0);
+        FTPLOG("Took over %u listener(s) from the previous process, %zu passive port(s) are still in use by it\n",
+               serverData.inheritedCount, reserved);
+    } else if (retval > 0) {
+        retval = 0;
+    } else {
+        /* The previous process keeps serving when it gets no acknowledgement, it is safe to start without them. */
+        CloseInheritedSockets();
+        for (size_t i = 0; i < PASV_PORTS_MAX; i++) {
+            pasvListeners[i].isReserved = false;
+        }
+        serverData.isSharedPortBusy = false;
+        retval = 0;
+    }
+
+    if (sock != -1) {
+        (void)close(sock);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Create the handoff socket, on which the next process can take over the listeners.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int StartHandoff(void)
+{
+    struct sockaddr_un addr;
+    int retval = -1;
+
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void)strncpy(addr.sun_path, serverData.options.handoffPath, sizeof(addr.sun_path) - 1);
+
+    /* A socket file left behind by a process that did not stop orderly. */
+    (void)unlink(addr.sun_path);
+
+    serverData.handoffSock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (serverData.handoffSock == -1) {
+        FTPLOG("Could not create handoff socket, error %d\n", errno);
+    } else if (bind(serverData.handoffSock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        FTPLOG("Could not bind handoff socket %s, error %d\n", addr.sun_path, errno);
+    } else if (listen(serverData.handoffSock, 1) != 0) {
+        FTPLOG("Handoff socket listen failed with error %d\n", errno);
+    } else {
+        serverData.handoffEvent.type = EVENT_SOURCE_HANDOFF;
+        serverData.handoffEvent.session = NULL;
+        serverData.handoffConnEvent.type = EVENT_SOURCE_HANDOFF_ACK;
+        serverData.handoffConnEvent.session = NULL;
+        VSFTPTimerInitialize(&serverData.handoffTimer, HandoffTimeout, &serverData.workers[0]);
+        retval = 0;
+    }
+
+    if ((retval != 0) && (serverData.handoffSock != -1)) {
+        (void)close(serverData.handoffSock);
+        serverData.handoffSock = -1;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Close and remove the handoff socket.
+ */
+static void StopHandoff(void)
+{
+    if (serverData.handoffSock != -1) {
+        (void)close(serverData.handoffSock);
+        serverData.handoffSock = -1;
+        (void)unlink(serverData.options.handoffPath);
+    }
+}
+
+/*!
+ * \brief Hand the listening sockets over to the next process that connected to the handoff socket.
+ * \details
+ *      Called by worker 0 when the handoff socket is readable. The listeners are sent right away, the acknowledgement
+ *      is received from the event loop, see ReceiveHandoffAck(), so that the sessions of worker 0 are not held up
+ *      while the next process takes over. One process is handed over to at a time, others are turned away.
+ *      From now on no passive ports are leased, the ones that are leased are sent along, see TakeOverListeners().
+ * \param worker
+ *      Worker 0, which owns the handoff socket.
+ */
+static void HandOffListeners(vsftpWorker_s *worker)
+{
+    char control[CMSG_SPACE(sizeof(int) * WORKERS_MAX)];
+    vsftpHandoffMessage_s message;
+    int socks[WORKERS_MAX];
+    struct epoll_event event;
+    struct cmsghdr *cmsg = NULL;
+    struct msghdr msg;
+    struct iovec iov;
+    uint32_t count = 0;
+    int sock = -1;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    sock = accept4(serverData.handoffSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ((sock != -1) && (serverData.handoffConn != -1)) {
+        FTPLOG("Another process is taking over the listeners, turning away the next one\n");
+    } else if (sock != -1) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        /* Set before the leases are read, see LeasePasvListener(). */
+        __atomic_store_n(&serverData.isHandingOff, true, __ATOMIC_SEQ_CST);
+        message.leasedLen = 0;
+        /* Its listeners stay open until the sessions that wait on it got their data connection. */
+        message.isSharedPortBusy = (serverData.options.pasvShared == true) ? 1U : 0U;
+        for (size_t i = FirstPooledPasvPort(); i < serverData.pasvListenersLen; i++) {
+            if (__atomic_load_n(&pasvListeners[i].isLeased, __ATOMIC_SEQ_CST) == true) {
+                message.leased[message.leasedLen++] = pasvListeners[i].port;
+            }
+        }
+
+        if (serverData.options.useAcceptor == true) {
+            socks[count++] = serverData.acceptor.serverSock;
+        } else {
+            for (unsigned int i = 0; i < serverData.options.workers; i++) {
+                if (serverData.workers[i].serverSock != -1) {
+                    socks[count++] = serverData.workers[i].serverSock;
+                }
+            }
+        }
+
+        (void)memset(&msg, 0, sizeof(msg));
+        (void)memset(control, 0, sizeof(control));
+        message.count = count;
+        iov.iov_base = &message;
+        iov.iov_len = offsetof(vsftpHandoffMessage_s, leased) + (message.leasedLen * sizeof(uint16_t));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        (void)memcpy(CMSG_DATA(cmsg), socks, sizeof(int) * count);
+
+        /* The kernel duplicates the sockets into the message, they may be closed as soon as this returns. The send
+         * buffer of a new connection is empty, so the small message does not block. */
+        if ((count == 0) || (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)) {
+            FTPLOG("Could not hand over the listeners, error %d\n", errno);
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &serverData.handoffConnEvent;
+        retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event);
+    }
+
+    if (retval == 0) {
+        serverData.handoffConn = sock;
+        serverData.handoffCount = count;
+        VSFTPTimerStart(&worker->timers, &serverData.handoffTimer, HANDOFF_TIMEOUT_MS);
+    } else if (sock != -1) {
+        (void)close(sock);
+        if (serverData.handoffConn == -1) {
+            __atomic_store_n(&serverData.isHandingOff, false, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*!
+ * \brief Close the connection to the next process that was handed the listeners, if any.
+ * \details
+ *      When the next process did not take the listeners over, passive ports are leased again.
+ * \param worker
+ *      Worker 0, which owns the connection.
+ */
+static void CloseHandoffConnection(vsftpWorker_s *worker)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (serverData.handoffConn != -1) {
+        VSFTPTimerStop(&worker->timers, &serverData.handoffTimer);
+        (void)epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, serverData.handoffConn, NULL);
+        (void)close(serverData.handoffConn);
+        serverData.handoffConn = -1;
+        __atomic_store_n(&serverData.isHandingOff, false, __ATOMIC_RELEASE);
+    }
+}
+
+/*!
+ * \brief Receive the acknowledgement of the next process that was handed the listeners.
+ * \details
+ *      Called by worker 0 when the connection to the next process is readable. Once the next process acknowledged the
+ *      listeners, this process stops accepting and drains, see DrainWorker(). Without acknowledgement it just keeps
+ *      serving.
+ * \param worker
+ *      Worker 0, which owns the connection.
+ */
+static void ReceiveHandoffAck(vsftpWorker_s *worker)
+{
+    ssize_t numRecv = 0;
+    char ack = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if (serverData.handoffConn != -1) {
+        numRecv = recv(serverData.handoffConn, &ack, sizeof(ack), 0);
+    }
+
+    if (serverData.handoffConn == -1) {
+        /* Already given up on while handling an earlier event. */
+    } else if ((numRecv == -1) && ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR))) {
+        /* Spurious wakeup, keep waiting. */
+    } else if ((numRecv != (ssize_t)sizeof(ack)) || (ack != HANDOFF_ACK)) {
+        FTPLOG("The next process did not take over the listeners, keep serving\n");
+        CloseHandoffConnection(worker);
+    } else {
+        FTPLOG("Handed over %u listener(s) to the next process, draining\n", serverData.handoffCount);
+        __atomic_store_n(&serverData.isDraining, true, __ATOMIC_RELEASE);
+        /* The next process creates its handoff socket once we closed the connection. */
+        StopHandoff();
+        StopAcceptor();
+        CloseHandoffConnection(worker);
+    }
+}
+
+/*!
+ * \brief Give up on a next process that did not acknowledge the listeners within HANDOFF_TIMEOUT_MS.
+ * \param timer
+ *      The handoff timer.
+ */
+static void HandoffTimeout(vsftpTimer_s *timer)
+{
+    vsftpWorker_s *worker = timer->arg;
+
+    FTPLOG("The next process did not acknowledge the listeners in time, keep serving\n");
+    CloseHandoffConnection(worker);
+}
+
+/*!
+ * \brief Check if a session waits for or uses a data connection.
+ * \param session
+ *      The session to check.
+ * \returns true when the session leased a passive port, waits on the shared passive port or has a data connection.
+ */
+static bool HasPendingData(const vsftpSession_s *session)
+{
+    /* Argument checks are performed by the caller. */
+
+    return (session->transferSock != -1) || (session->isDataWaiterQueued == true) ||
+           (session->transferClientSock != -1);
+}
+
+/*!
+ * \brief Let a worker of a process that handed over its listeners finish its sessions.
+ * \details
+ *      The listener is closed and new connections go to the next process. Sessions are not cut off in the middle of
+ *      their work: a session is disconnected once it is idle after its next command, unless it still waits for or
+ *      uses a data connection (f.e. between PASV and RETR). Sessions that send nothing are disconnected after
+ *      DRAIN_IDLE_TIMEOUT_MS, see IdleTimeout().
+ * \param worker
+ *      The worker to drain.
+ */
+static void DrainWorker(vsftpWorker_s *worker)
+{
+    vsftpPasvListener_s *listener = NULL;
+    vsftpSession_s *session = NULL;
+    bool isDataWaiting = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if (worker->isDrainStarted == false) {
+        if (worker->serverSock != -1) {
+            /* The listener lives on in the next process, so closing it does not remove it from our epoll set. */
+            (void)epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, worker->serverSock, NULL);
+            CloseServerSocket(&worker->serverSock);
+        }
+
+        /* The next process serves the passive ports, leased ones are closed once they are returned. */
+        while ((listener = worker->freePasvListeners) != NULL) {
+            worker->freePasvListeners = listener->nextFree;
+            (void)close(listener->sock);
+            listener->sock = -1;
+        }
+
+        /* A command that is running counts as the next command. */
+        for (size_t i = 0; i < worker->sessionsLen; i++) {
+            session = &worker->sessions[i];
+            if ((session->isInUse == true) && (session->isDisconnectPending == false)) {
+                session->isDrainServed = (COROUTINE_IS_RUNNING(&session->command.coroutine) == true) ||
+                                         (session->isOffloadPending == true);
+                VSFTPTimerStart(&worker->timers, &session->idleTimer, DRAIN_IDLE_TIMEOUT_MS);
+            }
+        }
+
+        worker->isDrainStarted = true;
+    }
+
+    for (size_t i = 0; i < worker->sessionsLen; i++) {
+        session = &worker->sessions[i];
+        if ((session->isInUse == false) || (session->isDisconnectPending == true)) {
+            continue;
+        }
+
+        isDataWaiting = isDataWaiting || (session->isDataWaiterQueued == true);
+        if ((session->isDrainServed == true) && (session->isOffloadPending == false) &&
+            (COROUTINE_IS_RUNNING(&session->command.coroutine) == false) && (session->requestsLen == 0) &&
+            (HasPendingData(session) == false)) {
+            (void)VSFTP_SEND_REPLY(session, "421 Service restarting, please reconnect.");
+            (void)VSFTPServerClientDisconnect(session);
+        }
+    }
+
+    /* Sessions that wait on the shared passive port still get their data connection from it. */
+    if ((worker->dataSock != -1) && (isDataWaiting == false)) {
+        (void)close(worker->dataSock);
+        worker->dataSock = -1;
+    }
+}
+
+/*!
+ * \brief Handle commands on an active client connection.
+ * \details
+ *      This is a non-blocking call, it is called when the control socket of 'session' is readable. The received data
+ *      is added to the requests of the session, then every complete command is handled, see HandleRequests().
+ * \param session
+ *      The session that owns the control socket.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int HandleConnection(vsftpSession_s *session)
+{
+    size_t received = 0;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    retval = ReceiveRequests(session, &received);
+
+    if ((retval == 0) && (received > 0) && (GetIdleTimeoutMs() > 0)) {
+        VSFTPTimerStart(&session->worker->timers, &session->idleTimer, GetIdleTimeoutMs());
+    }
+
+    if ((retval == 0) && (received > 0)) {
+        HandleRequests(session);
+    } else if (retval == 0) {
+        /* Clean-up connection on disconnect. */
+        FTPLOG("Client connection lost\n");
+
+        (void)VSFTPServerClientDisconnect(session);
+    } else {
+        if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+            /* No incoming data. */
+        } else {
+            /* Only this client is affected, keep serving the others. */
+            FTPLOG("Socket read failed with error %d\n", errno);
+            (void)VSFTPServerClientDisconnect(session);
+        }
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Get the free space of the requests ring of a session.
+ * \param session
+ *      The session, its ring must not be full.
+ * \param[out] iov
+ *      A pointer to the storage location (of 2 elements) for the free space, it may wrap around the end of the ring.
+ * \returns The number of elements of 'iov' used.
+ */
+static size_t GetRequestsSpace(vsftpSession_s *session, struct iovec *iov)
+{
+    const size_t tail = (session->requestsHead + session->requestsLen) & (REQUEST_RING_SIZE - 1U);
+    const size_t space = REQUEST_RING_SIZE - session->requestsLen;
+
+    /* Argument checks are performed by the caller. */
+
+    iov[0].iov_base = &session->requests[tail];
+    iov[0].iov_len = ((REQUEST_RING_SIZE - tail) < space) ? (REQUEST_RING_SIZE - tail) : space;
+    iov[1].iov_base = session->requests;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    return (iov[1].iov_len > 0) ? 2U : 1U;
+}
+
+/*!
+ * \brief Receive control data into the free space of the requests ring of a session.
+ * \details
+ *      The free space may wrap around the end of the ring, so it is read with one readv(). When the data was already
+ *      received through the ring of the worker this iteration, its result is taken instead.
+ * \param session
+ *      The session that owns the control socket, its ring must not be full.
+ * \param[out] received
+ *      A pointer to the storage location for the number of bytes received, 0 when the client disconnected.
+ * \returns 0 in case of successful completion or any other value in case of an error (errno is set).
+ */
+static int ReceiveRequests(vsftpSession_s *session, size_t *received)
+{
+    struct iovec iov[2];
+    size_t iovLen = 0;
+    ssize_t bytesRead = 0;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->isReceived == true) {
+        /* Already added to the ring, see ReceiveWorkerRequests(). */
+        session->isReceived = false;
+        if (session->received >= 0) {
+            *received = (size_t)session->received;
+            retval = 0;
+        } else {
+            errno = -session->received;
+        }
+    } else {
+        iovLen = GetRequestsSpace(session, iov);
+        /* A read stops at the urgent mark (f.e. of an ABOR), the rest of the command is received on the next
+         * event. */
+        bytesRead = readv(session->clientSock, iov, (int)iovLen);
+        if (bytesRead != -1) {
+            session->requestsLen += (size_t)bytesRead;
+            *received = (size_t)bytesRead;
+            retval = 0;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get a complete command from the requests ring of a session.
+ * \details
+ *      Commands end in \r\n, a bare \n is accepted as well.
+ * \param session
+ *      The session.
+ * \param offset
+ *      The offset from the first byte in the ring where the command starts.
+ * \param[out] line
+ *      A pointer to the storage location (of REQUEST_LEN_MAX bytes) for the command, without \r\n and terminated.
+ * \param[out] lineLen
+ *      A pointer to the storage location for the length of the command.
+ * \param[out] size
+ *      A pointer to the storage location for the bytes the command takes in the ring, including its line end. When
+ *      no complete command is found, the bytes that were searched: REQUEST_LEN_MAX means the line is too long.
+ * \returns true when a complete command was found, otherwise false.
+ */
+static bool PeekRequest(const vsftpSession_s *session, const size_t offset, char *line, size_t *lineLen,
+                        size_t *size)
+{
+    const size_t left = session->requestsLen - offset;
+    const size_t scan = (left < REQUEST_LEN_MAX) ? left : REQUEST_LEN_MAX;
+    const size_t start = session->requestsHead + offset;
+    bool isFound = false;
+    size_t len = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    *size = 0;
+    while ((isFound == false) && (len < scan)) {
+        line[len] = session->requests[(start + len) & (REQUEST_RING_SIZE - 1U)];
+        if (line[len] == '\n') {
+            isFound = true;
+            *size = len + 1U;
+        } else {
+            len++;
+        }
+    }
+
+    if (isFound == true) {
+        if ((len > 0) && (line[len - 1U] == '\r')) {
+            len--;
+        }
+        line[len] = '\0';
+        *lineLen = len;
+    } else {
+        *size = len;
+    }
+
+    return isFound;
+}
+
+/*!
+ * \brief Drop the bytes of a handled command from the requests ring of a session.
+ * \details
+ *      The bytes behind the command are moved up, to keep the ring in order when it is not the first.
+ * \param session
+ *      The session.
+ * \param offset
+ *      The offset from the first byte in the ring where the command starts.
+ * \param size
+ *      The bytes to drop, at most the bytes in the ring behind 'offset'.
+ */
+static void DropRequest(vsftpSession_s *session, const size_t offset, const size_t size)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (offset == 0) {
+        session->requestsHead = (session->requestsHead + size) & (REQUEST_RING_SIZE - 1U);
+    } else {
+        for (size_t i = offset; (i + size) < session->requestsLen; i++) {
+            session->requests[(session->requestsHead + i) & (REQUEST_RING_SIZE - 1U)] =
+                session->requests[(session->requestsHead + i + size) & (REQUEST_RING_SIZE - 1U)];
+        }
+    }
+    session->requestsLen -= size;
+    if (session->requestsLen == 0) {
+        /* Keep the next command in one piece as long as possible. */
+        session->requestsHead = 0;
+    }
+}
+
+/*!
+ * \brief Take an urgent command that can be handled now from behind commands that wait.
+ * \details
+ *      Clients send ABOR as urgent data, preceded by the Telnet Interrupt Process and Synch commands. It must not wait
+ *      behind commands that were pipelined after the transfer it aborts.
+ * \param session
+ *      The session.
+ * \param offset
+ *      The offset from the first byte in the ring of the command behind the first command.
+ * \param[out] line
+ *      A pointer to the storage location (of REQUEST_LEN_MAX bytes) for the urgent command.
+ * \param[out] lineLen
+ *      A pointer to the storage location for the length of the urgent command.
+ * \returns true when an urgent command was taken from the ring, otherwise false.
+ */
+static bool TakeUrgentRequest(vsftpSession_s *session, size_t offset, char *line, size_t *lineLen)
+{
+    size_t size = 0;
+    bool isTaken = false;
+
+    /* Argument checks are performed by the caller. */
+
+    while ((isTaken == false) && (offset < session->requestsLen) &&
+           (PeekRequest(session, offset, line, lineLen, &size) == true)) {
+        if ((line[0] == TELNET_IAC) && (VSFTPCommandsIsRunnable(session, line, *lineLen) == true)) {
+            DropRequest(session, offset, size);
+            isTaken = true;
+        } else {
+            offset += size;
+        }
+    }
+
+    return isTaken;
+}
+
+/*!
+ * \brief Stop or continue reading the control socket of a session.
+ * \details
+ *      The socket stays readable while the ring is full, so it is taken out of the epoll set until there is room.
+ * \param session
+ *      The session.
+ * \param isPaused
+ *      true to stop reading, false to continue.
+ */
+static void PauseRequests(vsftpSession_s *session, const bool isPaused)
+{
+    struct epoll_event event;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->isReceivePaused != isPaused) {
+        event.events = (isPaused == true) ? 0 : EPOLLIN;
+        event.data.ptr = &session->controlEvent;
+        if (epoll_ctl(session->worker->epollFd, EPOLL_CTL_MOD, session->clientSock, &event) == 0) {
+            session->isReceivePaused = isPaused;
+        } else {
+            FTPLOG("Could not modify control socket %d, error %d\n", session->clientSock, errno);
+        }
+    }
+}
+
+/*!
+ * \brief Handle the complete commands in the requests ring of a session.
+ * \details
+ *      Clients may pipeline commands (f.e. "TYPE I\r\nPASV\r\n" in one segment), they are handled in order. While a
+ *      command is in progress only the commands that do not interfere with it (f.e. ABOR) are handled, the others
+ *      wait in the ring until it is done, see ResumeCommand(). An urgent command is handled before the commands that
+ *      wait. An incomplete command waits for the rest of its data.
+ * \param session
+ *      The session.
+ */
+static void HandleRequests(vsftpSession_s *session)
+{
+    char line[REQUEST_LEN_MAX];
+    size_t lineLen = 0;
+    size_t size = 0;
+    bool isFound = false;
+    bool isReady = false;
+
+    /* Argument checks are performed by the caller. */
+
+    while ((session->isInUse == true) && (session->isDisconnectPending == false) && (session->requestsLen > 0)) {
+        isFound = PeekRequest(session, 0, line, &lineLen, &size);
+        isReady = false;
+        if (session->isRequestTooLong == true) {
+            /* The end of the line that was too long, or more of it. */
+            DropRequest(session, 0, size);
+            session->isRequestTooLong = (isFound == false);
+        } else if ((isFound == false) && (size == REQUEST_LEN_MAX)) {
+            DropRequest(session, 0, size);
+            session->isRequestTooLong = true;
+            (void)VSFTP_SEND_REPLY(session, "500 Command line too long.");
+        } else if (isFound == false) {
+            /* Wait for the rest of the command. */
+            break;
+        } else if (VSFTPCommandsIsRunnable(session, line, lineLen) == true) {
+            DropRequest(session, 0, size);
+            isReady = true;
+        } else if (TakeUrgentRequest(session, size, line, &lineLen) == true) {
+            isReady = true;
+        } else {
+            /* Wait for the command in progress. */
+            break;
+        }
+
+        if (isReady == true) {
+            FTPLOG("Received command from client: %s\n", line);
+            if (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == true) {
+                session->isDrainServed = true;
+            }
+
+            /* Handle the command, we currently ignore errors. */
+            (void)HandleCommandResult(session, VSFTPCommandsParse(session, line, lineLen));
+        }
+    }
+
+    if ((session->isInUse == true) && (session->isDisconnectPending == false)) {
+        PauseRequests(session, (session->requestsLen == REQUEST_RING_SIZE));
+    }
+}
+
+/*!
+ * \brief Handle the result of (a part of) a command handler.
+ * \details
+ *      A handler that yielded is resumed when its transfer socket is ready. Meanwhile the control socket is still
+ *      read, so commands like ABOR and STAT can be handled during a transfer.
+ * \param session
+ *      The session that runs the command.
+ * \param result
+ *      The value returned by the command handler.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int HandleCommandResult(vsftpSession_s *session, const int result)
+{
+    /* Argument checks are performed by the caller. */
+
+    if ((session->isInUse == false) || (result == COROUTINE_YIELDED)) {
+        /* The command disconnected the client or is still in progress. */
+    } else if (result != 0) {
+        FTPLOG("Command failed with error %d\n", result);
+        /* In case we get a list command (which creates a transfer socket, but is then rejected),
+         * or for any other reason, make sure to close a created but not used transfer socket.
+         */
+        (void)VSFTPServerCloseTransferClientSocket(session);
+        (void)VSFTPServerCloseTransferSocket(session);
+        /* We do not break on a command parse failure, the printout is enough. */
+    } else {
+        FTPLOG("Command handled successfully\n");
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Resume the command handler of a session that is waiting for its transfer socket.
+ * \details
+ *      Once the command is done, the commands that were pipelined behind it are handled.
+ * \param session
+ *      The session that runs the command.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int ResumeCommand(vsftpSession_s *session)
+{
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    retval = HandleCommandResult(session, VSFTPCommandsResume(session));
+
+    if ((session->isInUse == true) && (COROUTINE_IS_RUNNING(&session->command.coroutine) == false)) {
+        HandleRequests(session);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Resume the command of a session once a transfer socket is ready.
+ * \details
+ *      The socket is monitored once (EPOLLONESHOT), each wait has to be requested again.
+ * \param session
+ *      The session that waits.
+ * \param sock
+ *      The transfer (listening or client) socket to wait for.
+ * \param events
+ *      The epoll events to wait for.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WaitForTransfer(vsftpSession_s *session, const int sock, const uint32_t events)
+{
+    struct epoll_event event;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = &session->transferEvent;
+
+    retval = epoll_ctl(session->worker->epollFd, EPOLL_CTL_MOD, sock, &event);
+    if ((retval != 0) && (errno == ENOENT)) {
+        /* First wait on this socket. */
+        retval = epoll_ctl(session->worker->epollFd, EPOLL_CTL_ADD, sock, &event);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Accept the data connection of a client on the transfer socket.
+ * \details
+ *      On success the transfer socket is closed, on EAGAIN it is (re-)armed in the worker's epoll instance.
+ * \param session
+ *      The session that owns the transfer socket.
+ * \returns 0 in case of successful completion, EAGAIN when the client has not connected yet or any other value in case
+ *      of an error.
+ */
+static int AcceptDataConnection(vsftpSession_s *session)
+{
+    socklen_t addrlen = 0;
+    struct sockaddr_in client_address;
+    bool isForeign = false;
+    int lsock = -1;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    do {
+        addrlen = sizeof(client_address);
+        lsock = accept4(session->transferSock, (struct sockaddr *)&client_address, &addrlen,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+        /* Passive ports are reused, only the client of the session may connect. */
+        isForeign = (lsock >= 0) && (client_address.sin_addr.s_addr != session->client.sin_addr.s_addr);
+        if (isForeign == true) {
+            FTPLOG("Refusing data connection from another address than the client's\n");
+            (void)close(lsock);
+        }
+    } while (isForeign == true);
+
+    if (lsock >= 0) {
+        /* One data connection per transfer, the passive port can be leased again. */
+        (void)VSFTPServerCloseTransferSocket(session);
+        session->transferClientSock = lsock;
+        PrepareTransferClientSocket(session);
+        retval = 0;
+    } else if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+        retval = WaitForTransfer(session, session->transferSock, EPOLLIN);
+        if (retval == 0) {
+            retval = EAGAIN;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Handle a ready transfer socket of a session.
+ * \details
+ *      Most clients open the data connection right after the PASV reply, while they are still sending the command
+ *      that uses it. It is accepted right away and parked in the session, so the command finds it ready. Otherwise
+ *      the command that waits for the transfer is resumed.
+ * \param session
+ *      The session that owns the transfer socket.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int HandleTransfer(vsftpSession_s *session)
+{
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((session->transferSock != -1) && (session->isAcceptPending == false)) {
+        /* No command waits for the data connection yet, a failure is reported once one does. */
+        (void)AcceptDataConnection(session);
+    } else {
+        retval = ResumeCommand(session);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief (Re)start the transfer timer of a session.
+ * \param session
+ *      The session that runs the transfer.
+ * \param timeoutS
+ *      The timeout in seconds, 0 leaves the timer stopped.
+ */
+static void StartTransferTimer(vsftpSession_s *session, const unsigned int timeoutS)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (timeoutS > 0) {
+        VSFTPTimerStart(&session->worker->timers, &session->transferTimer, timeoutS * 1000U);
+    }
+}
+
+/*!
+ * \brief Get the idle timeout of the sessions.
+ * \details
+ *      While draining, sessions that send nothing are disconnected after DRAIN_IDLE_TIMEOUT_MS, also when there is no
+ *      idle timeout otherwise.
+ * \returns The idle timeout in milliseconds, 0 when sessions may stay idle.
+ */
+static unsigned int GetIdleTimeoutMs(void)
+{
+    unsigned int timeoutMs = serverData.options.idleTimeout * 1000U;
+
+    if (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == true) {
+        timeoutMs = DRAIN_IDLE_TIMEOUT_MS;
+    }
+
+    return timeoutMs;
+}
+
+/*!
+ * \brief Disconnect a session that did not send a command within the idle timeout.
+ * \details
+ *      A session that runs a command (f.e. a long transfer) is not idle, its timer is restarted instead.
+ * \param timer
+ *      The idle timer of the session.
+ */
+static void IdleTimeout(vsftpTimer_s *timer)
+{
+    vsftpSession_s *session = timer->arg;
+
+    if ((COROUTINE_IS_RUNNING(&session->command.coroutine) == true) || (session->isOffloadPending == true)) {
+        VSFTPTimerStart(&session->worker->timers, timer, GetIdleTimeoutMs());
+    } else {
+        FTPLOG("Client socket %d idle for %u ms, disconnecting\n", session->clientSock, GetIdleTimeoutMs());
+        (void)VSFTP_SEND_REPLY(session, "421 Timeout.");
+        (void)VSFTPServerClientDisconnect(session);
+    }
+}
+
+/*!
+ * \brief Fail the transfer of a session that did not open its data connection in time, or that stalled.
+ * \details
+ *      The transfer is aborted like an ABOR would. The command that waits for the transfer sockets is resumed right
+ *      away, a command that waits for a job sees the abort once the job is back.
+ * \param timer
+ *      The transfer timer of the session.
+ */
+static void TransferTimeout(vsftpTimer_s *timer)
+{
+    vsftpSession_s *session = timer->arg;
+
+    if (session->transferClientSock == -1) {
+        FTPLOG("Client socket %d did not open the data connection in time\n", session->clientSock);
+        session->isTransferTimedOut = true;
+    } else {
+        FTPLOG("Transfer of client socket %d stalled\n", session->clientSock);
+    }
+
+    (void)VSFTPServerAbortTransfer(session);
+
+    if ((session->isOffloadPending == false) && (COROUTINE_IS_RUNNING(&session->command.coroutine) == true)) {
+        (void)ResumeCommand(session);
+    }
+}
+
+/*!
+ * \brief Prepare the job of a session to run some work elsewhere.
+ * \details
+ *      The session is marked pending until the job is finished by its worker.
+ * \param session
+ *      The session to run the work for.
+ * \param work
+ *      The work to run.
+ */
+static void PrepareOffload(vsftpSession_s *session, const SessionWork work)
+{
+    /* Argument checks are performed by the caller. */
+
+    session->offloadWork = work;
+    session->offloadJob.work = RunOffloadWork;
+    session->offloadJob.complete = CompleteOffload;
+    session->offloadJob.arg = session;
+    session->isOffloadPending = true;
+    session->worker->offloadsPending++;
+}
+
+/*!
+ * \brief Run the work of a session on an offload thread (or on a worker that stole it).
+ * \param arg
+ *      A pointer to the session.
+ * \returns The value returned by the work.
+ */
+static int RunOffloadWork(void *arg)
+{
+    vsftpSession_s *session = arg;
+
+    return session->offloadWork(session);
+}
+
+/*!
+ * \brief Hand a completed job back to the worker of its session.
+ * \details
+ *      This is called from the thread that ran the job.
+ * \param job
+ *      The completed job.
+ */
+static void CompleteOffload(vsftpOffloadJob_s *job)
+{
+    vsftpSession_s *session = job->arg;
+    vsftpWorker_s *worker = session->worker;
+    const uint64_t one = 1;
+
+    (void)pthread_mutex_lock(&worker->mailboxMutex);
+    job->next = worker->mailbox;
+    worker->mailbox = job;
+    (void)pthread_mutex_unlock(&worker->mailboxMutex);
+
+    /* Wake up the worker. */
+    if (write(worker->mailboxFd, &one, sizeof(one)) != sizeof(one)) {
+        FTPLOG("Mailbox write failed with error %d\n", errno);
+    }
+}
+
+/*!
+ * \brief Handle the completed jobs in the mailbox of a worker.
+ * \details
+ *      Resumes the commands that waited for them, or finishes the disconnection of their sessions.
+ * \param worker
+ *      The worker that owns the mailbox.
+ */
+static void HandleMailbox(vsftpWorker_s *worker)
+{
+    vsftpOffloadJob_s *jobs = NULL;
+    vsftpOffloadJob_s *job = NULL;
+    uint64_t count = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    /* Reset the eventfd counter. */
+    if ((read(worker->mailboxFd, &count, sizeof(count)) == -1) && (errno != EAGAIN)) {
+        FTPLOG("Mailbox read failed with error %d\n", errno);
+    }
+
+    (void)pthread_mutex_lock(&worker->mailboxMutex);
+    jobs = worker->mailbox;
+    worker->mailbox = NULL;
+    (void)pthread_mutex_unlock(&worker->mailboxMutex);
+
+    while (jobs != NULL) {
+        job = jobs;
+        jobs = job->next;
+        FinishOffload(worker, job);
+    }
+}
+
+/*!
+ * \brief Finish a completed job of a session.
+ * \details
+ *      Resumes the command that waited for it, or finishes the disconnection of the session.
+ * \param worker
+ *      The worker that owns the session of the job.
+ * \param job
+ *      The completed job.
+ */
+static void FinishOffload(vsftpWorker_s *worker, vsftpOffloadJob_s *job)
+{
+    vsftpSession_s *session = job->arg;
+
+    /* Argument checks are performed by the caller. */
+
+    session->isOffloadPending = false;
+    worker->offloadsPending--;
+
+    if (session->isDisconnectPending == true) {
+        (void)VSFTPServerClientDisconnect(session);
+    } else {
+        (void)ResumeCommand(session);
+    }
+}
+
+/*!
+ * \brief Send the next chunk of the transfer of a session.
+ * \details
+ *      Runs on the worker that owns the session or on a worker that stole the chunk.
+ * \param session
+ *      The session with the transfer.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block or any other value in case of an
+ *      error.
+ */
+static int SendTransferChunk(vsftpSession_s *session)
+{
+    return VSFTPTransferSendChunk(&session->transfer, session->transferClientSock, session->chunkLimit,
+                                  &session->chunkSent);
+}
+
+/*!
+ * \brief Queue the next chunk of the transfer of a session on the deque of its worker.
+ * \details
+ *      The chunk is queued by the bytes the transfer has left, see RunTransferChunks().
+ *      When the worker has more chunks queued than this one, an idle worker is woken up to steal some.
+ * \param session
+ *      The session with the transfer.
+ * \returns EAGAIN, the calling command has to yield until the chunk is sent.
+ */
+static int QueueTransferChunk(vsftpSession_s *session)
+{
+    vsftpWorker_s *worker = session->worker;
+
+    /* Argument checks are performed by the caller. */
+
+    session->transferProgress = session->transfer.size - session->transfer.remaining;
+    if ((serverData.options.autotune == true) && (session->isTransferTuned == false) &&
+        (session->transferProgress >= AUTOTUNE_SAMPLE_BYTES)) {
+        AutotuneTransferClientSocket(session);
+    }
+
+    session->isChunkQueued = true;
+    PrepareOffload(session, SendTransferChunk);
+    if (session->transfer.remaining <= TRANSFER_SHORT_SIZE) {
+        VSFTPOffloadDequePush(&worker->chunks[TRANSFER_CLASS_SHORT], &session->offloadJob);
+    } else {
+        VSFTPOffloadDequePush(&worker->chunks[TRANSFER_CLASS_BULK], &session->offloadJob);
+    }
+
+    if (GetQueuedChunks(worker) > 1) {
+        WakeIdleWorker(worker);
+    }
+
+    return EAGAIN;
+}
+
+/*!
+ * \brief Send the transfer of a session with MSG_ZEROCOPY when its file is large enough.
+ * \details
+ *      Called before the first chunk. Smaller files are sent with sendfile(), for them the completion notifications
+ *      cost more than the copy they save.
+ * \param session
+ *      The session with the transfer.
+ */
+static void SelectTransferPath(vsftpSession_s *session)
+{
+    const uint64_t minSize = (uint64_t)serverData.options.zerocopyMin * 1024U * 1024U;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((minSize > 0) && (session->transfer.path == TRANSFER_PATH_SENDFILE) &&
+        (session->transfer.remaining == session->transfer.size) && (session->transfer.size >= minSize) &&
+        (VSFTPTransferEnableZerocopy(&session->transfer, session->transferClientSock) != 0)) {
+        FTPLOG("Could not enable zerocopy on socket %d, error %d\n", session->transferClientSock, errno);
+    }
+}
+
+/*!
+ * \brief Check if the sessions share a bandwidth limit.
+ * \returns true when there is a limit for all sessions or per client address, otherwise false.
+ */
+static bool HasSharedRateLimit(void)
+{
+    return (serverData.options.rateLimit > 0) || (serverData.options.rateLimitPerIp > 0);
+}
+
+/*!
+ * \brief Take tokens of the bandwidth a session shares with other sessions.
+ * \details
+ *      Deficit round robin: a session that wants to send joins the queue, then the tokens of the shared limits are
+ *      handed out over the queue a quantum per session per pass, until they run out or the client addresses of the
+ *      sessions are out of tokens. Every session that waits thus gets the same share, a session that asks more often
+ *      can not take the tokens from the others.
+ *      The other sessions that got tokens are moved to the ready queue of their worker, which is woken up through its
+ *      mailbox to resume them.
+ * \param session
+ *      The session that wants to send.
+ * \returns The tokens granted to the session, 0 when it has to wait for its turn.
+ */
+static size_t TakeSharedTokens(vsftpSession_s *session)
+{
+    vsftpClientTable_s *table = &serverData.clients;
+    vsftpShaperFlow_s *flow = NULL;
+    vsftpShaperFlow_s *next = NULL;
+    vsftpSession_s *other = NULL;
+    vsftpClientEntry_s *entry = NULL;
+    uint64_t wake = 0;
+    const uint64_t one = 1;
+    size_t available = 0;
+    size_t granted = 0;
+    size_t tokens = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&table->mutex);
+
+    if (session->flow.queue == NULL) {
+        VSFTPShaperQueueAppend(&table->queue, &session->flow);
+    }
+
+    do {
+        granted = 0;
+        for (flow = table->queue.head; (flow != NULL) && (VSFTPTokenBucketGetTokens(&table->bucket) > 0);
+             flow = flow->next) {
+            /* The client address of a session never changes, and it keeps its entry while the session exists. */
+            entry = &table->entries[FindClient(((vsftpSession_s *)flow->arg)->client.sin_addr.s_addr)];
+            tokens = SHAPER_QUANTUM;
+            available = VSFTPTokenBucketGetTokens(&table->bucket);
+            if (available < tokens) {
+                tokens = available;
+            }
+            available = VSFTPTokenBucketGetTokens(&entry->bucket);
+            if (available < tokens) {
+                tokens = available;
+            }
+            VSFTPTokenBucketTake(&table->bucket, tokens);
+            VSFTPTokenBucketTake(&entry->bucket, tokens);
+            flow->deficit += tokens;
+            granted += tokens;
+        }
+    } while (granted > 0);
+
+    for (flow = table->queue.head; flow != NULL; flow = next) {
+        next = flow->next;
+        other = flow->arg;
+        if ((flow->deficit > 0) && (other != session)) {
+            VSFTPShaperQueueRemove(flow);
+            VSFTPShaperQueueAppend(&table->ready[other->worker->id], flow);
+            wake |= (uint64_t)1U << other->worker->id;
+        }
+    }
+
+    /* Served now, or in the ready queue from an earlier call. */
+    if (session->flow.deficit > 0) {
+        VSFTPShaperQueueRemove(&session->flow);
+    }
+    tokens = session->flow.deficit;
+    session->flow.deficit = 0;
+
+    (void)pthread_mutex_unlock(&table->mutex);
+
+    for (unsigned int i = 0; wake != 0; i++, wake >>= 1U) {
+        if (((wake & 1U) != 0) && (write(serverData.workers[i].mailboxFd, &one, sizeof(one)) != sizeof(one))) {
+            FTPLOG("Mailbox write failed with error %d\n", errno);
+        }
+    }
+
+    return tokens;
+}
+
+/*!
+ * \brief Resume the transfers of a worker's sessions that collected their quantum of the shared bandwidth.
+ * \param worker
+ *      The worker to resume the transfers for.
+ */
+static void ResumeShapedTransfers(vsftpWorker_s *worker)
+{
+    vsftpClientTable_s *table = &serverData.clients;
+    vsftpShaperFlow_s *flow = NULL;
+    vsftpSession_s *session = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    do {
+        /* Resuming takes the lock again, so take one session at a time. */
+        (void)pthread_mutex_lock(&table->mutex);
+        flow = table->ready[worker->id].head;
+        VSFTPShaperQueueRemove(flow);
+        (void)pthread_mutex_unlock(&table->mutex);
+
+        if (flow != NULL) {
+            session = flow->arg;
+            VSFTPTimerStop(&worker->timers, &session->shaperTimer);
+            ShaperTimeout(&session->shaperTimer);
+        }
+    } while (flow != NULL);
+}
+
+/*!
+ * \brief Give the shared bandwidth a session was granted but did not use back, and leave the queues.
+ * \param session
+ *      The session whose transfer is done.
+ */
+static void ReleaseSharedTokens(vsftpSession_s *session)
+{
+    vsftpClientTable_s *table = &serverData.clients;
+    vsftpClientEntry_s *entry = NULL;
+    size_t tokens = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)pthread_mutex_lock(&table->mutex);
+
+    VSFTPShaperQueueRemove(&session->flow);
+    tokens = session->flow.deficit + session->sharedTokens;
+    session->flow.deficit = 0;
+    session->sharedTokens = 0;
+
+    if (tokens > 0) {
+        entry = &table->entries[FindClient(session->client.sin_addr.s_addr)];
+        VSFTPTokenBucketPutBack(&table->bucket, tokens);
+        VSFTPTokenBucketPutBack(&entry->bucket, tokens);
+    }
+
+    (void)pthread_mutex_unlock(&table->mutex);
+}
+
+/*!
+ * \brief Get the bytes the next chunk of the transfer of a session may send within the bandwidth limits.
+ * \details
+ *      The limit of the session is applied first (unless the kernel paces its data connection), then the limits it
+ *      shares with other sessions.
+ * \param session
+ *      The session with the transfer.
+ * \param[out] waitMs
+ *      A pointer to the storage location for the time to wait before trying again, set when 0 is returned.
+ * \returns The bytes the chunk may send, at most TRANSFER_CHUNK_SIZE, or 0 when it has to wait.
+ */
+static size_t TakeTransferTokens(vsftpSession_s *session, unsigned int *waitMs)
+{
+    size_t tokens = TRANSFER_CHUNK_SIZE;
+    size_t available = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->isKernelPaced == false) {
+        available = VSFTPTokenBucketGetTokens(&session->bucket);
+        if (available < tokens) {
+            tokens = available;
+        }
+        if (tokens == 0) {
+            /* Send what was earned by then, instead of saving up for a whole chunk. */
+            *waitMs = VSFTPTokenBucketGetWaitMs(&session->bucket, 1U);
+        }
+    }
+
+    if ((tokens > 0) && (HasSharedRateLimit() == true)) {
+        if (session->sharedTokens == 0) {
+            session->sharedTokens = TakeSharedTokens(session);
+        }
+        if (session->sharedTokens < tokens) {
+            tokens = session->sharedTokens;
+        }
+        session->sharedTokens -= tokens;
+        if (tokens == 0) {
+            /* Woken up when it gets its turn, unless no other session hands out tokens by then. */
+            *waitMs = TIMER_TICK_MS;
+        }
+    }
+
+    if (session->isKernelPaced == false) {
+        VSFTPTokenBucketTake(&session->bucket, tokens);
+    }
+
+    return tokens;
+}
+
+/*!
+ * \brief Return the tokens of the last chunk of a session that were not used, f.e. because the socket was full.
+ * \param session
+ *      The session with the transfer.
+ */
+static void ReturnTransferTokens(vsftpSession_s *session)
+{
+    size_t unused = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->chunkSent < session->chunkLimit) {
+        unused = session->chunkLimit - session->chunkSent;
+        if (session->isKernelPaced == false) {
+            VSFTPTokenBucketPutBack(&session->bucket, unused);
+        }
+        if (HasSharedRateLimit() == true) {
+            /* Keep them for the next chunk, the turn of the session is not over yet. */
+            session->sharedTokens += unused;
+        }
+    }
+}
+
+/*!
+ * \brief Queue the next chunk of the transfer of a session, as far as the bandwidth limits allow.
+ * \details
+ *      When there is no bandwidth left, the transfer is resumed by the shaper timer of the session.
+ * \param session
+ *      The session with the transfer.
+ * \returns EAGAIN, the calling command has to yield until the chunk is sent or the bandwidth is there.
+ */
+static int ShapeTransferChunk(vsftpSession_s *session)
+{
+    unsigned int waitMs = 0;
+    int retval = EAGAIN;
+
+    /* Argument checks are performed by the caller. */
+
+    session->chunkLimit = TakeTransferTokens(session, &waitMs);
+    if (session->chunkLimit > 0) {
+        retval = QueueTransferChunk(session);
+    } else {
+        VSFTPTimerStart(&session->worker->timers, &session->shaperTimer, waitMs);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Resume a transfer that waited for bandwidth.
+ * \param timer
+ *      The shaper timer of the session.
+ */
+static void ShaperTimeout(vsftpTimer_s *timer)
+{
+    vsftpSession_s *session = timer->arg;
+
+    if ((session->isOffloadPending == false) && (COROUTINE_IS_RUNNING(&session->command.coroutine) == true)) {
+        (void)ResumeCommand(session);
+    }
+}
+
+/*!
+ * \brief Let the kernel pace a new data connection to the bandwidth limit of its session.
+ * \details
+ *      With SO_MAX_PACING_RATE the kernel spreads the packets over time, the session limit then costs no wakeups.
+ *      When the kernel does not support it, the session limit is applied with the token bucket of the session.
+ * \param session
+ *      The session that just got its data connection.
+ */
+static void PaceTransferClientSocket(vsftpSession_s *session)
+{
+    const uint64_t limit = (uint64_t)serverData.options.rateLimitPerSession * 1024U;
+    const uint32_t rate = (limit < UINT32_MAX) ? (uint32_t)limit : UINT32_MAX;
+
+    /* Argument checks are performed by the caller. */
+
+    session->isKernelPaced = false;
+    if ((serverData.options.kernelPacing == true) && (rate > 0)) {
+        if (setsockopt(session->transferClientSock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0) {
+            session->isKernelPaced = true;
+        } else {
+            FTPLOG("Could not set the pacing rate, error %d\n", errno);
+        }
+    }
+}
+
+/*!
+ * \brief Apply the socket options of a profile to a connection.
+ * \details
+ *      Tuning is an optimization, options the kernel refuses are logged and otherwise ignored.
+ * \param sock
+ *      The connection.
+ * \param profile
+ *      The profile to apply.
+ * \param isKernelPaced
+ *      The kernel already paces the connection to the session limit, its pacing rate is kept.
+ */
+static void ApplySocketProfile(const int sock, const vsftpSocketProfile_e profile, const bool isKernelPaced)
+{
+    const vsftpSocketProfile_s *options = &socketProfiles[profile];
+    const char *congestion = serverData.options.congestion;
+    const uint32_t pacingRate = UINT32_MAX - 1U; /* ~0U would disable pacing again. */
+    const int noDelay = 1;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((options->isNoDelay == true) && (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) != 0)) {
+        FTPLOG("Could not set TCP_NODELAY on socket %d, error %d\n", sock, errno);
+    }
+
+    if ((options->isData == true) && (congestion != NULL) &&
+        (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion)) != 0)) {
+        FTPLOG("Could not set congestion control %s on socket %d, error %d\n", congestion, sock, errno);
+    }
+
+    if ((options->notSentLowat > 0) &&
+        (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &options->notSentLowat, sizeof(options->notSentLowat)) != 0)) {
+        FTPLOG("Could not set TCP_NOTSENT_LOWAT on socket %d, error %d\n", sock, errno);
+    }
+
+    /* Any pacing rate but ~0U lets TCP pace itself, at the rate it computes from its window and round trip time. */
+    if ((options->isPaced == true) && (isKernelPaced == false) &&
+        (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &pacingRate, sizeof(pacingRate)) != 0)) {
+        FTPLOG("Could not enable pacing on socket %d, error %d\n", sock, errno);
+    }
+}
+
+/*!
+ * \brief Set up a new data connection of a session.
+ * \details
+ *      It gets the LAN profile until its transfer sent enough to tell, see AutotuneTransferClientSocket().
+ * \param session
+ *      The session that just got its data connection.
+ */
+static void PrepareTransferClientSocket(vsftpSession_s *session)
+{
+    /* Argument checks are performed by the caller. */
+
+    PaceTransferClientSocket(session);
+    ApplySocketProfile(session->transferClientSock, SOCKET_PROFILE_DATA_LAN, session->isKernelPaced);
+    session->isTransferTuned = false;
+}
+
+/*!
+ * \brief Tune the data connection of a transfer to the path it takes.
+ * \details
+ *      Samples TCP_INFO once the transfer sent AUTOTUNE_SAMPLE_BYTES. A connection with a round trip time of at least
+ *      AUTOTUNE_WAN_RTT_US gets the WAN profile and a send buffer of a few times its bandwidth-delay product, estimated
+ *      from the delivery rate and the congestion window. The send buffer only grows, the kernel sizes it by itself up
+ *      to net.ipv4.tcp_wmem, which is often too small for long fat paths.
+ * \param session
+ *      The session with the transfer.
+ */
+static void AutotuneTransferClientSocket(vsftpSession_s *session)
+{
+    vsftpTcpInfo_s info;
+    socklen_t infoLen = sizeof(info);
+    vsftpSocketProfile_e profile = SOCKET_PROFILE_DATA_LAN;
+    uint64_t deliveryRate = 0;
+    uint64_t bdp = 0;
+    uint64_t wanted = 0;
+    int sndBuf = 0;
+    socklen_t sndBufLen = sizeof(sndBuf);
+
+    /* Argument checks are performed by the caller. */
+
+    session->isTransferTuned = true;
+
+    (void)memset(&info, 0, sizeof(info));
+    if (getsockopt(session->transferClientSock, IPPROTO_TCP, TCP_INFO, &info, &infoLen) != 0) {
+        FTPLOG("Could not get TCP_INFO of socket %d, error %d\n", session->transferClientSock, errno);
+    } else {
+        if (infoLen >= (offsetof(vsftpTcpInfo_s, deliveryRate) + sizeof(info.deliveryRate))) {
+            deliveryRate = info.deliveryRate;
+        }
+
+        bdp = (deliveryRate * info.rtt) / 1000000U;
+        if (((uint64_t)info.sndCwnd * info.sndMss) > bdp) {
+            bdp = (uint64_t)info.sndCwnd * info.sndMss;
+        }
+
+        if (info.rtt >= AUTOTUNE_WAN_RTT_US) {
+            profile = SOCKET_PROFILE_DATA_WAN;
+            ApplySocketProfile(session->transferClientSock, profile, session->isKernelPaced);
+
+            wanted = bdp * AUTOTUNE_SNDBUF_GAIN;
+            if (wanted > AUTOTUNE_SNDBUF_MAX) {
+                wanted = AUTOTUNE_SNDBUF_MAX;
+            }
+
+            /* The kernel reports (and reserves) twice the size asked for. */
+            if ((getsockopt(session->transferClientSock, SOL_SOCKET, SO_SNDBUF, &sndBuf, &sndBufLen) == 0) &&
+                (wanted > ((uint64_t)sndBuf / 2U))) {
+                sndBuf = (int)wanted;
+                if (setsockopt(session->transferClientSock, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) != 0) {
+                    FTPLOG("Could not set the send buffer of socket %d, error %d\n", session->transferClientSock,
+                           errno);
+                }
+            }
+        }
+
+        sndBufLen = sizeof(sndBuf);
+        (void)getsockopt(session->transferClientSock, SOL_SOCKET, SO_SNDBUF, &sndBuf, &sndBufLen);
+        FTPLOG("Data connection %d: rtt %u us, cwnd %u, delivery rate %llu B/s, bdp %llu B: profile %s, send buffer %d, "
+               "%s\n", session->transferClientSock, info.rtt, info.sndCwnd,
+               (unsigned long long)deliveryRate, (unsigned long long)bdp, socketProfiles[profile].name, sndBuf,
+               ((session->isKernelPaced == true) || (socketProfiles[profile].isPaced == true)) ? "paced" : "not paced");
+    }
+}
+
+/*!
+ * \brief Wake up a worker that is waiting for events, so it can steal chunks.
+ * \param worker
+ *      The worker that has chunks to spare.
+ */
+static void WakeIdleWorker(const vsftpWorker_s *worker)
+{
+    const vsftpWorker_s *idle = NULL;
+    const uint64_t one = 1;
+
+    /* Argument checks are performed by the caller. */
+
+    for (unsigned int i = 1; i < serverData.options.workers; i++) {
+        idle = &serverData.workers[(worker->id + i) % serverData.options.workers];
+        if (idle->isWaiting == true) {
+            /* An empty mailbox is harmless, the worker looks for chunks after handling its events. */
+            if (write(idle->mailboxFd, &one, sizeof(one)) != sizeof(one)) {
+                FTPLOG("Mailbox write failed with error %d\n", errno);
+            }
+            break;
+        }
+    }
+}
+
+/*!
+ * \brief Get the number of transfer chunks queued on a worker.
+ * \param worker
+ *      The worker.
+ * \returns The number of chunks of all classes.
+ */
+static size_t GetQueuedChunks(vsftpWorker_s *worker)
+{
+    size_t count = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    for (unsigned int class = 0; class < TRANSFER_CLASSES; class++) {
+        count += VSFTPOffloadDequeGetCount(&worker->chunks[class]);
+    }
+
+    return count;
+}
+
+/*!
+ * \brief Send a transfer chunk with the I/O priority of its class.
+ * \details
+ *      The result is not handed back, that is up to the caller.
+ * \param worker
+ *      The worker that sends the chunk.
+ * \param job
+ *      The job of the chunk.
+ * \param class
+ *      The class the chunk was queued in.
+ */
+static void RunChunk(vsftpWorker_s *worker, vsftpOffloadJob_s *job, const vsftpTransferClass_e class)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (worker->ioClass != class) {
+        /* Only a hint to the I/O scheduler, a failure changes nothing else. */
+        (void)VSFTPOffloadSetIoPriority((class == TRANSFER_CLASS_SHORT) ? IO_PRIORITY_SHORT : IO_PRIORITY_BULK);
+        worker->ioClass = class;
+    }
+
+    job->result = job->work(job->arg);
+}
+
+/*!
+ * \brief Queue the chunk of a session on the ring of its worker.
+ * \details
+ *      Chunks sent with MSG_ZEROCOPY or copied can be queued, they are submitted along with the replies of the
+ *      iteration, see FlushWorkerReplies(). When the ring or the copy buffers are full, the queued operations are
+ *      submitted first.
+ * \param worker
+ *      The worker that owns the session.
+ * \param session
+ *      The session with the chunk, its job was taken from the deque.
+ * \returns true when the chunk is queued, false when it has to be sent right away.
+ */
+static bool QueueRingChunk(vsftpWorker_s *worker, vsftpSession_s *session)
+{
+    char *buf = NULL;
+    bool isQueued = false;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((worker->hasRing == true) && (session->transfer.path != TRANSFER_PATH_SENDFILE)) {
+        if ((VSFTPUringIsFull(&worker->ring) == true) ||
+            ((session->transfer.path == TRANSFER_PATH_COPY) && (worker->copyBufsUsed == URING_COPY_BUFFERS))) {
+            SubmitWorkerRing(worker, false);
+            (void)FinishRingChunks(worker);
+        }
+        if (session->transfer.path == TRANSFER_PATH_COPY) {
+            buf = worker->copyBufs[worker->copyBufsUsed];
+        }
+        if ((worker->hasRing == true) &&
+            (VSFTPTransferQueueChunk(&session->transfer, &worker->ring, session->transferClientSock,
+                                     session->chunkLimit, buf, TRANSFER_CHUNK_SIZE, &session->transferEvent) == 0)) {
+            if (buf != NULL) {
+                worker->copyBufsUsed++;
+            }
+            isQueued = true;
+        }
+    }
+
+    return isQueued;
+}
+
+/*!
+ * \brief Take the result of a chunk that was reaped from the ring of a worker.
+ * \details
+ *      The command that waits for the chunk is resumed later, see FinishRingChunks().
+ * \param worker
+ *      The worker that owns the session.
+ * \param session
+ *      The session with the chunk.
+ * \param result
+ *      The result of the send, the bytes sent or minus its errno.
+ */
+static void CompleteRingChunk(vsftpWorker_s *worker, vsftpSession_s *session, const int result)
+{
+    vsftpOffloadJob_s *job = &session->offloadJob;
+
+    /* Argument checks are performed by the caller. */
+
+    job->result = VSFTPTransferCompleteChunk(&session->transfer, session->transferClientSock, session->chunkLimit,
+                                             result, &session->chunkSent);
+    worker->chunksSent++;
+    worker->ringChunks++;
+    job->next = worker->ringChunksDone;
+    worker->ringChunksDone = job;
+}
+
+/*!
+ * \brief Resume the commands of which the chunk was reaped from the ring of a worker.
+ * \param worker
+ *      The worker with the reaped chunks.
+ * \returns true when a command was resumed, it may have replied.
+ */
+static bool FinishRingChunks(vsftpWorker_s *worker)
+{
+    vsftpOffloadJob_s *jobs = worker->ringChunksDone;
+    vsftpOffloadJob_s *job = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    worker->ringChunksDone = NULL;
+    while (jobs != NULL) {
+        job = jobs;
+        jobs = job->next;
+        FinishOffload(worker, job);
+    }
+
+    return job != NULL;
+}
+
+/*!
+ * \brief Send the chunks of a class that a worker queued for its own sessions before this call, newest first.
+ * \details
+ *      Chunks queued meanwhile wait for the next iteration, so the worker keeps handling its events. With io_uring
+ *      the chunks that can be are queued on the ring of the worker instead, see QueueRingChunk().
+ * \param worker
+ *      The worker to send chunks.
+ * \param class
+ *      The class of the chunks to send.
+ */
+static void RunOwnChunks(vsftpWorker_s *worker, const vsftpTransferClass_e class)
+{
+    vsftpOffloadJob_s *job = NULL;
+    size_t budget = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    budget = VSFTPOffloadDequeGetCount(&worker->chunks[class]);
+    while ((budget > 0) && ((job = VSFTPOffloadDequePop(&worker->chunks[class])) != NULL)) {
+        budget--;
+        if (QueueRingChunk(worker, job->arg) == false) {
+            RunChunk(worker, job, class);
+            worker->chunksSent++;
+            FinishOffload(worker, job);
+        }
+    }
+}
+
+/*!
+ * \brief Send the transfer chunks that are ready.
+ * \details
+ *      Shortest job first: the worker sends the chunks of its own sessions with few bytes left first, then those of
+ *      bulk transfers, but only when no short chunks are queued (anymore). So a small file does not wait behind large
+ *      downloads. Bulk chunks that waited TRANSFER_AGING_MS get their turn anyway, so bulk
+ *      transfers slow down but never starve.
+ *      When it has no chunks left, the worker steals (at most TRANSFER_STEAL_MAX) chunks from the other workers,
+ *      short ones first and oldest first.
+ * \param worker
+ *      The worker to send chunks.
+ */
+static void RunTransferChunks(vsftpWorker_s *worker)
+{
+    vsftpWorker_s *victim = NULL;
+    vsftpOffloadJob_s *job = NULL;
+    struct timespec now;
+    size_t stolen = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    RunOwnChunks(worker, TRANSFER_CLASS_SHORT);
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((VSFTPOffloadDequeGetCount(&worker->chunks[TRANSFER_CLASS_SHORT]) == 0) ||
+        (VSFTPOffloadDequeGetCount(&worker->chunks[TRANSFER_CLASS_BULK]) == 0)) {
+        worker->bulkServedAt = now;
+        RunOwnChunks(worker, TRANSFER_CLASS_BULK);
+    } else if (ElapsedUs(&worker->bulkServedAt, &now) >= (TRANSFER_AGING_MS * 1000U)) {
+        worker->bulkServedAt = now;
+        worker->bulkAged++;
+        RunOwnChunks(worker, TRANSFER_CLASS_BULK);
+    }
+
+    if (GetQueuedChunks(worker) == 0) {
+        for (unsigned int class = 0; class < TRANSFER_CLASSES; class++) {
+            for (unsigned int i = 1; (i < serverData.options.workers) && (stolen < TRANSFER_STEAL_MAX); i++) {
+                victim = &serverData.workers[(worker->id + i) % serverData.options.workers];
+                while ((stolen < TRANSFER_STEAL_MAX) &&
+                       ((job = VSFTPOffloadDequeSteal(&victim->chunks[class])) != NULL)) {
+                    RunChunk(worker, job, class);
+                    stolen++;
+                    /* Back to the owner through its mailbox. */
+                    job->complete(job);
+                }
+            }
+        }
+        worker->chunksStolen += stolen;
+    }
+}
+
+/*!
+ * \brief Cancel the transfer chunks of a worker that were not sent yet.
+ * \param worker
+ *      The worker to cancel the chunks of.
+ */
+static void CancelTransferChunks(vsftpWorker_s *worker)
+{
+    vsftpOffloadJob_s *job = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    for (unsigned int class = 0; class < TRANSFER_CLASSES; class++) {
+        while ((job = VSFTPOffloadDequePop(&worker->chunks[class])) != NULL) {
+            job->result = ECANCELED;
+            FinishOffload(worker, job);
+        }
+    }
+}
+
+/*!
+ * \brief Send data on a given socket.
+ * \param sock
+ *      The socket to send the file to.
+ * \param buf
+ *      A pointer to the storage location containing data.
+ * \param size
+ *      The size of 'buf'.
+ * \param[out] send
+ *      A pointer to the storage location for the total send data.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int SendOwnSock(const int sock, const char *buf, const size_t size, size_t *send)
+{
+    ssize_t lsend = 0;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    lsend = write(sock, buf, size);
+    if (lsend != -1) {
+        *send = (size_t)lsend;
+        retval = 0;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Add a session to the flush list of its worker, when it is not in it yet.
+ * \param session
+ *      The session that has replies to send.
+ */
+static void QueueReplies(vsftpSession_s *session)
+{
+    vsftpWorker_s *worker = session->worker;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->isFlushQueued == false) {
+        session->prevFlush = NULL;
+        session->nextFlush = worker->flushList;
+        if (worker->flushList != NULL) {
+            worker->flushList->prevFlush = session;
+        }
+        worker->flushList = session;
+        session->isFlushQueued = true;
+    }
+}
+
+/*!
+ * \brief Remove a session from the flush list of its worker, when it is in it.
+ * \param session
+ *      The session to remove.
+ */
+static void UnqueueReplies(vsftpSession_s *session)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (session->isFlushQueued == true) {
+        if (session->prevFlush != NULL) {
+            session->prevFlush->nextFlush = session->nextFlush;
+        } else {
+            session->worker->flushList = session->nextFlush;
+        }
+        if (session->nextFlush != NULL) {
+            session->nextFlush->prevFlush = session->prevFlush;
+        }
+        session->prevFlush = NULL;
+        session->nextFlush = NULL;
+        session->isFlushQueued = false;
+    }
+}
+
+/*!
+ * \brief Send the replies of a session that are not sent yet.
+ * \details
+ *      All replies of an iteration (f.e. to pipelined commands) go out in one send, so mostly in one segment. What the
+ *      socket does not take now is kept and sent at the end of a next iteration, the session stays in the flush list
+ *      until everything is sent.
+ * \param session
+ *      The session to send the replies of.
+ * \param isMore
+ *      True when more replies follow in this iteration (MSG_MORE), the buffer is flushed early because it is full.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int FlushReplies(vsftpSession_s *session, const bool isMore)
+{
+    ssize_t sent = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((session->repliesLen > 0) && (session->clientSock != -1)) {
+        sent = send(session->clientSock, session->replies, session->repliesLen,
+                    MSG_NOSIGNAL | MSG_DONTWAIT | ((isMore == true) ? MSG_MORE : 0));
+    }
+
+    return CompleteFlush(session, sent, (sent == -1) ? errno : 0);
+}
+
+/*!
+ * \brief Drop the replies of a session that were sent.
+ * \details
+ *      The session leaves the flush list of its worker once all its replies are sent, or the connection is gone.
+ * \param session
+ *      The session that sent its replies.
+ * \param sent
+ *      The bytes sent, -1 when the send failed.
+ * \param error
+ *      The errno of a failed send.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int CompleteFlush(vsftpSession_s *session, const ssize_t sent, const int error)
+{
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if (sent > 0) {
+        session->repliesLen -= (size_t)sent;
+        (void)memmove(session->replies, &session->replies[sent], session->repliesLen);
+    } else if ((sent == -1) && (error != EAGAIN) && (error != EWOULDBLOCK) && (error != EINTR)) {
+        /* The connection is gone, reading the control socket disconnects the session. */
+        FTPLOG("Could not send replies on client socket %d, error %d\n", session->clientSock, error);
+        retval = -1;
+    }
+
+    if ((retval != 0) || (session->clientSock == -1)) {
+        session->repliesLen = 0;
+    }
+
+    if (session->repliesLen == 0) {
+        UnqueueReplies(session);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Submit the operations queued on the ring of a worker and hand their results to the sessions.
+ * \details
+ *      Receives are added to the requests ring of the session right away, ReceiveRequests() takes the result when the
+ *      event is handled. The results of transfer chunks are taken too, but their commands are resumed by the caller,
+ *      see FinishRingChunks(). When the ring fails, the worker falls back to plain system calls, the sessions of which
+ *      no result was reaped just do those. Only their chunks fail, as it is unknown what they sent.
+ * \param worker
+ *      The worker with the ring.
+ * \param isReceive
+ *      True when receives are queued, otherwise reply sends and transfer chunks are. They are not mixed in one submit.
+ */
+static void SubmitWorkerRing(vsftpWorker_s *worker, const bool isReceive)
+{
+    vsftpEventSource_s *source = NULL;
+    vsftpSession_s *session = NULL;
+    void *data = NULL;
+    int result = 0;
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    retval = VSFTPUringSubmit(&worker->ring);
+    if (retval != 0) {
+        FTPLOG("Worker %u io_uring submit failed with error %d, using plain system calls\n", worker->id, errno);
+    }
+
+    while (VSFTPUringReap(&worker->ring, &data, &result) == true) {
+        source = data;
+        if (source == NULL) {
+            /* The read of a copied chunk, the send that is linked to it tells its result. */
+            continue;
+        }
+
+        session = source->session;
+        if (source->type == EVENT_SOURCE_TRANSFER) {
+            CompleteRingChunk(worker, session, result);
+        } else if (isReceive == true) {
+            if (result > 0) {
+                session->requestsLen += (size_t)result;
+            }
+            session->received = result;
+            session->isReceived = true;
+        } else if (result >= 0) {
+            (void)CompleteFlush(session, result, 0);
+        } else {
+            (void)CompleteFlush(session, -1, -result);
+        }
+    }
+
+    /* The copy buffers are free again. */
+    worker->copyBufsUsed = 0;
+
+    if (retval != 0) {
+        for (size_t i = 0; i < worker->sessionsLen; i++) {
+            session = &worker->sessions[i];
+            if ((session->isInUse == true) && (session->isOffloadPending == true) &&
+                (session->transfer.queued > 0)) {
+                session->transfer.queued = 0;
+                session->offloadJob.result = -1;
+                session->offloadJob.next = worker->ringChunksDone;
+                worker->ringChunksDone = &session->offloadJob;
+            }
+        }
+        VSFTPUringClose(&worker->ring);
+        worker->hasRing = false;
+    }
+}
+
+/*!
+ * \brief Receive the control data of all readable sessions of an iteration through the ring of the worker.
+ * \details
+ *      One system call for all of them, instead of one per session. Sessions whose requests ring is full are read
+ *      as before, see HandleConnection().
+ * \param worker
+ *      The worker, it must have a ring.
+ * \param events
+ *      The events of the iteration.
+ * \param numEvents
+ *      The number of 'events'.
+ */
+static void ReceiveWorkerRequests(vsftpWorker_s *worker, const struct epoll_event *events, const int numEvents)
+{
+    vsftpEventSource_s *source = NULL;
+    vsftpSession_s *session = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    for (int i = 0; (worker->hasRing == true) && (i < numEvents); i++) {
+        source = events[i].data.ptr;
+        if (source->type != EVENT_SOURCE_CONTROL) {
+            continue;
+        }
+
+        session = source->session;
+        if ((session->isInUse == false) || (session->isDisconnectPending == true) ||
+            (session->requestsLen == REQUEST_RING_SIZE)) {
+            continue;
+        }
+
+        if (VSFTPUringIsFull(&worker->ring) == true) {
+            SubmitWorkerRing(worker, true);
+        }
+
+        (void)memset(&session->receiveMsg, 0, sizeof(session->receiveMsg));
+        session->receiveMsg.msg_iov = session->receiveIov;
+        session->receiveMsg.msg_iovlen = GetRequestsSpace(session, session->receiveIov);
+        if ((worker->hasRing == true) &&
+            (VSFTPUringQueueRecvmsg(&worker->ring, session->clientSock, &session->receiveMsg, MSG_DONTWAIT,
+                                    &session->controlEvent) != 0)) {
+            break;
+        }
+    }
+
+    if (worker->hasRing == true) {
+        SubmitWorkerRing(worker, true);
+    }
+}
+
+/*!
+ * \brief Send the replies of all sessions of a worker that are not sent yet.
+ * \details
+ *      Called once at the end of each iteration of the worker, see WorkerHandler(). With io_uring the replies are
+ *      submitted along with the transfer chunks queued by RunOwnChunks(). The commands those chunks resume may reply
+ *      again, then their replies are sent too.
+ * \param worker
+ *      The worker to send the replies of.
+ */
+static void FlushWorkerReplies(vsftpWorker_s *worker)
+{
+    vsftpSession_s *session = NULL;
+    vsftpSession_s *next = NULL;
+    bool isResumed = false;
+
+    /* Argument checks are performed by the caller. */
+
+    do {
+        session = worker->flushList;
+        while (session != NULL) {
+            next = session->nextFlush;
+            if ((worker->hasRing == true) && (session->repliesLen > 0) && (session->clientSock != -1)) {
+                /* One system call for the replies of all sessions. */
+                if (VSFTPUringIsFull(&worker->ring) == true) {
+                    SubmitWorkerRing(worker, false);
+                }
+                if ((worker->hasRing == false) ||
+                    (VSFTPUringQueueSend(&worker->ring, session->clientSock, session->replies, session->repliesLen,
+                                         MSG_NOSIGNAL | MSG_DONTWAIT, &session->controlEvent) != 0)) {
+                    (void)FlushReplies(session, false);
+                }
+            } else {
+                (void)FlushReplies(session, false);
+            }
+            session = next;
+        }
+
+        if (worker->hasRing == true) {
+            SubmitWorkerRing(worker, false);
+        }
+
+        /* Not while walking the flush list, a resumed command may change it. */
+        isResumed = FinishRingChunks(worker);
+    } while (isResumed == true);
+}
+
+/*!
+ * \brief Append a reply to the replies of a session that are not sent yet.
+ * \details
+ *      When the buffer is full, the replies in it are sent first.
+ * \param session
+ *      The session to reply to.
+ * \param reply
+ *      The reply, including its \r\n.
+ * \param len
+ *      The length of 'reply'.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int AppendReply(vsftpSession_s *session, const char *reply, const size_t len)
+{
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    if (session->clientSock != -1) {
+        retval = 0;
+    }
+
+    if ((retval == 0) && (len > (sizeof(session->replies) - session->repliesLen))) {
+        retval = FlushReplies(session, true);
+    }
+
+    if (retval == 0) {
+        if (len <= (sizeof(session->replies) - session->repliesLen)) {
+            (void)memcpy(&session->replies[session->repliesLen], reply, len);
+            session->repliesLen += len;
+            QueueReplies(session);
+        } else {
+            FTPLOG("Replies of client socket %d are not taken, reply dropped\n", session->clientSock);
+            retval = -1;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Close the client socket of a session.
+ * \param session
+ *      The session that owns the client socket.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int CloseClientSocket(vsftpSession_s *session)
+{
+    int retval = -1;
+
+    if (session->clientSock != -1) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        /* Replies that are not sent yet, f.e. to QUIT, go out first. */
+        (void)FlushReplies(session, false);
+
+        FTPLOG("Closing client socket %d\n", session->clientSock);
+        retval = shutdown(session->clientSock, SHUT_RDWR);
+    }
+
+    if (session->clientSock != -1) {
+        /* Closing the socket also removes it from the epoll set. */
+        if (close(session->clientSock) != 0) {
+            retval = -1;
+        }
+    }
+
+    session->clientSock = -1;
+    session->repliesLen = 0;
+    UnqueueReplies(session);
+
+    return retval;
+}
+
+/*!
+ * \brief Start a worker.
+ * \details
+ *      Creates the worker's epoll instance and its listening socket on the server port.
+ *      All workers bind the same port (SO_REUSEPORT), the kernel distributes incoming connections among them. With
+ *      the acceptor thread the worker has no listener, it only receives the connections handed over to it.
+ * \param worker
+ *      The worker to start.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int StartWorker(vsftpWorker_s *worker)
+{
+    int retval = -1;
+    struct epoll_event event;
+
+    /* Argument checks are performed by the caller. */
+
+    /* Initialize structure data to invalid values. */
+    worker->serverSock = -1;
+    worker->dataSock = -1;
+    worker->serverEvent.type = EVENT_SOURCE_LISTENER;
+    worker->serverEvent.session = NULL;
+    worker->mailboxEvent.type = EVENT_SOURCE_MAILBOX;
+    worker->mailboxEvent.session = NULL;
+    InitializeSessionPool(worker);
+    VSFTPTimerWheelInitialize(&worker->timers);
+    (void)clock_gettime(CLOCK_MONOTONIC, &worker->bulkServedAt);
+    /* Unknown, set by the first chunk. */
+    worker->ioClass = TRANSFER_CLASSES;
+
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epollFd == -1) {
+        FTPLOG("Could not create epoll instance, error %d\n", errno);
+    } else {
+        retval = 0;
+    }
+
+    if ((retval == 0) && (serverData.isDraining == false) && (serverData.options.pasvShared == true)) {
+        worker->dataEvent.type = EVENT_SOURCE_DATA_LISTENER;
+        worker->dataEvent.session = NULL;
+        VSFTPTimerInitialize(&worker->dataSockTimer, SharedPasvPortTimeout, worker);
+        if (__atomic_load_n(&serverData.isSharedPortBusy, __ATOMIC_ACQUIRE) == true) {
+            /* PASV is served from the pool meanwhile. */
+            FTPLOG("Worker %u waits for the previous process to close the shared passive port\n", worker->id);
+            VSFTPTimerStart(&worker->timers, &worker->dataSockTimer, PASV_SHARED_RETRY_MS);
+        } else {
+            retval = OpenSharedPasvPort(worker);
+        }
+    }
+
+    if ((retval == 0) && (serverData.isDraining == false)) {
+        CreatePasvListeners(worker);
+    }
+
+    if ((retval == 0) && (serverData.options.useAcceptor == false) && (serverData.isDraining == false)) {
+        /* Prepare sockaddr_in structure. */
+        worker->server.sin_family = AF_INET;
+        worker->server.sin_addr.s_addr = INADDR_ANY;
+        worker->server.sin_port = htons(serverData.port);
+
+        worker->serverSock = TakeInheritedSocket(worker->id);
+    }
+
+    if ((retval == 0) && (serverData.options.useAcceptor == false) && (serverData.isDraining == false) &&
+        (worker->serverSock == -1)) {
+        /* Create the socket. */
+        retval = CreatePassiveSocket((in_port_t)serverData.port,
+                                     &worker->serverSock,
+                                     &worker->server,
+                                     false,
+                                     (int)serverData.options.backlog);
+        if (retval != 0) {
+            worker->serverSock = -1;
+        }
+    }
+
+    if ((retval == 0) && (worker->serverSock != -1)) {
+        event.events = EPOLLIN;
+        event.data.ptr = &worker->serverEvent;
+        retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->serverSock, &event);
+    }
+
+    if (retval == 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &worker->mailboxEvent;
+        retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->mailboxFd, &event);
+    }
+
+    if ((retval == 0) && (worker->id == 0) && (serverData.handoffSock != -1)) {
+        event.events = EPOLLIN;
+        event.data.ptr = &serverData.handoffEvent;
+        retval = epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, serverData.handoffSock, &event);
+    }
+
+    if ((retval == 0) && (serverData.options.ioUring == true)) {
+        if (VSFTPUringInitialize(&worker->ring, URING_ENTRIES) == 0) {
+            worker->hasRing = true;
+        } else {
+            FTPLOG("Worker %u could not set up io_uring, error %d, using plain system calls\n", worker->id, errno);
+        }
+    }
+
+    if (retval == 0) {
+        worker->isStarted = true;
+    } else {
+        StopWorker(worker);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Stop a worker.
+ * \details
+ *      Disconnects all sessions of the worker and closes its listening socket and epoll instance. Jobs that are still
+ *      pending on the offload threads are waited for.
+ * \param worker
+ *      The worker to stop.
+ */
+static void StopWorker(vsftpWorker_s *worker)
+{
+    struct pollfd mailbox;
+    vsftpAcceptedClient_s client;
+
+    /* Argument checks are performed by the caller. */
+
+    /* Sessions can not be released while another thread uses them, wait for their jobs to come back. Chunks that
+     * nobody picked up yet are cancelled.
+     */
+    mailbox.fd = worker->mailboxFd;
+    mailbox.events = POLLIN;
+    CancelTransferChunks(worker);
+    while (worker->offloadsPending > 0) {
+        if ((poll(&mailbox, 1, -1) == -1) && (errno != EINTR)) {
+            FTPLOG("Mailbox poll failed with error %d\n", errno);
+            break;
+        }
+        HandleMailbox(worker);
+        CancelTransferChunks(worker);
+    }
+
+    if ((worker->chunksSent > 0) || (worker->chunksStolen > 0)) {
+        FTPLOG("Worker %u sent %llu chunks of its own sessions and stole %llu chunks, bulk chunks aged %llu times\n",
+               worker->id, (unsigned long long)worker->chunksSent, (unsigned long long)worker->chunksStolen,
+               (unsigned long long)worker->bulkAged);
+    }
+
+    if ((worker->transfers[TRANSFER_PATH_SENDFILE] > 0) || (worker->transfers[TRANSFER_PATH_COPY] > 0) ||
+        (worker->transfers[TRANSFER_PATH_ZEROCOPY] > 0)) {
+        FTPLOG("Worker %u sent %llu transfers with sendfile, %llu with read/write and %llu with zerocopy\n",
+               worker->id, (unsigned long long)worker->transfers[TRANSFER_PATH_SENDFILE],
+               (unsigned long long)worker->transfers[TRANSFER_PATH_COPY],
+               (unsigned long long)worker->transfers[TRANSFER_PATH_ZEROCOPY]);
+    }
+
+    if ((worker->zerocopyBytes > 0) || (worker->copiedBytes > 0)) {
+        FTPLOG("Worker %u sent %llu bytes zerocopy, the kernel copied %llu bytes after all\n", worker->id,
+               (unsigned long long)worker->zerocopyBytes, (unsigned long long)worker->copiedBytes);
+    }
+
+    if ((worker->refused > 0) || (worker->shed > 0)) {
+        FTPLOG("Worker %u refused %llu connections over the session limits and shed %llu under overload\n",
+               worker->id, (unsigned long long)worker->refused, (unsigned long long)worker->shed);
+    }
+
+    if (worker->handOvers > 0) {
+        FTPLOG("Worker %u took over %llu connections, hand-over avg/max %llu/%llu us\n", worker->id,
+               (unsigned long long)worker->handOvers,
+               (unsigned long long)(worker->handOverTimeTotalUs / worker->handOvers),
+               (unsigned long long)worker->handOverTimeMaxUs);
+    }
+
+    /* Connections that were handed over but not taken yet never got a session, just close them. */
+    while (PopAcceptedClient(&worker->acceptRing, &client) == true) {
+        (void)close(client.sock);
+    }
+
+    /* We don't know in what state we currently are, just orderly shutdown and close everything. */
+    for (size_t i = 0; i < worker->sessionsLen; i++) {
+        if (worker->sessions[i].isInUse == true) {
+            (void)VSFTPServerClientDisconnect(&worker->sessions[i]);
+        }
+    }
+
+    if (worker->serverSock != -1) {
+        CloseServerSocket(&worker->serverSock);
+    }
+
+    if (worker->id == 0) {
+        CloseHandoffConnection(worker);
+    }
+
+    /* The sessions are gone, so none of the passive ports is leased anymore. */
+    ClosePasvListeners(worker);
+    VSFTPTimerStop(&worker->timers, &worker->dataSockTimer);
+    if (worker->dataSock != -1) {
+        (void)close(worker->dataSock);
+        worker->dataSock = -1;
+    }
+
+    if (worker->epollFd != -1) {
+        (void)close(worker->epollFd);
+        worker->epollFd = -1;
+    }
+
+    if (worker->hasRing == true) {
+        FTPLOG("Worker %u submitted %llu operations in %llu io_uring calls, %llu of them transfer chunks\n",
+               worker->id, (unsigned long long)worker->ring.operations, (unsigned long long)worker->ring.submits,
+               (unsigned long long)worker->ringChunks);
+        VSFTPUringClose(&worker->ring);
+        worker->hasRing = false;
+    }
+
+    worker->isStarted = false;
+}
+
+/*!
+ * \brief Handle the next iteration of a worker.
+ * \details
+ *      When the worker is not started yet, it is (re)started first.
+ *
+ *      Otherwise, wait (at most EPOLL_WAIT_TIMEOUT_MS) for events and dispatch them:
+ *      - A readable server socket accepts the new client connections into sessions.
+ *      - A readable client socket handles a received command (or the disconnection) of that session.
+ *      - A ready transfer socket resumes the command that waits for it.
+ *      - A readable mailbox resumes the commands of which the offloaded job completed and takes the connections the
+ *        acceptor thread handed over.
+ *
+ *      Then the timers that are due expire and the transfer chunks that are ready are sent, see RunTransferChunks().
+ * \param worker
+ *      The worker to handle.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+static int WorkerHandler(vsftpWorker_s *worker)
+{
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+    vsftpEventSource_s *source = NULL;
+    struct timespec busyStart;
+    struct timespec busyEnd;
+    int numEvents = 0;
+    int timeout = EPOLL_WAIT_TIMEOUT_MS;
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    if (worker->isStarted == false) {
+        retval = StartWorker(worker);
+    } else { /* worker->isStarted == true. */
+        retval = 0;
+
+        /* Do not wait with chunks that are ready to be sent, nor past the next tick of the timers. */
+        if (GetQueuedChunks(worker) > 0) {
+            timeout = 0;
+        } else {
+            timeout = VSFTPTimerWheelGetTimeout(&worker->timers, EPOLL_WAIT_TIMEOUT_MS);
+        }
+
+        worker->isWaiting = true;
+        numEvents = epoll_wait(worker->epollFd, events, EPOLL_EVENTS_MAX, timeout);
+        worker->isWaiting = false;
+        (void)clock_gettime(CLOCK_MONOTONIC, &busyStart);
+        if ((numEvents == -1) && (errno != EINTR)) {
+            FTPLOG("Epoll wait failed with error %d\n", errno);
+            retval = -1;
+        }
+
+        if ((retval == 0) && (worker->hasRing == true)) {
+            ReceiveWorkerRequests(worker, events, numEvents);
+        }
+
+        for (int i = 0; (retval == 0) && (i < numEvents); i++) {
+            source = events[i].data.ptr;
+
+            if (source->type == EVENT_SOURCE_LISTENER) {
+                retval = AcceptIncomingConnections(worker);
+                if (worker->isStarted == false) {
+                    /* The worker was stopped, remaining events refer to closed sockets. */
+                    break;
+                }
+            } else if (source->type == EVENT_SOURCE_MAILBOX) {
+                HandleMailbox(worker);
+                TakeHandedOverConnections(worker);
+                TakeDataConnections(worker);
+                if (HasSharedRateLimit() == true) {
+                    ResumeShapedTransfers(worker);
+                }
+            } else if (source->type == EVENT_SOURCE_HANDOFF) {
+                HandOffListeners(worker);
+            } else if (source->type == EVENT_SOURCE_HANDOFF_ACK) {
+                ReceiveHandoffAck(worker);
+            } else if (source->type == EVENT_SOURCE_DATA_LISTENER) {
+                AcceptDataConnections(worker);
+            } else if ((source->session->isInUse == false) || (source->session->isDisconnectPending == true)) {
+                /* The session was disconnected while handling an earlier event. */
+            } else if (source->type == EVENT_SOURCE_CONTROL) {
+                retval = HandleConnection(source->session);
+            } else { /* source->type == EVENT_SOURCE_TRANSFER */
+                retval = HandleTransfer(source->session);
+            }
+        }
+
+        if ((retval == 0) && (worker->isStarted == true)) {
+            VSFTPTimerWheelAdvance(&worker->timers);
+            RunTransferChunks(worker);
+
+            if (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == true) {
+                DrainWorker(worker);
+            }
+
+            /* All replies of this iteration, one send per session. Replies a socket did not take are retried at the
+             * end of the next iteration, which is at most EPOLL_WAIT_TIMEOUT_MS away. */
+            FlushWorkerReplies(worker);
+
+            (void)clock_gettime(CLOCK_MONOTONIC, &busyEnd);
+            worker->loopTimeUs -= worker->loopTimeUs / 8U;
+            worker->loopTimeUs += ElapsedUs(&busyStart, &busyEnd) / 8U;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Pin a worker to a CPU.
+ * \details
+ *      Worker 'n' is pinned to online CPU 'n' modulo the number of online CPUs. Pinning is an optimization,
+ *      failures are logged and otherwise ignored.
+ * \param worker
+ *      The worker to pin, this has to be called from the worker's own thread.
+ */
+static void PinWorker(const vsftpWorker_s *worker)
+{
+    cpu_set_t cpus;
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int retval = -1;
+
+    /* Argument checks are performed by the caller. */
+
+    if (numCpus > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->id % (unsigned long)numCpus, &cpus);
+        retval = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    if (retval == 0) {
+        FTPLOG("Worker %u pinned to CPU %lu\n", worker->id, worker->id % (unsigned long)numCpus);
+    } else {
+        FTPLOG("Worker %u could not be pinned to a CPU\n", worker->id);
+    }
+}
+
+/*!
+ * \brief Entry point of the threads of the additional workers.
+ * \details
+ *      Worker 0 is handled by the thread calling VSFTPServerHandler(), all others run here until the server is
+ *      stopped.
+ * \param arg
+ *      A pointer to the worker to run.
+ * \returns NULL.
+ */
+static void *WorkerThread(void *arg)
+{
+    vsftpWorker_s *worker = arg;
+
+    if (serverData.options.pinWorkers == true) {
+        PinWorker(worker);
+    }
+
+    while (worker->isRunning == true) {
+        if (WorkerHandler(worker) != 0) {
+            FTPLOG("Worker %u handler failed, stopping worker\n", worker->id);
+            break;
+        }
+    }
+
+    StopWorker(worker);
+
+    return NULL;
+}
+
+/*!
+ * \brief Get the default server options.
+ * \param[out] options
+ *      A pointer to the storage location for the default options.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerGetDefaultOptions(vsftpServerOptions_s *options)
+{
+    int retval = -1;
+
+    if (options != NULL) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        (void)memset(options, 0, sizeof(*options));
+        options->workers = 1;
+        options->pinWorkers = false;
+        options->offloadThreads = OFFLOAD_THREADS_DEFAULT;
+        options->backlog = LISTEN_BACKLOG_DEFAULT;
+        options->useAcceptor = false;
+        options->idleTimeout = IDLE_TIMEOUT_DEFAULT_S;
+        options->dataTimeout = DATA_TIMEOUT_DEFAULT_S;
+        options->stallTimeout = STALL_TIMEOUT_DEFAULT_S;
+        options->maxClients = 0;
+        options->maxClientsPerIp = 0;
+        options->shedLatency = SHED_LATENCY_DEFAULT_MS;
+        options->pasvPortMin = PASV_PORT_MIN_DEFAULT;
+        options->pasvPortMax = PASV_PORT_MAX_DEFAULT;
+        options->pasvShared = false;
+        options->handoffPath = NULL;
+        options->rateLimit = 0;
+        options->rateLimitPerIp = 0;
+        options->rateLimitPerSession = 0;
+        options->kernelPacing = false;
+        options->congestion = NULL;
+        options->autotune = true;
+        options->zerocopyMin = ZEROCOPY_MIN_SIZE_DEFAULT;
+        options->ioUring = true;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Initialize the VS-FTP server.
+ * \details
+ *      Initializes the Server with configuration data received from the caller.
+ * \param rootPath
+ *      The root path to start the FTP server with.
+ *      The server will not allow any path to be accessed above/before it.
+ * \param rootPathLen
+ *      The length of 'rootPath'.
+ * \param ipAddr
+ *      The IP-Address to start a client listen socket on.
+ * \param ipAddrLen
+ *      The length of 'ipAddr'.
+ * \param port
+ *      The port to start a client listen socket on.
+ * \param options
+ *      A pointer to the server options, or NULL to use the defaults.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerInitialize(const char *rootPath, const size_t rootPathLen, const char *ipAddr, const size_t ipAddrLen,
+                          const uint16_t port, const vsftpServerOptions_s *options)
+{
+    int retval = -1;
+    size_t sessionsPerWorker = 0;
+
+    FTPLOG("Initializing server\n");
+
+    if ((rootPath != NULL) && (rootPathLen > 0) && (ipAddr != NULL) && (ipAddrLen > 0)) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        if (options != NULL) {
+            serverData.options = *options;
+        } else {
+            retval = VSFTPServerGetDefaultOptions(&serverData.options);
+        }
+    }
+
+    if (retval == 0) {
+        if ((serverData.options.workers == 0) || (serverData.options.workers > WORKERS_MAX)) {
+            FTPLOG("Invalid number of workers %u\n", serverData.options.workers);
+            retval = -1;
+        } else if (serverData.options.offloadThreads > OFFLOAD_THREADS_MAX) {
+            FTPLOG("Invalid number of offload threads %u\n", serverData.options.offloadThreads);
+            retval = -1;
+        } else if ((serverData.options.backlog == 0) || (serverData.options.backlog > INT32_MAX)) {
+            FTPLOG("Invalid listen backlog %u\n", serverData.options.backlog);
+            retval = -1;
+        } else if ((serverData.options.pasvPortMin == 0) ||
+                   (serverData.options.pasvPortMin > serverData.options.pasvPortMax) ||
+                   (((unsigned int)serverData.options.pasvPortMax - serverData.options.pasvPortMin + 1U) >
+                    PASV_PORTS_MAX) ||
+                   ((serverData.options.pasvShared == false) &&
+                    (((unsigned int)serverData.options.pasvPortMax - serverData.options.pasvPortMin + 1U) <
+                     serverData.options.workers))) {
+            /* Every worker needs a passive port of its own, unless they share the first one. */
+            FTPLOG("Invalid passive port range %u-%u\n", serverData.options.pasvPortMin,
+                   serverData.options.pasvPortMax);
+            retval = -1;
+        } else if ((serverData.options.handoffPath != NULL) &&
+                   ((serverData.options.handoffPath[0] == '\0') ||
+                    (strlen(serverData.options.handoffPath) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)))) {
+            FTPLOG("Invalid handoff socket path\n");
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        /* Copy server configuration data. */
+        (void)strncpy(serverData.ipAddr, ipAddr, sizeof(serverData.ipAddr));
+        serverData.ipAddrLen = ipAddrLen;
+        serverData.port = port;
+        serverData.pasvListenersLen = (size_t)serverData.options.pasvPortMax - serverData.options.pasvPortMin + 1U;
+        VSFTPTokenBucketInitialize(&serverData.clients.bucket, (uint64_t)serverData.options.rateLimit * 1024U);
+        for (size_t i = 0; i < serverData.pasvListenersLen; i++) {
+            pasvListeners[i].sock = -1;
+        }
+
+        /* Hand each worker an equal slice of the session slab. */
+        sessionsPerWorker = SESSIONS_MAX / serverData.options.workers;
+        for (unsigned int i = 0; i < serverData.options.workers; i++) {
+            serverData.workers[i].id = i;
+            serverData.workers[i].epollFd = -1;
+            serverData.workers[i].serverSock = -1;
+            serverData.workers[i].sessions = &sessions[i * sessionsPerWorker];
+            serverData.workers[i].sessionsLen = sessionsPerWorker;
+        }
+
+        /* The mailboxes, deques and rings live as long as the process, other threads may use them while a worker
+         * restarts.
+         */
+        for (unsigned int i = 0; (retval == 0) && (i < serverData.options.workers); i++) {
+            serverData.workers[i].mailbox = NULL;
+            serverData.workers[i].mailboxFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (serverData.workers[i].mailboxFd == -1) {
+                FTPLOG("Could not create mailbox for worker %u, error %d\n", i, errno);
+                retval = -1;
+            } else {
+                retval = pthread_mutex_init(&serverData.workers[i].mailboxMutex, NULL);
+            }
+
+            for (unsigned int class = 0; (retval == 0) && (class < TRANSFER_CLASSES); class++) {
+                retval = VSFTPOffloadDequeInitialize(&serverData.workers[i].chunks[class]);
+            }
+        }
+    }
+
+    if (retval == 0) {
+        retval = VSFTPFilesystemGetRealPath(NULL, 0, rootPath, rootPathLen, serverData.rootPath,
+                                            sizeof(serverData.rootPath),
+                                            &serverData.rootPathLen);
+    }
+
+    if (retval == 0) {
+        retval = VSFTPFilesystemIsDir(serverData.rootPath, serverData.rootPathLen);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Start the VS-FTP server.
+ * \details
+ *      Starts the offload threads, all workers and the acceptor thread when used. Worker 0 runs in the thread calling
+ *      VSFTPServerHandler(), every other worker gets its own thread.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerStart(void)
+{
+    vsftpWorker_s *worker = NULL;
+    int retval = 0;
+
+    FTPLOG("Starting server with %u worker(s)\n", serverData.options.workers);
+
+    /* Take the listeners over before creating our own handoff socket, the previous process owns its path until then. */
+    if (serverData.options.handoffPath != NULL) {
+        retval = TakeOverListeners();
+        if (retval == 0) {
+            retval = StartHandoff();
+        }
+    }
+
+    if (retval == 0) {
+        retval = VSFTPOffloadStart(serverData.options.offloadThreads);
+    }
+
+    for (unsigned int i = 0; (retval == 0) && (i < serverData.options.workers); i++) {
+        retval = StartWorker(&serverData.workers[i]);
+    }
+
+    if ((retval == 0) && (serverData.options.pinWorkers == true)) {
+        PinWorker(&serverData.workers[0]);
+    }
+
+    for (unsigned int i = 1; (retval == 0) && (i < serverData.options.workers); i++) {
+        worker = &serverData.workers[i];
+        worker->isRunning = true;
+        retval = pthread_create(&worker->thread, NULL, WorkerThread, worker);
+        if (retval == 0) {
+            worker->isThreadCreated = true;
+        } else {
+            FTPLOG("Could not create thread for worker %u, error %d\n", i, retval);
+            worker->isRunning = false;
+        }
+    }
+
+    /* Connections are accepted only once every worker can take them. */
+    if ((retval == 0) && (serverData.options.useAcceptor == true)) {
+        retval = StartAcceptor();
+    }
+
+    CloseInheritedSockets();
+
+    if (retval == 0) {
+        serverData.isStarted = true;
+    } else {
+        (void)VSFTPServerStop();
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Stop the VS-FTP server.
+ * \details
+ *      Stop serving and clean-up to restore the initialized state.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerStop(void)
+{
+    vsftpWorker_s *worker = NULL;
+    vsftpOffloadStatistics_s statistics;
+    vsftpOpenFileStatistics_s openFileStatistics;
+
+    FTPLOG("Stopping server\n");
+
+    /* No new connections are handed over once the acceptor is stopped. */
+    StopAcceptor();
+
+    /* Worker threads stop themselves (within EPOLL_WAIT_TIMEOUT_MS) once signalled. */
+    for (unsigned int i = 0; i < serverData.options.workers; i++) {
+        serverData.workers[i].isRunning = false;
+    }
+
+    for (unsigned int i = 0; i < serverData.options.workers; i++) {
+        worker = &serverData.workers[i];
+        if (worker->isThreadCreated == true) {
+            (void)pthread_join(worker->thread, NULL);
+            worker->isThreadCreated = false;
+        } else {
+            StopWorker(worker);
+        }
+    }
+
+    /* The workers waited for their pending jobs, the offload threads are idle now. */
+    VSFTPOffloadGetStatistics(&statistics);
+    FTPLOG("Offload statistics: %llu submitted, %llu completed, %llu rejected, queue depth max %zu, "
+           "wait avg/max %llu/%llu us, run avg/max %llu/%llu us\n",
+           (unsigned long long)statistics.submitted, (unsigned long long)statistics.completed,
+           (unsigned long long)statistics.rejected, statistics.queueDepthMax,
+           (unsigned long long)((statistics.completed > 0) ? (statistics.waitTimeTotalUs / statistics.completed) : 0),
+           (unsigned long long)statistics.waitTimeMaxUs,
+           (unsigned long long)((statistics.completed > 0) ? (statistics.runTimeTotalUs / statistics.completed) : 0),
+           (unsigned long long)statistics.runTimeMaxUs);
+    VSFTPOffloadStop();
+
+    VSFTPFilesystemGetOpenFileStatistics(&openFileStatistics);
+    FTPLOG("Open file statistics: %llu opened, %llu opens shared an open file, most users of one file %u\n",
+           (unsigned long long)openFileStatistics.opened, (unsigned long long)openFileStatistics.shared,
+           openFileStatistics.usersMax);
+
+    StopHandoff();
+    CloseInheritedSockets();
+
+    serverData.isStarted = false;
+
+    return 0;
+}
+
+/*!
+ * \brief Handle the next server iteration.
+ * \details
+ *      When the server is not yet started it is started first, otherwise the next iteration of worker 0 is handled.
+ *
+ *      This function blocks at most EPOLL_WAIT_TIMEOUT_MS waiting for events.
+ *      Each iteration this function will loop back to the caller, allowing it to check for termination.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerHandler(void)
+{
+    int retval = -1;
+
+    if (serverData.isStarted == false) {
+        retval = VSFTPServerStart();
+    } else {
+        retval = WorkerHandler(&serverData.workers[0]);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Check if the server is drained.
+ * \details
+ *      After handing its listeners over to a new process (see the 'handoffPath' option), the server finishes its
+ *      sessions. Once it is drained it can be stopped without interrupting any client.
+ * \returns true when the listeners are handed over and no sessions are left, false otherwise.
+ */
+bool VSFTPServerIsDrained(void)
+{
+    bool isDrained = __atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; (isDrained == true) && (i < serverData.options.workers); i++) {
+        if (__atomic_load_n(&serverData.workers[i].sessionCount, __ATOMIC_RELAXED) > 0) {
+            isDrained = false;
+        }
+    }
+
+    return isDrained;
+}
+
+/*!
+ * \brief Disconnect a client or clean up a partial disconnection.
+ * \details
+ *      The session is returned to the session pool, 'session' must not be used after this call.
+ *      While an offloaded job of the session is pending only the client socket is closed, the session is returned to
+ *      the pool once the job is back.
+ * \param session
+ *      The session to disconnect.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPServerClientDisconnect(vsftpSession_s *session)
+{
+    int retval = -1;
+
+    if ((session != NULL) && (session->isInUse == true)) {
+        retval = 0;
+    }
+
+    if ((retval == 0) && (session->isOffloadPending == true)) {
+        /* An offload thread still uses the command state, HandleMailbox() finishes the disconnection. */
+        if (session->isDisconnectPending == false) {
+            FTPLOG("Disconnecting client, waiting for its offloaded job\n");
+            session->isDisconnectPending = true;
+            VSFTPTimerStop(&session->worker->timers, &session->idleTimer);
+            VSFTPTimerStop(&session->worker->timers, &session->transferTimer);
+            VSFTPTimerStop(&session->worker->timers, &session->shaperTimer);
+            (void)CloseClientSocket(session);
+        }
+    } else if (retval == 0) {
+        FTPLOG("Disconnecting client\n");
+
+        /* We don't know in what state we currently are, just orderly shutdown and close everything. */
+        VSFTPTimerStop(&session->worker->timers, &session->idleTimer);
+        VSFTPTimerStop(&session->worker->timers, &session->transferTimer);
+        VSFTPCommandsCleanup(session);
+        VSFTPServerCloseTransferFile(session);
+        (void)VSFTPServerCloseTransferClientSocket(session);
+        (void)VSFTPServerCloseTransferSocket(session);
+        (void)CloseClientSocket(session);
+
+        ReleaseSession(session);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Get the state of the command in progress of a session.
+ * \param session
+ *      The session to get the command state of.
+ * \returns A pointer to the command state or NULL in case of an error.
+ */
+vsftpCommandState_s *VSFTPServerGetCommandState(vsftpSession_s *session)
+{
+    vsftpCommandState_s *state = NULL;
+
+    if (session != NULL) {
+        state = &session->command;
+    }
 
-    return retval;
+    return state;
 }
 
 /*!
- * \brief Handle commands on an active client connection.
+ * \brief Run a blocking call of a session on an offload thread.
  * \details
- *      This is a synchronous call.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ *      The command in progress must yield while VSFTPServerGetOffloadResult() returns EAGAIN, it is resumed once the
+ *      work completed. Until then the work owns the command state and must be the only one to use it.
+ *      When the offload queue is full (or no offload threads are configured) the work is run right away instead.
+ * \param session
+ *      The session to run the work for.
+ * \param work
+ *      The blocking call, it is called with 'session'.
+ * \returns EAGAIN when the work is queued, otherwise the value returned by the work (0 in case of successful
+ *      completion or any other value in case of an error).
  */
-static int HandleConnection(void)
+int VSFTPServerOffload(vsftpSession_s *session, const SessionWork work)
 {
     int retval = -1;
-    /* Polling read commands from client. */
-    size_t bytes_read = 0;
-    char buffer[REQUEST_LEN_MAX];
 
-    /* Argument checks are performed by the caller. */
-
-    retval = ReceiveOwnSock(serverData.clientSock, buffer, sizeof(buffer), &bytes_read);
-
-    /* Terminate the buffer. */
-    buffer[bytes_read] = '\0';
-    if ((retval == 0) && (bytes_read > 2) && (strncmp(&buffer[bytes_read - 2], "\r\n", 2) == 0)) {
-        /* Handle the command, we currently ignore errors. */
-        buffer[bytes_read - 2] = '\0';
-        bytes_read -= 2;
+    if ((session != NULL) && (work != NULL) && (session->isOffloadPending == false)) {
+        retval = 0;
+    }
 
-        FTPLOG("Received command from client: %s\n", buffer);
+    if (retval == 0) {
+        PrepareOffload(session, work);
 
-        retval = VSFTPCommandsParse(buffer, bytes_read);
-        if (retval != 0) {
-            FTPLOG("Command failed with error %d\n", retval);
-            /* In case we get a list command (which creates a transfer socket, but is then rejected),
-             * or for any other reason, make sure to close a created but not used transfer socket.
-             */
-            (void)VSFTPServerCloseTransferClientSocket();
-            (void)VSFTPServerCloseTransferSocket();
-            /* We do not break on a command parse failure, the printout is enough. */
-            retval = 0;
+        retval = VSFTPOffloadSubmit(&session->offloadJob);
+        if (retval == 0) {
+            retval = EAGAIN;
         } else {
-            FTPLOG("Command handled successfully\n");
-        }
-    } else if ((retval == 0) && (bytes_read == 0)) {
-        /* Clean-up connection on disconnect, including server socket. */
-        FTPLOG("Client connection lost\n");
+            session->isOffloadPending = false;
+            session->worker->offloadsPending--;
 
-        VSFTPServerClientDisconnect();
-    } else {
-        if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
-            /* No incoming data. */
-        } else {
-            FTPLOG("Socket read failed with error %d\n", errno);
-            (void)VSFTPServerStop();
+            if (retval == EBUSY) {
+                /* Better to block this worker for a moment than to fail the command. */
+                retval = work(session);
+                session->offloadJob.result = retval;
+            }
         }
     }
 
@@ -231,412 +4839,456 @@ static int HandleConnection(void)
 }
 
 /*!
- * \brief Send data on a given socket.
- * \param sock
- *      The socket to send the file to.
- * \param buf
- *      A pointer to the storage location containing data.
- * \param size
- *      The size of 'buf'.
- * \param[out] send
- *      A pointer to the storage location for the total send data.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ * \brief Get the result of the work that was offloaded last.
+ * \param session
+ *      The session that offloaded the work.
+ * \returns EAGAIN while the work is pending, otherwise the value returned by the work.
  */
-static int SendOwnSock(const int sock, const char *buf, const size_t size, size_t *send)
+int VSFTPServerGetOffloadResult(const vsftpSession_s *session)
 {
-    ssize_t lsend = 0;
     int retval = -1;
 
-    /* Argument checks are performed by the caller. */
-
-    lsend = write(sock, buf, size);
-    if (lsend != -1) {
-        *send = (size_t)lsend;
-        retval = 0;
+    if ((session != NULL) && (session->isOffloadPending == true)) {
+        retval = EAGAIN;
+    } else if (session != NULL) {
+        retval = session->offloadJob.result;
     }
 
     return retval;
 }
 
 /*!
- * \brief Receive data on a given socket.
- * \param sock
- *      The socket to send the file to.
- * \param buf
- *      A pointer to the storage location for data.
- * \param size
- *      The size of 'buf'.
- * \param[out] received
- *      A pointer to the storage location for the total received data.
- * \return 
+ * \brief Create the transfer socket.
+ * \details
+ *      The transfer socket is a listener leased from the passive port pool of the session's worker, it is already bound
+ *      and listening.
+ * \param session
+ *      The session to create the transfer socket for.
+ * \param[out] port
+ *      A pointer to the storage location for the port number of the transfer socket.
+ * \returns 0 in case of successful completion, EBUSY when all passive ports are in use or any other value in case of
+ *      an error.
  */
-static int ReceiveOwnSock(const int sock, char *buf, const size_t size, size_t *received)
+int VSFTPServerCreateTransferSocket(vsftpSession_s *session, uint16_t *port)
 {
-    ssize_t bytesRead = 0;
     int retval = -1;
 
-    /* Argument checks are performed by the caller. */
-
-    bytesRead = read(sock, buf, size);
-    if (bytesRead != -1) {
-        *received = (size_t)bytesRead;
+    if ((session != NULL) && (session->transferSock == -1) && (session->isDataWaiterQueued == false) &&
+        (port != NULL)) {
         retval = 0;
+    } /* Else already created. */
+
+    if (retval == 0) {
+        session->isTransferAborted = false;
+        session->isTransferTimedOut = false;
+    }
+
+    /* While draining the next process serves the shared passive port too, see DrainWorker(). */
+    if ((retval == 0) && (serverData.options.pasvShared == true) && (session->worker->dataSock != -1) &&
+        (__atomic_load_n(&serverData.isDraining, __ATOMIC_ACQUIRE) == false) && (QueueDataWaiter(session) == true)) {
+        *port = serverData.options.pasvPortMin;
+        /* The PASV expires, so a client that never connects does not keep its address from the shared port. */
+        StartTransferTimer(session, ((serverData.options.dataTimeout > 0) &&
+                                     (serverData.options.dataTimeout < PASV_SHARED_EXPIRY_S)) ?
+                                    serverData.options.dataTimeout : PASV_SHARED_EXPIRY_S);
+    } else if (retval == 0) {
+        /* Another session of the client address may already wait on the shared passive port, then it gets a port of
+         * the pool.
+         */
+        session->pasvListener = LeasePasvListener(session->worker);
+        if (session->pasvListener != NULL) {
+            session->transferSock = session->pasvListener->sock;
+            *port = session->pasvListener->port;
+        } else {
+            FTPLOG("All passive ports of worker %u are in use\n", session->worker->id);
+            retval = EBUSY;
+        }
+    }
+
+    if ((retval == 0) && (session->transferSock != -1)) {
+        /* Accept the data connection as soon as it arrives, see HandleTransfer(). */
+        retval = WaitForTransfer(session, session->transferSock, EPOLLIN);
+        if (retval != 0) {
+            (void)VSFTPServerCloseTransferSocket(session);
+        }
     }
 
     return retval;
 }
 
 /*!
- * \brief Close the client socket.
+ * \brief Close the transfer socket.
+ * \details
+ *      The listener is returned to the passive port pool.
+ * \param session
+ *      The session that owns the transfer socket.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-static int CloseClientSocket(void)
+int VSFTPServerCloseTransferSocket(vsftpSession_s *session)
 {
     int retval = -1;
 
-    if (serverData.clientSock != -1) {
+    if ((session != NULL) && ((session->transferSock != -1) || (session->isDataWaiterQueued == true))) {
         retval = 0;
     }
 
     if (retval == 0) {
-        FTPLOG("Closing transfer socket %d\n", serverData.clientSock);
-        retval = shutdown(serverData.clientSock, SHUT_RDWR);
-    }
+        VSFTPTimerStop(&session->worker->timers, &session->transferTimer);
 
-    if (retval == 0) {
-        retval = close(serverData.clientSock);
+        if (session->isDataWaiterQueued == true) {
+            CancelDataWaiter(session);
+        } else {
+            ReturnPasvListener(session->worker, session->pasvListener);
+            session->pasvListener = NULL;
+            session->transferSock = -1;
+        }
+        session->isAcceptPending = false;
     }
 
-    serverData.clientSock = -1;
-
     return retval;
 }
 
 /*!
- * \brief Initialize the VS-FTP server.
+ * \brief Accept the data connection of a client on the transfer socket.
  * \details
- *      Initializes the Server with configuration data received from the caller.
- * \param rootPath
- *      The root path to start the FTP server with.
- *      The server will not allow any path to be accessed above/before it.
- * \param rootPathLen
- *      The length of 'rootPath'.
- * \param ipAddr
- *      The IP-Address to start a client listen socket on.
- * \param ipAddrLen
- *      The length of 'ipAddr'.
- * \param port
- *      The port to start a client listen socket on.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ *      This is a non-blocking call. When the client has not connected yet, the calling command is resumed as soon as
+ *      it does.
+ * \param session
+ *      The session that owns the transfer socket.
+ * \returns 0 in case of successful completion, EAGAIN when the client has not connected yet, ETIMEDOUT when the client
+ *      did not connect within the data connection timeout, ECANCELED when the transfer was aborted or any other value
+ *      in case of an error.
  */
-int VSFTPServerInitialize(const char *rootPath, const size_t rootPathLen, const char *ipAddr, const size_t ipAddrLen,
-                          const uint16_t port)
+int VSFTPServerAcceptTransferClientConnection(vsftpSession_s *session)
 {
     int retval = -1;
 
-    FTPLOG("Initializing server\n");
-
-    if ((rootPath != NULL) && (rootPathLen > 0) && (ipAddr != NULL) && (ipAddrLen > 0)) {
+    if ((session != NULL) && (session->isTransferAborted == true)) {
+        retval = (session->isTransferTimedOut == true) ? ETIMEDOUT : ECANCELED;
+    } else if ((session != NULL) && (session->transferClientSock != -1)) {
+        /* Accepted as soon as it arrived, see HandleTransfer(). */
         retval = 0;
-    }
-
-    if (retval == 0) {
-        /* Copy server configuration data. */
-        (void)strncpy(serverData.ipAddr, ipAddr, sizeof(serverData.ipAddr));
-        serverData.ipAddrLen = ipAddrLen;
-        serverData.port = port;
-
-        retval = VSFTPFilesystemGetRealPath(NULL, 0, rootPath, rootPathLen, serverData.rootPath,
-                                            sizeof(serverData.rootPath),
-                                            &serverData.rootPathLen);
-    }
-
-    if (retval == 0) {
-        retval = VSFTPFilesystemIsDir(serverData.rootPath, serverData.rootPathLen);
+    } else if ((session != NULL) && ((session->transferSock != -1) || (session->isDataWaiterQueued == true))) {
+        /* On the shared passive port, the connection is handed to the session, see TakeDataConnections(). */
+        retval = (session->isDataWaiterQueued == true) ? EAGAIN : AcceptDataConnection(session);
+        if (retval == EAGAIN) {
+            session->isAcceptPending = true;
+            if (VSFTPTimerIsArmed(&session->transferTimer) == false) {
+                StartTransferTimer(session, serverData.options.dataTimeout);
+            }
+        }
     }
 
     return retval;
 }
 
 /*!
- * \brief Start the VS-FTP server.
+ * \brief Close the transfer client socket.
+ * \param session
+ *      The session that owns the transfer client socket.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPServerStart(void)
+int VSFTPServerCloseTransferClientSocket(vsftpSession_s *session)
 {
     int retval = -1;
 
-    FTPLOG("Starting server\n");
-
-    /* Initialize structure data to invalid values. */
-    serverData.transferSock = -1;
-    serverData.serverSock = -1;
-    serverData.clientSock = -1;
-    retval = VSFTPServerSetCwd(serverData.rootPath, serverData.rootPathLen);
+    if ((session != NULL) && (session->transferClientSock != -1)) {
+        retval = 0;
+    }
 
     if (retval == 0) {
-        serverData.transferModeBinary = true;
+        VSFTPTimerStop(&session->worker->timers, &session->transferTimer);
 
-        /* Prepare sockaddr_in structure. */
-        serverData.server.sin_family = AF_INET;
-        serverData.server.sin_addr.s_addr = INADDR_ANY;
-        serverData.server.sin_port = htons(serverData.port);
+        /* Completions are lost with the socket. */
+        VSFTPTransferReapZerocopy(&session->transfer, session->transferClientSock);
 
-        /* Create the socket. */
-        retval = CreatePassiveSocket((in_port_t)serverData.port,
-                                                &serverData.serverSock,
-                                                &serverData.server);
-    }
+        FTPLOG("Closing transfer client socket %d\n", session->transferClientSock);
+        retval = shutdown(session->transferClientSock, SHUT_RDWR);
+        if (close(session->transferClientSock) != 0) {
+            retval = -1;
+        }
 
-    if (retval == 0) {
-        serverData.isServerSocketCreated = true;
+        session->transferClientSock = -1;
+        session->isKernelPaced = false;
     }
 
     return retval;
 }
 
 /*!
- * \brief Stop the VS-FTP server.
+ * \brief Open the file to send with VSFTPServerSendfileTransfer().
  * \details
- *      Stop serving and clean-up to restore the initialized state.
+ *      Only the range set with VSFTPServerSetTransferRange() is sent, the range is reset for the next file.
+ * \param session
+ *      The session to open the file for.
+ * \param pathTofile
+ *      The absolute path to the file.
+ * \param len
+ *      The length of 'pathTofile'.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPServerStop(void)
+int VSFTPServerOpenTransferFile(vsftpSession_s *session, const char *pathTofile, const size_t len)
 {
-    FTPLOG("Stopping server\n");
+    int retval = -1;
 
-    /* We don't know in what state we currently are, just orderly shutdown and close everything. */
-    (void)VSFTPServerCloseTransferClientSocket();
-    (void)VSFTPServerCloseTransferSocket();
-    (void)CloseClientSocket();
+    /* pathTofile and len are checked by callee. */
+
+    if (session != NULL) {
+        session->isChunkQueued = false;
+        session->transferProgress = 0;
+        retval = VSFTPTransferOpen(&session->transfer, pathTofile, len);
+    }
 
-    if (serverData.serverSock != -1) {
-        FTPLOG("Closing server socket %d\n", serverData.serverSock);
-        (void)shutdown(serverData.serverSock, SHUT_RDWR);
-        (void)close(serverData.serverSock);
-        serverData.serverSock = -1;
+    if ((retval == 0) && ((session->rangeStart > 0) || (session->rangeEnd != UINT64_MAX))) {
+        retval = VSFTPTransferSetRange(&session->transfer, session->rangeStart, session->rangeEnd);
+        if (retval != 0) {
+            VSFTPTransferClose(&session->transfer);
+        }
     }
 
-    serverData.isServerSocketCreated = false;
-    serverData.isConnected = false;
+    if (session != NULL) {
+        session->rangeStart = 0;
+        session->rangeEnd = UINT64_MAX;
+    }
 
-    return 0;
+    return retval;
 }
 
 /*!
- * \brief Handle the next server iteration.
- * \details
- *      When not connected
- *      - Check for a connection and connect when a request is received
- *
- *      When connected:
- *      - Check for a (newly) received command.
- *      - Handle a received command.
- *      - Repeat.
- *      - Handle closing a connection.
- *
- *      This function blocks waiting on a client connection or client data.
- *      Each action (connection, data reception, disconnection) this function
- *      will loop back to the caller.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ * \brief Close the file opened with VSFTPServerOpenTransferFile().
+ * \param session
+ *      The session that owns the file, closing a closed file is allowed.
  */
-int VSFTPServerHandler(void)
+void VSFTPServerCloseTransferFile(vsftpSession_s *session)
 {
-    int retval = -1;
-
-    if (serverData.isServerSocketCreated == false) {
-        /* Create server socket. */
-        retval = VSFTPServerStart();
-    } else { /* serverData.isServerSocketCreated == true. */
-        /* Wait for connection and/or handle connection. */
-        if (serverData.isConnected == false) {
-            /* Poll for an incoming connection and accept it when there is 1. */
-            retval = WaitForIncomingConnection();
-        } else { /* serverData.isConnected == true */
-            retval = HandleConnection();
+    if (session != NULL) {
+        VSFTPTimerStop(&session->worker->timers, &session->shaperTimer);
+        if ((session->transfer.isOpen == true) && (HasSharedRateLimit() == true)) {
+            ReleaseSharedTokens(session);
+        }
+        if (session->transfer.isOpen == true) {
+            session->worker->transfers[session->transfer.path]++;
+            FTPLOG("Transfer sent %llu of %llu bytes with %s\n",
+                   (unsigned long long)(session->transfer.size - session->transfer.remaining),
+                   (unsigned long long)session->transfer.size, transferPathNames[session->transfer.path]);
         }
+        if (session->transfer.path == TRANSFER_PATH_ZEROCOPY) {
+            if (session->transferClientSock != -1) {
+                VSFTPTransferReapZerocopy(&session->transfer, session->transferClientSock);
+            }
+            /* The rest was not completed yet. */
+            session->worker->zerocopyBytes += session->transfer.zerocopyBytes;
+            session->worker->copiedBytes += session->transfer.copiedBytes;
+            FTPLOG("Transfer completed %llu bytes zerocopy and %llu bytes copied\n",
+                   (unsigned long long)session->transfer.zerocopyBytes,
+                   (unsigned long long)session->transfer.copiedBytes);
+        }
+        VSFTPTransferClose(&session->transfer);
     }
-
-    return retval;
 }
 
 /*!
- * \brief Disconnect a client or clean up a partial disconnection.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ * \brief Advance the file transfer of a session by one chunk.
+ * \details
+ *      This is a non-blocking call. Each chunk is queued on the deque of the session's worker, where it is sent by that
+ *      worker or stolen by an idle one. The calling command yields until the chunk is sent, and when the socket would
+ *      block, until it is writable again. In between the worker serves other sessions and the control socket, so the
+ *      transfer can be aborted.
+ * \param session
+ *      The session that owns the transfer client socket and the opened file.
+ * \returns 0 when the file has been sent, EAGAIN when the transfer is not complete yet, ECANCELED when the transfer
+ *      was aborted or any other value in case of an error.
  */
-int VSFTPServerClientDisconnect(void)
+int VSFTPServerSendfileTransfer(vsftpSession_s *session)
 {
-    FTPLOG("Disconnecting client\n");
+    int retval = -1;
 
-    /* We don't know in what state we currently are, just orderly shutdown and close everything. */
-    (void)VSFTPServerCloseTransferClientSocket();
-    (void)VSFTPServerCloseTransferSocket();
-    (void)CloseClientSocket();
+    if ((session != NULL) && (session->isOffloadPending == true)) {
+        /* The previous chunk is not sent yet. */
+        retval = EAGAIN;
+    } else if ((session != NULL) && (session->isTransferAborted == true)) {
+        session->isChunkQueued = false;
+        retval = ECANCELED;
+    } else if ((session != NULL) && (session->transferClientSock != -1)) {
+        retval = 0;
+    }
 
-    serverData.isConnected = false;
+    if ((retval == 0) && (session->isChunkQueued == true)) {
+        /* Collect the result of the previous chunk. */
+        session->isChunkQueued = false;
+        retval = session->offloadJob.result;
+        ReturnTransferTokens(session);
+
+        if ((retval == 0) && (VSFTPTransferIsComplete(&session->transfer) == true)) {
+            /* Done. */
+        } else if ((retval == 0) && (session->chunkSent == session->chunkLimit)) {
+            /* The socket took the whole chunk, it is most likely still writable. */
+            retval = ShapeTransferChunk(session);
+        } else if ((retval == 0) || (retval == EAGAIN)) {
+            retval = WaitForTransfer(session, session->transferClientSock, EPOLLOUT);
+            if (retval == 0) {
+                retval = EAGAIN;
+            }
+        }
+    } else if (retval == 0) {
+        SelectTransferPath(session);
+        retval = ShapeTransferChunk(session);
+    }
 
-    return 0;
+    if (retval == EAGAIN) {
+        /* Each chunk, or each time the socket became writable again, counts as progress. */
+        StartTransferTimer(session, serverData.options.stallTimeout);
+    }
+
+    return retval;
 }
 
 /*!
- * \brief Create the transfer socket.
- * \param portNum
- *      The port number to create the transfer socket on.
+ * \brief Abort the transfer of a session.
+ * \details
+ *      The transfer sockets are closed immediately, unless another thread still uses them for a chunk. The command
+ *      that runs the transfer fails with ECANCELED when it is resumed (and closes the sockets).
+ * \param session
+ *      The session to abort the transfer of.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPServerCreateTransferSocket(const uint16_t portNum)
+int VSFTPServerAbortTransfer(vsftpSession_s *session)
 {
     int retval = -1;
 
-    if (serverData.transferSock == -1) {
+    if (session != NULL) {
+        FTPLOG("Aborting transfer\n");
+        session->isTransferAborted = true;
+        if (session->isOffloadPending == false) {
+            (void)VSFTPServerCloseTransferClientSocket(session);
+            (void)VSFTPServerCloseTransferSocket(session);
+        }
         retval = 0;
-    } /* Else already created. */
-
-    if (retval == 0) {
-        /* Prepare sockaddr_in structure. */
-        serverData.transfer.sin_family = AF_INET;
-        serverData.transfer.sin_addr.s_addr = INADDR_ANY;
-        serverData.transfer.sin_port = htons(portNum);
-        /* Create a new socket connection. */
-        retval = CreatePassiveSocket(portNum, &serverData.transferSock, &serverData.transfer);
     }
 
     return retval;
 }
 
 /*!
- * \brief Close the transfer socket.
- * \returns 0 in case of successful completion or any other value in case of an error.
+ * \brief Get the progress of the file transfer of a session.
+ * \param session
+ *      The session to get the progress of.
+ * \param[out] sent
+ *      A pointer to the storage location for the number of bytes sent.
+ * \param[out] size
+ *      A pointer to the storage location for the size of the file.
+ * \returns 0 in case of successful completion or any other value when there is no file transfer.
  */
-int VSFTPServerCloseTransferSocket(void)
+int VSFTPServerGetTransferProgress(const vsftpSession_s *session, size_t *sent, size_t *size)
 {
     int retval = -1;
 
-    if (serverData.transferSock != -1) {
+    /* The transfer may be used by another thread while a job is pending, then the progress up to the pending chunk is
+     * reported.
+     */
+    if ((session != NULL) && (session->isOffloadPending == true) && (session->isChunkQueued == true) &&
+        (sent != NULL) && (size != NULL)) {
+        *sent = session->transferProgress;
+        *size = session->transfer.size;
+        retval = 0;
+    } else if ((session != NULL) && (session->isOffloadPending == false) && (session->transfer.isOpen == true) &&
+               (sent != NULL) && (size != NULL)) {
+        *sent = session->transfer.size - session->transfer.remaining;
+        *size = session->transfer.size;
         retval = 0;
     }
 
-    if (retval == 0) {
-        FTPLOG("Closing transfer socket %d\n", serverData.transferSock);
-        retval = shutdown(serverData.transferSock, SHUT_RDWR);
-    }
-
-    if (retval == 0) {
-        retval = close(serverData.transferSock);
-    }
-
-    serverData.transferSock = -1;
-
     return retval;
 }
 
-int VSFTPServerAcceptTransferClientConnection(void)
+/*!
+ * \brief Send a buffer on the transfer client socket.
+ * \details
+ *      This is a non-blocking call. It sends until the buffer is sent or the socket would block, in which case the
+ *      calling command is resumed as soon as the socket is writable again.
+ * \param session
+ *      The session that owns the transfer client socket.
+ * \param buf
+ *      A pointer to the storage location containing data.
+ * \param len
+ *      The length of 'buf'.
+ * \param[in,out] sent
+ *      A pointer to the number of bytes of 'buf' that have been sent already.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block, ECANCELED when the transfer was
+ *      aborted or any other value in case of an error.
+ */
+int VSFTPServerSendTransfer(vsftpSession_s *session, const char *buf, const size_t len, size_t *sent)
 {
-    socklen_t addrlen = 0;
-    struct sockaddr_in client_address;
-    int lsock = -1;
+    size_t numSent = 0;
     int retval = -1;
 
-    if (serverData.transferSock != -1) {
+    if ((session != NULL) && (session->isTransferAborted == true)) {
+        retval = ECANCELED;
+    } else if ((session != NULL) && (session->transferClientSock != -1) && (buf != NULL) && (sent != NULL)) {
         retval = 0;
     }
 
-    if (retval == 0) {
-        addrlen = sizeof(client_address);
-        lsock = accept(serverData.transferSock, (struct sockaddr *)&client_address, &addrlen);
-        if (lsock >= 0) {
-            serverData.transferClientSock = lsock;
+    while ((retval == 0) && (*sent < len)) {
+        retval = SendOwnSock(session->transferClientSock, &buf[*sent], len - *sent, &numSent);
+        if (retval == -1) {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+                retval = WaitForTransfer(session, session->transferClientSock, EPOLLOUT);
+                if (retval == 0) {
+                    StartTransferTimer(session, serverData.options.stallTimeout);
+                    retval = EAGAIN;
+                }
+            }
         } else {
-            retval = -1;
+            *sent += numSent;
         }
     }
 
     return retval;
 }
 
-
 /*!
- * \brief Close the transfer client socket.
+ * \brief Set the range of the file the next file transfer sends.
+ * \details
+ *      The offset of REST (with 'end' UINT64_MAX) or the range of RANG.
+ * \param session
+ *      The session.
+ * \param start
+ *      The first byte to send.
+ * \param end
+ *      The last byte to send, UINT64_MAX for the end of the file.
  * \returns 0 in case of successful completion or any other value in case of an error.
  */
-int VSFTPServerCloseTransferClientSocket(void)
+int VSFTPServerSetTransferRange(vsftpSession_s *session, const uint64_t start, const uint64_t end)
 {
     int retval = -1;
 
-    if (serverData.transferClientSock != -1) {
+    if ((session != NULL) && (start <= end)) {
+        session->rangeStart = start;
+        session->rangeEnd = end;
         retval = 0;
     }
 
-    if (retval == 0) {
-        FTPLOG("Closing transfer client socket %d\n", serverData.transferClientSock);
-        retval = shutdown(serverData.transferClientSock, SHUT_RDWR);
-    }
-
-    if (retval == 0) {
-        retval = close(serverData.transferClientSock);
-    }
-
-    serverData.transferClientSock = -1;
-
     return retval;
 }
 
-int VSFTPServerSendfileTransfer(const char *pathTofile, const size_t len)
+int VSFTPServerSetTransferMode(vsftpSession_s *session, const bool binary)
 {
-    char fileBuf[FILE_READ_BUF_SIZE];
-    size_t toRead = 0;
-    ssize_t numRead = 0;
-    size_t numSent = 0;
-    size_t count = 0;
-    int fd = -1;
     int retval = -1;
 
-    /* Arguments checked by callees. */
-
-    retval = VSFTPFilesystemOpenFile(pathTofile, len, &fd, &count);
-    if (retval == 0) {
-        while (count > 0) {
-            toRead = count < sizeof(fileBuf) ? count : sizeof(fileBuf);
-            numRead = read(fd, fileBuf, toRead);
-            if (numRead == -1) {
-                retval = -1;
-                break;
-            }
-            if (numRead == 0) {
-                break;                      /* EOF */
-            }
-
-            retval = SendOwnSock(serverData.transferClientSock, fileBuf, (size_t)numRead, &numSent);
-            if (retval == -1) {
-                break;
-            }
-            if (numSent == 0) {
-                retval = -1;
-                break;
-            }
-
-            count -= numSent;
-        }
+    if (session != NULL) {
+        session->transferModeBinary = binary;
+        retval = 0;
     }
 
-    (void)VSFTPFilesystemCloseFile(fd);
-
     return retval;
 }
 
-int VSFTPServerSetTransferMode(const bool binary)
-{
-    serverData.transferModeBinary = binary;
-
-    return 0;
-}
-
-int VSFTPServerGetTransferMode(bool *binary)
+int VSFTPServerGetTransferMode(const vsftpSession_s *session, bool *binary)
 {
     int retval = -1;
 
-    if (binary != NULL) {
-        *binary = serverData.transferModeBinary;
+    if ((session != NULL) && (binary != NULL)) {
+        *binary = session->transferModeBinary;
         retval = 0;
     }
 
@@ -698,8 +5350,8 @@ int VSFTPServerAbsPathIsNotAboveRootPath(const char *absPath, const size_t absPa
     return retval;
 }
 
-int VSFTPServerServerPathToRealPath(const char *serverPath, const size_t serverPathLen, char *realPath,
-                                    const size_t size, size_t *realPathLen)
+int VSFTPServerServerPathToRealPath(const vsftpSession_s *session, const char *serverPath, const size_t serverPathLen,
+                                    char *realPath, const size_t size, size_t *realPathLen)
 {
     char cwd[PATH_LEN_MAX];
     size_t cwdLen = 0;
@@ -719,7 +5371,7 @@ int VSFTPServerServerPathToRealPath(const char *serverPath, const size_t serverP
             bufLen = strnlen(buf, sizeof(buf));
             retval = VSFTPFilesystemGetRealPath(NULL, 0, buf, bufLen, realPath, size, realPathLen);
         } else {
-            retval = VSFTPServerGetCwd(cwd, sizeof(cwd), &cwdLen);
+            retval = VSFTPServerGetCwd(session, cwd, sizeof(cwd), &cwdLen);
 
             if (retval == 0) {
                 retval = VSFTPFilesystemGetRealPath(cwd, cwdLen, serverPath, serverPathLen, realPath, size,
@@ -759,7 +5411,7 @@ int VSFTPServerRealPathToServerPath(const char *realPath, const size_t realPathL
     return retval;
 }
 
-int VSFTPServerSetCwd(const char *dir, const size_t len)
+int VSFTPServerSetCwd(vsftpSession_s *session, const char *dir, const size_t len)
 {
     int retval = -1;
     char realPath[PATH_LEN_MAX]; /* Local copy first. */
@@ -769,12 +5421,12 @@ int VSFTPServerSetCwd(const char *dir, const size_t len)
 
     /* Checks are performed in callees. */
 
-    retval = VSFTPServerGetCwd(cwd, sizeof(cwd), &cwdLen);
+    retval = VSFTPServerGetCwd(session, cwd, sizeof(cwd), &cwdLen);
 
     /* Get the absolute path. */
     if (retval == 0) {
         retval = VSFTPFilesystemGetRealPath(cwd, cwdLen, dir, len, realPath, sizeof(realPath), &realPathLen);
-    } else {
+    } else if (session != NULL) {
         /* It could be that CWD has not yet been set, just pass it as NULL with length 0. */
         retval = VSFTPFilesystemGetRealPath(NULL, 0, dir, len, realPath, sizeof(realPath), &realPathLen);
     }
@@ -790,9 +5442,9 @@ int VSFTPServerSetCwd(const char *dir, const size_t len)
 
     /* Set the new path. */
     if (retval == 0) {
-        if (sizeof(serverData.cwd) > realPathLen) {
-            (void)strncpy(serverData.cwd, realPath, sizeof(serverData.cwd));
-            serverData.cwdLen = realPathLen;
+        if (sizeof(session->cwd) > realPathLen) {
+            (void)strncpy(session->cwd, realPath, sizeof(session->cwd));
+            session->cwdLen = realPathLen;
         } else {
             retval = -1;
         }
@@ -801,19 +5453,19 @@ int VSFTPServerSetCwd(const char *dir, const size_t len)
     return retval;
 }
 
-int VSFTPServerGetCwd(char *buf, const size_t size, size_t *len)
+int VSFTPServerGetCwd(const vsftpSession_s *session, char *buf, const size_t size, size_t *len)
 {
     int retval = -1;
     int written = 0;
 
     /* Check if CWD has been initialized and if the buffer is large enough to contain it. */
-    if ((buf != NULL) && (size > 0) && (len != NULL) &&
-        (serverData.cwdLen > 0) && (serverData.cwdLen < size)) {
+    if ((session != NULL) && (buf != NULL) && (size > 0) && (len != NULL) &&
+        (session->cwdLen > 0) && (session->cwdLen < size)) {
         retval = 0;
     }
 
     if (retval == 0) {
-        written = snprintf(buf, size, serverData.cwd, serverData.cwdLen);
+        written = snprintf(buf, size, "%s", session->cwd);
         if ((written >= 0) && ((size_t)written < size)) {
             *len = (size_t)written;
         } else {
@@ -824,95 +5476,63 @@ int VSFTPServerGetCwd(char *buf, const size_t size, size_t *len)
     return retval;
 }
 
-int VSFTPServerSendReply(const char *__restrict format, ...)
+int VSFTPServerSendReply(vsftpSession_s *session, const char *__restrict format, ...)
 {
     char buf[RESPONSE_LEN_MAX];
     int written = 0;
     int retval = -1;
     va_list ap;
 
-    if (format != NULL) {
+    if ((session != NULL) && (format != NULL)) {
         retval = 0;
     }
 
     if (retval == 0) {
-        /* Write reply to buffer. */
+        /* Write reply to buffer, leaving room for the \r\n. */
         va_start(ap, format);
         written = vsnprintf(buf, sizeof(buf), format, ap);
         va_end(ap);
-        if ((written < 0) || ((size_t)written >= sizeof(buf))) {
-            retval = -1;
-        }
-    }
-
-    /* Append \r\n. */
-    if (retval == 0) {
-        written += snprintf(&buf[written], sizeof(buf) - written, "\r\n");
-        if ((written < 0) || ((size_t)written >= sizeof(buf))) {
+        if ((written < 0) || (((size_t)written + STRLEN(REPLY_END)) > sizeof(buf))) {
             retval = -1;
         }
     }
 
     if (retval == 0) {
-        if (write(serverData.clientSock, buf, (size_t)written) == -1) {
-            retval = -1;
-        }
+        (void)memcpy(&buf[written], REPLY_END, STRLEN(REPLY_END));
+        retval = AppendReply(session, buf, (size_t)written + STRLEN(REPLY_END));
     }
 
     return retval;
 }
 
-int VSFTPServerSendReplyOwnBuf(char *buf, const size_t size, const size_t len)
+int VSFTPServerSendReplyConst(vsftpSession_s *session, const char *reply, const size_t len)
 {
-    int written = 0;
     int retval = -1;
 
-    if ((buf != NULL) && (size > 0) && (len > 0)) {
+    if ((session != NULL) && (reply != NULL) && (len > 0)) {
         retval = 0;
     }
 
     if (retval == 0) {
-        /* Append \r\n. */
-        written = snprintf(&buf[len], size - len, "\r\n");
-        if ((written >= 0) && ((size_t)written < size)) {
-            retval = 0;
-        }
-    }
-
-    if (retval == 0) {
-        if (write(serverData.clientSock, buf, len + written) == -1) {
-            retval = -1;
-        }
+        retval = AppendReply(session, reply, len);
     }
 
     return retval;
 }
 
-int VSFTPServerSendReplyOwnBufTransfer(char *buf, const size_t size, const size_t len)
+int VSFTPServerSendReplyOwnBuf(vsftpSession_s *session, char *buf, const size_t size, const size_t len)
 {
-    int written = 0;
     int retval = -1;
 
-    /* No need to check 'sock', this is handled by write(). */
-
-    if ((buf != NULL) && (size > 0) && (len > 0)) {
+    if ((session != NULL) && (buf != NULL) && (size > 0) && (len > 0) && ((len + STRLEN(REPLY_END)) <= size)) {
         retval = 0;
     }
 
     if (retval == 0) {
         /* Append \r\n. */
-        written = snprintf(&buf[len], size - len, "\r\n");
-        if ((written >= 0) && ((size_t)written < size)) {
-            retval = 0;
-        }
-    }
-
-    if (retval == 0) {
-        if (write(serverData.transferClientSock, buf, len + written) == -1) {
-            retval = -1;
-        }
+        (void)memcpy(&buf[len], REPLY_END, STRLEN(REPLY_END));
+        retval = AppendReply(session, buf, len + STRLEN(REPLY_END));
     }
 
     return retval;
 }
-
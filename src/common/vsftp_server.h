@@ -19,36 +19,96 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
+/* A client session, owned by the server and only accessed through the functions below. */
+typedef struct vsftpSession_s vsftpSession_s;
+
+/* The state of the command in progress of a session, defined by the commands module. */
+struct vsftpCommandState_s;
+
+/* Server options, start from VSFTPServerGetDefaultOptions() and override what is needed. */
+typedef struct {
+    unsigned int workers;           /* The number of workers, each with its own listener, sessions and thread. */
+    bool pinWorkers;                /* Pin each worker to its own CPU. */
+    unsigned int offloadThreads;    /* Threads that run blocking filesystem calls, 0 runs them on the workers. */
+    unsigned int backlog;           /* The listen backlog of the server port. */
+    bool useAcceptor;               /* Accept on a dedicated thread that hands connections to the least loaded worker,
+                                     * instead of a listener per worker. */
+    unsigned int idleTimeout;       /* Seconds without commands before a session is disconnected, 0 never. */
+    unsigned int dataTimeout;       /* Seconds the client has to open a data connection, 0 forever. */
+    unsigned int stallTimeout;      /* Seconds a transfer may make no progress before it is aborted, 0 forever. */
+    unsigned int maxClients;        /* Sessions of all clients together, 0 limits them to the session slab only. */
+    unsigned int maxClientsPerIp;   /* Sessions per client address, 0 for no limit. */
+    unsigned int shedLatency;       /* Average worker iteration time (ms) above which new sessions are shed, 0 never. */
+    uint16_t pasvPortMin;           /* The passive port pool, each port has a listener that is leased per transfer. */
+    uint16_t pasvPortMax;
+    bool pasvShared;                /* Use only the first passive port, data connections are matched to the sessions
+                                     * by client address and PASV order. */
+    const char *handoffPath;        /* Unix socket on which the listeners are handed over to a new process, NULL for
+                                     * none. */
+    unsigned int rateLimit;         /* File transfer bandwidth (KiB/s) of all sessions together, 0 for no limit. */
+    unsigned int rateLimitPerIp;    /* File transfer bandwidth (KiB/s) per client address, 0 for no limit. */
+    unsigned int rateLimitPerSession; /* File transfer bandwidth (KiB/s) per session, 0 for no limit. */
+    bool kernelPacing;              /* Let the kernel pace data connections to the session limit (SO_MAX_PACING_RATE)
+                                     * where it can. */
+    const char *congestion;         /* Congestion control of data connections (TCP_CONGESTION), NULL for the kernel
+                                     * default. */
+    bool autotune;                  /* Tune the data connections of transfers from their TCP_INFO. */
+    unsigned int zerocopyMin;       /* File size (MiB) from which transfers are sent with MSG_ZEROCOPY, 0 never. */
+    bool ioUring;                   /* Batch the control socket I/O of the workers through io_uring, if supported. */
+} vsftpServerOptions_s;
+
+/* A blocking call that is run off the worker thread, see VSFTPServerOffload(). */
+typedef int (* SessionWork)(vsftpSession_s *session);
+
+extern int VSFTPServerGetDefaultOptions(vsftpServerOptions_s *options);
 extern int VSFTPServerInitialize(const char *rootPath, size_t rootPathLen, const char *ipAddr, size_t ipAddrLen,
-                                 uint16_t port);
+                                 uint16_t port, const vsftpServerOptions_s *options);
 extern int VSFTPServerStart(void);
 extern int VSFTPServerStop(void);
 extern int VSFTPServerHandler(void);
+extern bool VSFTPServerIsDrained(void);
 
-extern int VSFTPServerClientDisconnect(void);
-extern int VSFTPServerCreateTransferSocket(uint16_t port_num);
-extern int VSFTPServerCloseTransferSocket(void);
-extern int VSFTPServerAcceptTransferClientConnection(void);
-extern int VSFTPServerCloseTransferClientSocket(void);
+extern int VSFTPServerClientDisconnect(vsftpSession_s *session);
+extern struct vsftpCommandState_s *VSFTPServerGetCommandState(vsftpSession_s *session);
+extern int VSFTPServerOffload(vsftpSession_s *session, SessionWork work);
+extern int VSFTPServerGetOffloadResult(const vsftpSession_s *session);
+extern int VSFTPServerCreateTransferSocket(vsftpSession_s *session, uint16_t *port);
+extern int VSFTPServerCloseTransferSocket(vsftpSession_s *session);
+extern int VSFTPServerAcceptTransferClientConnection(vsftpSession_s *session);
+extern int VSFTPServerCloseTransferClientSocket(vsftpSession_s *session);
 
-extern int VSFTPServerSendfileTransfer(const char *pathTofile, size_t len);
-extern int VSFTPServerSetTransferMode(bool binary);
-extern int VSFTPServerGetTransferMode(bool *binary);
+extern int VSFTPServerOpenTransferFile(vsftpSession_s *session, const char *pathTofile, size_t len);
+extern void VSFTPServerCloseTransferFile(vsftpSession_s *session);
+extern int VSFTPServerSendfileTransfer(vsftpSession_s *session);
+extern int VSFTPServerAbortTransfer(vsftpSession_s *session);
+extern int VSFTPServerGetTransferProgress(const vsftpSession_s *session, size_t *sent, size_t *size);
+extern int VSFTPServerSendTransfer(vsftpSession_s *session, const char *buf, size_t len, size_t *sent);
+extern int VSFTPServerSetTransferRange(vsftpSession_s *session, uint64_t start, uint64_t end);
+extern int VSFTPServerSetTransferMode(vsftpSession_s *session, bool binary);
+extern int VSFTPServerGetTransferMode(const vsftpSession_s *session, bool *binary);
 
 extern int VSFTPServerIsValidIPAddress(char *ipAddress);
 extern int VSFTPServerGetServerIP4(char *buf, size_t size, size_t *len);
 extern int VSFTPServerAbsPathIsNotAboveRootPath(const char *absPath, size_t absPathLen);
-extern int VSFTPServerServerPathToRealPath(const char *serverPath, size_t serverPathLen, char *realPath,
-                                           size_t size, size_t *realPathLen);
+extern int VSFTPServerServerPathToRealPath(const vsftpSession_s *session, const char *serverPath,
+                                           size_t serverPathLen, char *realPath, size_t size, size_t *realPathLen);
 extern int VSFTPServerRealPathToServerPath(const char *realPath, size_t realPathLen, char *serverPath,
                                            size_t size, size_t *serverPathLen);
-extern int VSFTPServerSetCwd(const char *dir, size_t len);
-extern int VSFTPServerGetCwd(char *buf, size_t size, size_t *len);
+extern int VSFTPServerSetCwd(vsftpSession_s *session, const char *dir, size_t len);
+extern int VSFTPServerGetCwd(const vsftpSession_s *session, char *buf, size_t size, size_t *len);
+
+/* Send a reply that is a string literal, it is not formatted and its length (including the \r\n) is known at compile
+ * time. Replies are sent once the worker handled its events, all replies of a session in one go.
+ */
+#define VSFTP_SEND_REPLY(_session, _reply) \
+    VSFTPServerSendReplyConst((_session), _reply "\r\n", sizeof(_reply "\r\n") - 1U)
 
-extern int VSFTPServerSendReply(const char *__restrict format, ...);
-extern int VSFTPServerSendReplyOwnBuf(char *buf, size_t size, size_t len);
-extern int VSFTPServerSendReplyOwnBufTransfer(char *buf, size_t size, size_t len);
+extern int VSFTPServerSendReply(vsftpSession_s *session, const char *__restrict format, ...);
+extern int VSFTPServerSendReplyConst(vsftpSession_s *session, const char *reply, size_t len);
+extern int VSFTPServerSendReplyOwnBuf(vsftpSession_s *session, char *buf, size_t size, size_t len);
 
 #endif /* VSFTP_SERVER_H__ */
 
@@ -0,0 +1,191 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "vsftp_shaper.h"
+
+static uint64_t GetTimeUs(void);
+
+/*!
+ * \brief Get the time of the monotonic clock.
+ * \returns The time in microseconds.
+ */
+static uint64_t GetTimeUs(void)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000U) + ((uint64_t)now.tv_nsec / 1000U);
+}
+
+/*!
+ * \brief Initialize a full token bucket.
+ * \details
+ *      The bucket holds the tokens of SHAPER_BURST_MS, but at least SHAPER_QUANTUM so a whole quantum can be sent.
+ * \param bucket
+ *      The bucket to initialize.
+ * \param rate
+ *      The rate in bytes per second, 0 for no limit.
+ */
+void VSFTPTokenBucketInitialize(vsftpTokenBucket_s *bucket, const uint64_t rate)
+{
+    if (bucket != NULL) {
+        bucket->rate = rate;
+        bucket->burst = (rate * SHAPER_BURST_MS) / 1000U;
+        if (bucket->burst < SHAPER_QUANTUM) {
+            bucket->burst = SHAPER_QUANTUM;
+        }
+        bucket->tokens = bucket->burst;
+        bucket->updatedUs = GetTimeUs();
+    }
+}
+
+/*!
+ * \brief Add the tokens earned since the last call and get the tokens in a bucket.
+ * \param bucket
+ *      The bucket.
+ * \returns The tokens in the bucket, SIZE_MAX for a bucket without limit (or in case of an error).
+ */
+size_t VSFTPTokenBucketGetTokens(vsftpTokenBucket_s *bucket)
+{
+    uint64_t nowUs = 0;
+    uint64_t earned = 0;
+    size_t tokens = SIZE_MAX;
+
+    if ((bucket != NULL) && (bucket->rate > 0)) {
+        nowUs = GetTimeUs();
+        if ((nowUs - bucket->updatedUs) >= ((bucket->burst * 1000000U) / bucket->rate)) {
+            /* Idle long enough to fill up, this also keeps the multiplication below from overflowing. */
+            bucket->tokens = bucket->burst;
+            bucket->updatedUs = nowUs;
+        } else if ((nowUs - bucket->updatedUs) >= 1000U) {
+            /* Refilled at most once per millisecond, so rounding the time down below can not add up to much. */
+            earned = ((nowUs - bucket->updatedUs) * bucket->rate) / 1000000U;
+        }
+        if (earned > 0) {
+            /* Only move the time on by what was turned into tokens, so slow refills do not lose fractions. */
+            bucket->updatedUs += (earned * 1000000U) / bucket->rate;
+            bucket->tokens = ((bucket->burst - bucket->tokens) > earned) ? (bucket->tokens + earned) : bucket->burst;
+        }
+        tokens = (bucket->tokens < SIZE_MAX) ? (size_t)bucket->tokens : SIZE_MAX;
+    }
+
+    return tokens;
+}
+
+/*!
+ * \brief Take tokens from a bucket.
+ * \param bucket
+ *      The bucket.
+ * \param tokens
+ *      The tokens to take, at most what VSFTPTokenBucketGetTokens() returned.
+ */
+void VSFTPTokenBucketTake(vsftpTokenBucket_s *bucket, const size_t tokens)
+{
+    if ((bucket != NULL) && (bucket->rate > 0)) {
+        bucket->tokens = (bucket->tokens > tokens) ? (bucket->tokens - tokens) : 0U;
+    }
+}
+
+/*!
+ * \brief Put tokens that were taken but not used back in a bucket.
+ * \param bucket
+ *      The bucket.
+ * \param tokens
+ *      The tokens to put back, the bucket does not hold more than its burst.
+ */
+void VSFTPTokenBucketPutBack(vsftpTokenBucket_s *bucket, const size_t tokens)
+{
+    if ((bucket != NULL) && (bucket->rate > 0)) {
+        bucket->tokens = ((bucket->burst - bucket->tokens) > tokens) ? (bucket->tokens + tokens) : bucket->burst;
+    }
+}
+
+/*!
+ * \brief Get the time until a bucket holds a number of tokens.
+ * \param bucket
+ *      The bucket, its tokens must have been updated by VSFTPTokenBucketGetTokens().
+ * \param tokens
+ *      The tokens to wait for, at most the burst of the bucket is waited for.
+ * \returns The time to wait in milliseconds, 0 when the tokens are there (or in case of an error).
+ */
+unsigned int VSFTPTokenBucketGetWaitMs(const vsftpTokenBucket_s *bucket, const size_t tokens)
+{
+    uint64_t wanted = tokens;
+    unsigned int waitMs = 0;
+
+    if ((bucket != NULL) && (bucket->rate > 0)) {
+        if (wanted > bucket->burst) {
+            wanted = bucket->burst;
+        }
+        if (wanted > bucket->tokens) {
+            waitMs = (unsigned int)((((wanted - bucket->tokens) * 1000U) + bucket->rate - 1U) / bucket->rate);
+        }
+    }
+
+    return waitMs;
+}
+
+/*!
+ * \brief Add a flow at the end of a queue.
+ * \param queue
+ *      The queue.
+ * \param flow
+ *      The flow to add, it must not be queued.
+ */
+void VSFTPShaperQueueAppend(vsftpShaperQueue_s *queue, vsftpShaperFlow_s *flow)
+{
+    if ((queue != NULL) && (flow != NULL) && (flow->queue == NULL)) {
+        flow->next = NULL;
+        flow->prev = queue->tail;
+        if (queue->tail != NULL) {
+            queue->tail->next = flow;
+        } else {
+            queue->head = flow;
+        }
+        queue->tail = flow;
+        flow->queue = queue;
+    }
+}
+
+/*!
+ * \brief Remove a flow from the queue it is in.
+ * \param flow
+ *      The flow to remove, removing a flow that is not queued is allowed.
+ */
+void VSFTPShaperQueueRemove(vsftpShaperFlow_s *flow)
+{
+    if ((flow != NULL) && (flow->queue != NULL)) {
+        if (flow->prev != NULL) {
+            flow->prev->next = flow->next;
+        } else {
+            flow->queue->head = flow->next;
+        }
+        if (flow->next != NULL) {
+            flow->next->prev = flow->prev;
+        } else {
+            flow->queue->tail = flow->prev;
+        }
+        flow->prev = NULL;
+        flow->next = NULL;
+        flow->queue = NULL;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_SHAPER_H__
+#define VSFTP_SHAPER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A token bucket, every byte sent takes a token. Tokens are added at 'rate' bytes per second, up to 'burst'.
+ * A bucket is not thread-safe, buckets shared by threads must be protected by the user.
+ */
+typedef struct {
+    uint64_t rate;              /* Bytes per second, 0 for no limit. */
+    uint64_t burst;             /* Most tokens the bucket holds. */
+    uint64_t tokens;
+    uint64_t updatedUs;         /* The time tokens were last added. */
+} vsftpTokenBucket_s;
+
+typedef struct vsftpShaperQueue_s vsftpShaperQueue_s;
+
+/* A user of a shared limit, f.e. waiting for its turn in a deficit round robin queue. */
+typedef struct vsftpShaperFlow_s {
+    struct vsftpShaperFlow_s *prev;
+    struct vsftpShaperFlow_s *next;
+    vsftpShaperQueue_s *queue;  /* The queue the flow is in, NULL for none. */
+    size_t deficit;             /* Tokens granted in its turns and not taken yet. */
+    void *arg;                  /* Free for use by the user. */
+} vsftpShaperFlow_s;
+
+struct vsftpShaperQueue_s {
+    vsftpShaperFlow_s *head;
+    vsftpShaperFlow_s *tail;
+};
+
+extern void VSFTPTokenBucketInitialize(vsftpTokenBucket_s *bucket, uint64_t rate);
+extern size_t VSFTPTokenBucketGetTokens(vsftpTokenBucket_s *bucket);
+extern void VSFTPTokenBucketTake(vsftpTokenBucket_s *bucket, size_t tokens);
+extern void VSFTPTokenBucketPutBack(vsftpTokenBucket_s *bucket, size_t tokens);
+extern unsigned int VSFTPTokenBucketGetWaitMs(const vsftpTokenBucket_s *bucket, size_t tokens);
+
+extern void VSFTPShaperQueueAppend(vsftpShaperQueue_s *queue, vsftpShaperFlow_s *flow);
+extern void VSFTPShaperQueueRemove(vsftpShaperFlow_s *flow);
+
+#endif /* VSFTP_SHAPER_H__ */
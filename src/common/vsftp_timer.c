@@ -0,0 +1,349 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "vsftp_timer.h"
+
+#define TIMER_WHEEL_SLOT_MASK   ((uint64_t)TIMER_WHEEL_SLOTS - 1U)
+#define TIMER_WHEEL_SPAN        ((uint64_t)1U << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))
+
+static uint64_t GetElapsedMs(const vsftpTimerWheel_s *wheel);
+static void InitializeList(vsftpTimerLink_s *head);
+static void LinkTimer(vsftpTimerLink_s *head, vsftpTimerLink_s *link);
+static void UnlinkTimer(vsftpTimerLink_s *link);
+static void MoveList(vsftpTimerLink_s *from, vsftpTimerLink_s *to);
+static void InsertTimer(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer);
+static void CascadeSlot(vsftpTimerWheel_s *wheel, unsigned int level);
+static void Tick(vsftpTimerWheel_s *wheel);
+
+/*!
+ * \brief Get the time elapsed since a wheel was initialized.
+ * \param wheel
+ *      The wheel.
+ * \returns The elapsed time in milliseconds.
+ */
+static uint64_t GetElapsedMs(const vsftpTimerWheel_s *wheel)
+{
+    struct timespec now;
+    int64_t ms = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = ((int64_t)(now.tv_sec - wheel->start.tv_sec) * 1000) + ((now.tv_nsec - wheel->start.tv_nsec) / 1000000);
+
+    return (ms > 0) ? (uint64_t)ms : 0U;
+}
+
+/*!
+ * \brief Initialize an empty list.
+ * \param head
+ *      The head node of the list.
+ */
+static void InitializeList(vsftpTimerLink_s *head)
+{
+    /* Argument checks are performed by the caller. */
+
+    head->next = head;
+    head->prev = head;
+}
+
+/*!
+ * \brief Add a node at the end of a list.
+ * \param head
+ *      The head node of the list.
+ * \param link
+ *      The node to add, it must not be part of a list.
+ */
+static void LinkTimer(vsftpTimerLink_s *head, vsftpTimerLink_s *link)
+{
+    /* Argument checks are performed by the caller. */
+
+    link->next = head;
+    link->prev = head->prev;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+/*!
+ * \brief Remove a node from the list it is part of.
+ * \param link
+ *      The node to remove.
+ */
+static void UnlinkTimer(vsftpTimerLink_s *link)
+{
+    /* Argument checks are performed by the caller. */
+
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+/*!
+ * \brief Move all nodes of a list to another, empty, list.
+ * \param from
+ *      The head node of the list to move from, it is empty afterwards.
+ * \param to
+ *      The head node of the empty list to move to.
+ */
+static void MoveList(vsftpTimerLink_s *from, vsftpTimerLink_s *to)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (from->next != from) {
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        InitializeList(from);
+    }
+}
+
+/*!
+ * \brief Add a timer to the slot its expiry falls in.
+ * \details
+ *      The lowest level that spans the time left is used, a timer that expires beyond the highest level is capped.
+ * \param wheel
+ *      The wheel to add the timer to.
+ * \param timer
+ *      The timer to add, its expiry must not be before the current tick.
+ */
+static void InsertTimer(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer)
+{
+    uint64_t delta = 0;
+    unsigned int level = 0;
+    size_t slot = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    if ((timer->expiry - wheel->now) >= TIMER_WHEEL_SPAN) {
+        timer->expiry = wheel->now + TIMER_WHEEL_SPAN - 1U;
+    }
+
+    delta = timer->expiry - wheel->now;
+    while (((level + 1U) < TIMER_WHEEL_LEVELS) && (delta >= ((uint64_t)1U << ((level + 1U) * TIMER_WHEEL_SLOT_BITS)))) {
+        level++;
+    }
+
+    slot = (size_t)((timer->expiry >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK);
+    LinkTimer(&wheel->slots[level][slot], &timer->link);
+}
+
+/*!
+ * \brief Move the timers of the current slot of a level down to the lower levels.
+ * \param wheel
+ *      The wheel.
+ * \param level
+ *      The level to cascade, 1 or higher.
+ */
+static void CascadeSlot(vsftpTimerWheel_s *wheel, const unsigned int level)
+{
+    vsftpTimerLink_s timers;
+    vsftpTimerLink_s *link = NULL;
+    size_t slot = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    slot = (size_t)((wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK);
+
+    InitializeList(&timers);
+    MoveList(&wheel->slots[level][slot], &timers);
+
+    while (timers.next != &timers) {
+        link = timers.next;
+        UnlinkTimer(link);
+        InsertTimer(wheel, (vsftpTimer_s *)link);
+    }
+}
+
+/*!
+ * \brief Advance a wheel by one tick and expire the timers of that tick.
+ * \param wheel
+ *      The wheel.
+ */
+static void Tick(vsftpTimerWheel_s *wheel)
+{
+    vsftpTimer_s *timer = NULL;
+    size_t slot = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    wheel->now++;
+
+    /* Whenever a level wraps around, the next slot of the level above it comes within its reach. */
+    for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if ((wheel->now & (((uint64_t)1U << (level * TIMER_WHEEL_SLOT_BITS)) - 1U)) != 0) {
+            break;
+        }
+        CascadeSlot(wheel, level);
+    }
+
+    /* Callbacks may start and stop any timer, so take the expired ones one at a time. */
+    slot = (size_t)(wheel->now & TIMER_WHEEL_SLOT_MASK);
+    MoveList(&wheel->slots[0][slot], &wheel->expired);
+    while (wheel->expired.next != &wheel->expired) {
+        timer = (vsftpTimer_s *)wheel->expired.next;
+        UnlinkTimer(&timer->link);
+        wheel->count--;
+        timer->expired(timer);
+    }
+}
+
+/*!
+ * \brief Initialize an empty timer wheel.
+ * \param wheel
+ *      The wheel to initialize.
+ */
+void VSFTPTimerWheelInitialize(vsftpTimerWheel_s *wheel)
+{
+    if (wheel != NULL) {
+        for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+                InitializeList(&wheel->slots[level][slot]);
+            }
+        }
+        InitializeList(&wheel->expired);
+        (void)clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+        wheel->now = 0;
+        wheel->count = 0;
+    }
+}
+
+/*!
+ * \brief Expire the timers of a wheel that are due.
+ * \details
+ *      The callbacks of the expired timers are called from this function.
+ * \param wheel
+ *      The wheel.
+ */
+void VSFTPTimerWheelAdvance(vsftpTimerWheel_s *wheel)
+{
+    uint64_t target = 0;
+
+    if (wheel != NULL) {
+        target = GetElapsedMs(wheel) / TIMER_TICK_MS;
+
+        if (wheel->count == 0) {
+            /* Nothing to expire, skip the empty ticks. */
+            wheel->now = target;
+        }
+
+        while (wheel->now < target) {
+            Tick(wheel);
+        }
+    }
+}
+
+/*!
+ * \brief Get the time to wait for events before the wheel has to be advanced again.
+ * \param wheel
+ *      The wheel.
+ * \param timeoutMax
+ *      The longest time to wait in milliseconds.
+ * \returns The time to wait in milliseconds, at most 'timeoutMax'.
+ */
+int VSFTPTimerWheelGetTimeout(const vsftpTimerWheel_s *wheel, const int timeoutMax)
+{
+    uint64_t elapsed = 0;
+    uint64_t nextTick = 0;
+    int timeout = timeoutMax;
+
+    if ((wheel != NULL) && (wheel->count > 0)) {
+        elapsed = GetElapsedMs(wheel);
+        nextTick = (wheel->now + 1U) * TIMER_TICK_MS;
+        if (nextTick <= elapsed) {
+            timeout = 0;
+        } else if ((nextTick - elapsed) < (uint64_t)timeoutMax) {
+            timeout = (int)(nextTick - elapsed);
+        }
+    }
+
+    return timeout;
+}
+
+/*!
+ * \brief Initialize a timer that is not armed.
+ * \param timer
+ *      The timer to initialize.
+ * \param expired
+ *      The function to call when the timer expires.
+ * \param arg
+ *      Free for use by the user.
+ */
+void VSFTPTimerInitialize(vsftpTimer_s *timer, const TimerExpired expired, void *arg)
+{
+    if (timer != NULL) {
+        timer->link.next = NULL;
+        timer->link.prev = NULL;
+        timer->expiry = 0;
+        timer->expired = expired;
+        timer->arg = arg;
+    }
+}
+
+/*!
+ * \brief Start (or restart) a timer.
+ * \param wheel
+ *      The wheel to start the timer on, a timer must always be started on the same wheel.
+ * \param timer
+ *      The timer to start.
+ * \param timeoutMs
+ *      The time until the timer expires in milliseconds, rounded up to whole ticks.
+ */
+void VSFTPTimerStart(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer, const unsigned int timeoutMs)
+{
+    uint64_t ticks = 0;
+
+    if ((wheel != NULL) && (timer != NULL) && (timer->expired != NULL)) {
+        VSFTPTimerStop(wheel, timer);
+
+        ticks = ((uint64_t)timeoutMs + TIMER_TICK_MS - 1U) / TIMER_TICK_MS;
+        timer->expiry = wheel->now + ((ticks > 0) ? ticks : 1U);
+        InsertTimer(wheel, timer);
+        wheel->count++;
+    }
+}
+
+/*!
+ * \brief Stop a timer, stopping a timer that is not armed is allowed.
+ * \param wheel
+ *      The wheel the timer was started on.
+ * \param timer
+ *      The timer to stop.
+ */
+void VSFTPTimerStop(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer)
+{
+    if ((wheel != NULL) && (timer != NULL) && (timer->link.next != NULL)) {
+        UnlinkTimer(&timer->link);
+        wheel->count--;
+    }
+}
+
+/*!
+ * \brief Check if a timer is armed.
+ * \param timer
+ *      The timer.
+ * \returns true when the timer is armed, false when it is not (or in case of an error).
+ */
+bool VSFTPTimerIsArmed(const vsftpTimer_s *timer)
+{
+    return (timer != NULL) && (timer->link.next != NULL);
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_TIMER_H__
+#define VSFTP_TIMER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+
+typedef struct vsftpTimer_s vsftpTimer_s;
+
+typedef void (* TimerExpired)(vsftpTimer_s *timer);
+
+/* A node of a circular, doubly linked list of timers. Each list has a head node that is not part of a timer. */
+typedef struct vsftpTimerLink_s {
+    struct vsftpTimerLink_s *next;
+    struct vsftpTimerLink_s *prev;
+} vsftpTimerLink_s;
+
+/* A one-shot timer, the storage is owned by the user and must remain valid while the timer is armed. */
+struct vsftpTimer_s {
+    vsftpTimerLink_s link;      /* Must be the first member, NULL links mean the timer is not armed. */
+    uint64_t expiry;            /* The tick at which the timer expires. */
+    TimerExpired expired;       /* Called once the timer expires, the timer may be restarted from it. */
+    void *arg;                  /* Free for use by the user. */
+};
+
+/* A hierarchical timer wheel, starting, stopping and expiring a timer take constant time.
+ * Level 'n' has TIMER_WHEEL_SLOTS slots of TIMER_WHEEL_SLOTS^n ticks each. Timers on a higher level are moved down
+ * (cascaded) when the lower level wraps. A wheel is used by a single thread.
+ */
+typedef struct {
+    vsftpTimerLink_s slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    vsftpTimerLink_s expired;   /* Timers whose callback still has to be called in the current tick. */
+    struct timespec start;
+    uint64_t now;               /* Ticks since 'start' that have been processed. */
+    size_t count;               /* Timers armed. */
+} vsftpTimerWheel_s;
+
+extern void VSFTPTimerWheelInitialize(vsftpTimerWheel_s *wheel);
+extern void VSFTPTimerWheelAdvance(vsftpTimerWheel_s *wheel);
+extern int VSFTPTimerWheelGetTimeout(const vsftpTimerWheel_s *wheel, int timeoutMax);
+
+extern void VSFTPTimerInitialize(vsftpTimer_s *timer, TimerExpired expired, void *arg);
+extern void VSFTPTimerStart(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer, unsigned int timeoutMs);
+extern void VSFTPTimerStop(vsftpTimerWheel_s *wheel, vsftpTimer_s *timer);
+extern bool VSFTPTimerIsArmed(const vsftpTimer_s *timer);
+
+#endif /* VSFTP_TIMER_H__ */
@@ -0,0 +1,742 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include "vsftp_filesystem.h"
+#include "vsftp_uring.h"
+#include "config.h"
+#include "vsftp_transfer.h"
+
+static int SendfileChunk(vsftpTransfer_s *transfer, int sock, size_t size, size_t *sent);
+static int CopyChunk(vsftpTransfer_s *transfer, int sock, size_t size, size_t *sent);
+static void CompleteZerocopy(vsftpTransfer_s *transfer, uint32_t seqFirst, uint32_t seqLast, bool isCopied);
+static void ReleaseWindows(vsftpTransfer_s *transfer);
+static vsftpTransferWindow_s *MapWindow(vsftpTransfer_s *transfer);
+static vsftpTransferWindow_s *GetSendWindow(vsftpTransfer_s *transfer);
+static int ZerocopyChunk(vsftpTransfer_s *transfer, int sock, size_t size, size_t *sent);
+static void AdvanceChunk(vsftpTransfer_s *transfer, vsftpTransferWindow_s *window, size_t numSent, size_t *sent);
+
+/*!
+ * \brief Initialize a transfer to the closed state.
+ * \param transfer
+ *      The transfer to initialize.
+ */
+void VSFTPTransferInitialize(vsftpTransfer_s *transfer)
+{
+    if (transfer != NULL) {
+        (void)memset(transfer, 0, sizeof(*transfer));
+        transfer->fd = -1;
+    }
+}
+
+/*!
+ * \brief Open the file to transfer.
+ * \param transfer
+ *      The transfer, it must be closed.
+ * \param absPath
+ *      The absolute path to the file, including the filename.
+ * \param absPathLen
+ *      The length of 'absPath'.
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPTransferOpen(vsftpTransfer_s *transfer, const char *absPath, const size_t absPathLen)
+{
+    int retval = -1;
+
+    /* absPath and absPathLen are checked by callee. */
+
+    if ((transfer != NULL) && (transfer->isOpen == false)) {
+        retval = 0;
+    }
+
+    if (retval == 0) {
+        retval = VSFTPFilesystemOpenFile(absPath, absPathLen, &transfer->fd, &transfer->size,
+                                         &transfer->fileId);
+    }
+
+    if (retval == 0) {
+        transfer->offset = 0;
+        transfer->remaining = transfer->size;
+        transfer->path = TRANSFER_PATH_SENDFILE;
+        transfer->isOpen = true;
+    } else if (transfer != NULL) {
+        VSFTPTransferClose(transfer);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Limit a transfer to a byte range of its file.
+ * \details
+ *      Used to resume (REST) or to send a part of a file (RANG). It must be set before the first chunk is sent, every
+ *      way of sending starts at the range.
+ * \param transfer
+ *      The open transfer.
+ * \param start
+ *      The first byte to send, the size of the file sends nothing.
+ * \param end
+ *      The last byte to send, UINT64_MAX (or any byte past the end of the file) sends up to the end of the file.
+ * \returns 0 in case of successful completion, ERANGE when 'start' lies beyond the end of the file or any other value
+ *      in case of an error.
+ */
+int VSFTPTransferSetRange(vsftpTransfer_s *transfer, const uint64_t start, const uint64_t end)
+{
+    int retval = -1;
+
+    if ((transfer != NULL) && (transfer->isOpen == true) && (transfer->offset == 0) &&
+        (transfer->remaining == transfer->size) && (start <= end)) {
+        retval = 0;
+    }
+
+    if ((retval == 0) && (start > transfer->size)) {
+        retval = ERANGE;
+    }
+
+    if (retval == 0) {
+        transfer->offset = (off_t)start;
+        if (end < transfer->size) {
+            transfer->size = (size_t)(end - start) + 1U;
+        } else {
+            transfer->size -= (size_t)start;
+        }
+        transfer->remaining = transfer->size;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Send the next chunk of a transfer with sendfile().
+ * \details
+ *      The file is sent from the page cache, without copying it to user space, with a single call per chunk unless
+ *      the socket buffer fills up. When the kernel refuses sendfile() for the file before anything was sent, the
+ *      transfer falls back to copying (TRANSFER_PATH_COPY).
+ * \param transfer
+ *      The transfer to advance.
+ * \param sock
+ *      The socket to send the chunk on.
+ * \param size
+ *      The most bytes to send.
+ * \param[in,out] sent
+ *      A pointer to the storage location for the number of bytes sent, it is added to.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block before anything was sent or any
+ *      other value in case of an error.
+ */
+static int SendfileChunk(vsftpTransfer_s *transfer, const int sock, const size_t size, size_t *sent)
+{
+    size_t toSend = 0;
+    ssize_t numSent = 0;
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    while ((transfer->remaining > 0) && (*sent < size)) {
+        toSend = (transfer->remaining < (size - *sent)) ? transfer->remaining : (size - *sent);
+
+        /* Advances the offset by the bytes sent. */
+        numSent = sendfile(sock, transfer->fd, &transfer->offset, toSend);
+        if (numSent == 0) {
+            /* The file was truncated while sending it. */
+            retval = -1;
+            break;
+        } else if (numSent == -1) {
+            if (((errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP)) && (*sent == 0)) {
+                /* Not supported for this file, send it the old way. */
+                transfer->path = TRANSFER_PATH_COPY;
+            } else if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (*sent == 0)) {
+                retval = EAGAIN;
+            } else if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
+                retval = -1;
+            }
+            break;
+        }
+
+        transfer->remaining -= (size_t)numSent;
+        *sent += (size_t)numSent;
+
+        if ((size_t)numSent < toSend) {
+            /* The socket buffer is full. */
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Send the next chunk of a transfer by reading it into a buffer and writing it from there.
+ * \param transfer
+ *      The transfer to advance.
+ * \param sock
+ *      The socket to send the chunk on.
+ * \param size
+ *      The most bytes to send.
+ * \param[in,out] sent
+ *      A pointer to the storage location for the number of bytes sent, it is added to.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block before anything was sent or any
+ *      other value in case of an error.
+ */
+static int CopyChunk(vsftpTransfer_s *transfer, const int sock, const size_t size, size_t *sent)
+{
+    char fileBuf[FILE_READ_BUF_SIZE];
+    size_t toRead = 0;
+    ssize_t numRead = 0;
+    ssize_t numSent = 0;
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    while ((transfer->remaining > 0) && (*sent < size)) {
+        toRead = transfer->remaining < sizeof(fileBuf) ? transfer->remaining : sizeof(fileBuf);
+        if (toRead > (size - *sent)) {
+            toRead = size - *sent;
+        }
+        /* Read at the offset, bytes that could not be sent are simply read again for the next chunk. */
+        numRead = pread(transfer->fd, fileBuf, toRead, transfer->offset);
+        if (numRead <= 0) {
+            /* Error, or the file was truncated while sending it. */
+            retval = -1;
+            break;
+        }
+
+        numSent = write(sock, fileBuf, (size_t)numRead);
+        if (numSent == -1) {
+            if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (*sent == 0)) {
+                retval = EAGAIN;
+            } else if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
+                retval = -1;
+            }
+            break;
+        }
+
+        AdvanceChunk(transfer, NULL, (size_t)numSent, sent);
+
+        if (numSent < numRead) {
+            /* The socket buffer is full. */
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Let the rest of a transfer be sent with MSG_ZEROCOPY.
+ * \details
+ *      Enables SO_ZEROCOPY on the socket. From then on the file is mapped in windows of ZEROCOPY_WINDOW_SIZE and sent
+ *      from the mapping, the kernel pins the pages instead of copying them. This only pays off for large sends, the
+ *      caller decides on the size of the file.
+ * \param transfer
+ *      The transfer, it must be open and still be sent with sendfile().
+ * \param sock
+ *      The socket the transfer is sent on.
+ * \returns 0 in case of successful completion or any other value in case of an error, f.e. when the kernel does not
+ *      support MSG_ZEROCOPY. The transfer is then sent with sendfile().
+ */
+int VSFTPTransferEnableZerocopy(vsftpTransfer_s *transfer, const int sock)
+{
+    const int one = 1;
+    int retval = -1;
+
+    if ((transfer != NULL) && (transfer->isOpen == true) && (transfer->path == TRANSFER_PATH_SENDFILE)) {
+        retval = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+    }
+
+    if (retval == 0) {
+        transfer->path = TRANSFER_PATH_ZEROCOPY;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Account the completion of MSG_ZEROCOPY sends to the windows they were sent from.
+ * \param transfer
+ *      The transfer the sends belong to.
+ * \param seqFirst
+ *      The sequence number of the first completed send.
+ * \param seqLast
+ *      The sequence number of the last completed send.
+ * \param isCopied
+ *      The kernel copied the data of the sends after all.
+ */
+static void CompleteZerocopy(vsftpTransfer_s *transfer, const uint32_t seqFirst, const uint32_t seqLast,
+                             const bool isCopied)
+{
+    vsftpTransferWindow_s *window = NULL;
+    uint64_t first = 0;
+    uint64_t end = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    for (size_t i = 0; i < transfer->windowsLen; i++) {
+        window = &transfer->windows[(transfer->windowsHead + i) % ZEROCOPY_WINDOWS];
+
+        /* The overlap of the completed range and the sends of the window. */
+        first = (seqFirst > window->seqStart) ? seqFirst : window->seqStart;
+        end = (((uint64_t)seqLast + 1U) < window->seqEnd) ? ((uint64_t)seqLast + 1U) : window->seqEnd;
+        if (end > first) {
+            window->completed += (uint32_t)(end - first);
+            window->isCopied = window->isCopied || isCopied;
+        }
+    }
+}
+
+/*!
+ * \brief Unmap the windows at the head of the ring that are sent and completed by the kernel.
+ * \param transfer
+ *      The transfer to release the windows of.
+ */
+static void ReleaseWindows(vsftpTransfer_s *transfer)
+{
+    vsftpTransferWindow_s *window = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    while (transfer->windowsLen > 0) {
+        window = &transfer->windows[transfer->windowsHead];
+        if ((window->sent < window->len) || (window->completed < (window->seqEnd - window->seqStart))) {
+            break;
+        }
+
+        if (window->isCopied == true) {
+            transfer->copiedBytes += window->len;
+        } else {
+            transfer->zerocopyBytes += window->len;
+        }
+        (void)munmap(window->map, window->mapLen);
+
+        transfer->windowsHead = (transfer->windowsHead + 1U) % ZEROCOPY_WINDOWS;
+        transfer->windowsLen--;
+    }
+}
+
+/*!
+ * \brief Reap the MSG_ZEROCOPY completions of a transfer from the error queue of its socket.
+ * \details
+ *      Windows of which all sends are completed are unmapped. Call it before the socket is closed, so that the last
+ *      windows are accounted too.
+ * \param transfer
+ *      The transfer, reaping a transfer that is not sent with MSG_ZEROCOPY is allowed.
+ * \param sock
+ *      The socket the transfer is sent on.
+ */
+void VSFTPTransferReapZerocopy(vsftpTransfer_s *transfer, const int sock)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    const struct sock_extended_err *serr = NULL;
+    struct cmsghdr *cmsg = NULL;
+    struct msghdr msg;
+
+    if ((transfer != NULL) && (transfer->windowsLen > 0)) {
+        (void)memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        /* One notification per call, adjacent completions are merged into a range by the kernel. */
+        while (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) != -1) {
+            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+                    ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))) {
+                    serr = (const struct sock_extended_err *)(const void *)CMSG_DATA(cmsg);
+                    if ((serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) && (serr->ee_errno == 0)) {
+                        CompleteZerocopy(transfer, serr->ee_info, serr->ee_data,
+                                         (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+                    }
+                }
+            }
+            msg.msg_controllen = sizeof(control);
+        }
+
+        ReleaseWindows(transfer);
+    }
+}
+
+/*!
+ * \brief Map the next window of a transfer at its offset.
+ * \param transfer
+ *      The transfer, it must have room for another window.
+ * \returns The window, or NULL when the file could not be mapped.
+ */
+static vsftpTransferWindow_s *MapWindow(vsftpTransfer_s *transfer)
+{
+    vsftpTransferWindow_s *window = NULL;
+    const off_t pageOffset = transfer->offset % (off_t)sysconf(_SC_PAGESIZE);
+    void *map = NULL;
+    size_t len = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    len = (transfer->remaining < ZEROCOPY_WINDOW_SIZE) ? transfer->remaining : ZEROCOPY_WINDOW_SIZE;
+    map = mmap(NULL, len + (size_t)pageOffset, PROT_READ, MAP_SHARED, transfer->fd, transfer->offset - pageOffset);
+    if (map != MAP_FAILED) {
+        /* Read ahead aggressively and drop the pages behind. */
+        (void)madvise(map, len + (size_t)pageOffset, MADV_SEQUENTIAL);
+
+        window = &transfer->windows[(transfer->windowsHead + transfer->windowsLen) % ZEROCOPY_WINDOWS];
+        window->map = map;
+        window->mapLen = len + (size_t)pageOffset;
+        window->data = (const char *)map + pageOffset;
+        window->len = len;
+        window->sent = 0;
+        window->seqStart = transfer->seqNext;
+        window->seqEnd = transfer->seqNext;
+        window->completed = 0;
+        window->isCopied = false;
+        transfer->windowsLen++;
+    }
+
+    return window;
+}
+
+/*!
+ * \brief Get the window of a transfer the next MSG_ZEROCOPY send is sent from.
+ * \details
+ *      The last window while it has bytes left to send, otherwise the next window is mapped. When the file cannot be
+ *      mapped, the transfer falls back to sendfile() (TRANSFER_PATH_SENDFILE).
+ * \param transfer
+ *      The transfer with bytes remaining.
+ * \returns The window, or NULL when all windows still wait for completion or the file could not be mapped.
+ */
+static vsftpTransferWindow_s *GetSendWindow(vsftpTransfer_s *transfer)
+{
+    vsftpTransferWindow_s *window = NULL;
+
+    /* Argument checks are performed by the caller. */
+
+    if (transfer->windowsLen > 0) {
+        window = &transfer->windows[(transfer->windowsHead + transfer->windowsLen - 1U) % ZEROCOPY_WINDOWS];
+        if (window->sent == window->len) {
+            window = NULL;
+        }
+    }
+
+    if ((window == NULL) && (transfer->windowsLen < ZEROCOPY_WINDOWS)) {
+        window = MapWindow(transfer);
+        if (window == NULL) {
+            transfer->path = TRANSFER_PATH_SENDFILE;
+        }
+    }
+
+    return window;
+}
+
+/*!
+ * \brief Send the next chunk of a transfer from a mapping of the file with MSG_ZEROCOPY.
+ * \details
+ *      Completed windows are unmapped first. When all windows still wait for completion, the chunk is sent with
+ *      sendfile() instead. When the kernel is out of memory for notifications, the slice is copied from its window, so
+ *      that the window stays in step with the offset. When the file cannot be mapped, the transfer falls back to
+ *      sendfile() (TRANSFER_PATH_SENDFILE).
+ * \param transfer
+ *      The transfer to advance.
+ * \param sock
+ *      The socket to send the chunk on.
+ * \param size
+ *      The most bytes to send.
+ * \param[in,out] sent
+ *      A pointer to the storage location for the number of bytes sent, it is added to.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block before anything was sent or any
+ *      other value in case of an error.
+ */
+static int ZerocopyChunk(vsftpTransfer_s *transfer, const int sock, const size_t size, size_t *sent)
+{
+    vsftpTransferWindow_s *window = NULL;
+    bool isZerocopy = true;
+    size_t toSend = 0;
+    ssize_t numSent = 0;
+    int retval = 0;
+
+    /* Argument checks are performed by the caller. */
+
+    VSFTPTransferReapZerocopy(transfer, sock);
+
+    while ((transfer->remaining > 0) && (*sent < size)) {
+        window = GetSendWindow(transfer);
+        if ((window == NULL) && (transfer->path == TRANSFER_PATH_ZEROCOPY)) {
+            retval = SendfileChunk(transfer, sock, size, sent);
+            break;
+        } else if (window == NULL) {
+            break;
+        }
+
+        toSend = window->len - window->sent;
+        if (toSend > (size - *sent)) {
+            toSend = size - *sent;
+        }
+
+        isZerocopy = true;
+        numSent = send(sock, window->data + window->sent, toSend, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if ((numSent == -1) && (errno == ENOBUFS)) {
+            /* No memory for the notification, this slice is copied from the window without a sequence number. */
+            isZerocopy = false;
+            window->isCopied = true;
+            numSent = send(sock, window->data + window->sent, toSend, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+
+        if (numSent == -1) {
+            if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (*sent == 0)) {
+                retval = EAGAIN;
+            } else if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
+                retval = -1;
+            }
+            break;
+        }
+
+        if (isZerocopy == true) {
+            /* Each successful send gets the next sequence number, also when it is completed by copying. */
+            transfer->seqNext++;
+            window->seqEnd = transfer->seqNext;
+        }
+        AdvanceChunk(transfer, window, (size_t)numSent, sent);
+
+        if ((size_t)numSent < toSend) {
+            /* The socket buffer is full. */
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Account the bytes of a send to a transfer.
+ * \param transfer
+ *      The transfer that was sent.
+ * \param window
+ *      The window the bytes were sent from, NULL when they were not sent from a mapping.
+ * \param numSent
+ *      The bytes sent.
+ * \param[in,out] sent
+ *      A pointer to the storage location for the number of bytes sent by the chunk, it is added to.
+ */
+static void AdvanceChunk(vsftpTransfer_s *transfer, vsftpTransferWindow_s *window, const size_t numSent,
+                         size_t *sent)
+{
+    /* Argument checks are performed by the caller. */
+
+    if (window != NULL) {
+        window->sent += numSent;
+    }
+    transfer->offset += (off_t)numSent;
+    transfer->remaining -= numSent;
+    *sent += numSent;
+}
+
+/*!
+ * \brief Send the next chunk of a transfer.
+ * \details
+ *      Sends at most 'size' bytes, so that a single transfer cannot monopolize its worker.
+ *      This is a non-blocking call when 'sock' is non-blocking. The chunk is sent with sendfile(), or copied when the
+ *      file does not support it, or from a mapping of the file with MSG_ZEROCOPY, see 'path' of the transfer.
+ * \param transfer
+ *      The transfer to advance.
+ * \param sock
+ *      The socket to send the chunk on.
+ * \param size
+ *      The most bytes to send, f.e. TRANSFER_CHUNK_SIZE.
+ * \param[out] sent
+ *      A pointer to the storage location for the number of bytes sent.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block before anything was sent or any
+ *      other value in case of an error.
+ */
+int VSFTPTransferSendChunk(vsftpTransfer_s *transfer, const int sock, const size_t size, size_t *sent)
+{
+    int retval = -1;
+
+    if ((transfer != NULL) && (transfer->isOpen == true) && (sent != NULL)) {
+        retval = 0;
+        *sent = 0;
+    }
+
+    if ((retval == 0) && (transfer->path == TRANSFER_PATH_ZEROCOPY)) {
+        retval = ZerocopyChunk(transfer, sock, size, sent);
+    }
+
+    /* Also when the file could not be mapped. */
+    if ((retval == 0) && (transfer->path == TRANSFER_PATH_SENDFILE) && (*sent < size)) {
+        retval = SendfileChunk(transfer, sock, size, sent);
+    }
+
+    /* Also when sendfile() was just refused. */
+    if ((retval == 0) && (transfer->path == TRANSFER_PATH_COPY)) {
+        retval = CopyChunk(transfer, sock, size, sent);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Queue the next chunk of a transfer on a ring.
+ * \details
+ *      A chunk is a single send, as the bytes of a send must not depend on an earlier send of the same submit that fell
+ *      short. With MSG_ZEROCOPY it is sent from the current window, up to its end. A copied chunk is read into 'buf'
+ *      by an operation that is linked to the send. Chunks sent with sendfile() can not be queued, io_uring has no
+ *      such operation, nor can chunks while all windows wait for completion.
+ *      Once reaped, the result of the send is handed to VSFTPTransferCompleteChunk().
+ * \param transfer
+ *      The transfer to advance, it must not have a chunk queued.
+ * \param ring
+ *      The ring to queue the chunk on.
+ * \param sock
+ *      The socket to send the chunk on.
+ * \param size
+ *      The most bytes to send.
+ * \param buf
+ *      The buffer a copied chunk is read into, it must stay valid until the chunk is reaped. Not used with
+ *      MSG_ZEROCOPY.
+ * \param bufLen
+ *      The size of 'buf'.
+ * \param data
+ *      Returned with the result of the send, see VSFTPUringReap().
+ * \returns 0 when the chunk is queued or any other value when it has to be sent with VSFTPTransferSendChunk().
+ */
+int VSFTPTransferQueueChunk(vsftpTransfer_s *transfer, vsftpUring_s *ring, const int sock, const size_t size,
+                            char *buf, const size_t bufLen, void *data)
+{
+    vsftpTransferWindow_s *window = NULL;
+    size_t toSend = 0;
+    int retval = -1;
+
+    if ((transfer != NULL) && (transfer->isOpen == true) && (transfer->remaining > 0) && (size > 0) &&
+        (transfer->queued == 0)) {
+        toSend = (transfer->remaining < size) ? transfer->remaining : size;
+    }
+
+    if ((toSend > 0) && (transfer->path == TRANSFER_PATH_ZEROCOPY)) {
+        VSFTPTransferReapZerocopy(transfer, sock);
+        window = GetSendWindow(transfer);
+        if (window != NULL) {
+            if (toSend > (window->len - window->sent)) {
+                toSend = window->len - window->sent;
+            }
+            retval = VSFTPUringQueueSend(ring, sock, window->data + window->sent, toSend,
+                                         MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL, data);
+        }
+    } else if ((toSend > 0) && (transfer->path == TRANSFER_PATH_COPY) && (buf != NULL) && (bufLen > 0)) {
+        if (toSend > bufLen) {
+            toSend = bufLen;
+        }
+        retval = VSFTPUringQueueReadSend(ring, transfer->fd, transfer->offset, sock, buf, toSend,
+                                         MSG_DONTWAIT | MSG_NOSIGNAL, data);
+    }
+
+    if (retval == 0) {
+        transfer->queued = toSend;
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Complete the chunk of a transfer that was queued on a ring.
+ * \details
+ *      When the send could not be done on the ring, the chunk is sent with VSFTPTransferSendChunk() instead: a copied
+ *      chunk of which the read fell short, so that a truncated file is noticed, and a MSG_ZEROCOPY send for which the
+ *      kernel was out of memory for the notification.
+ * \param transfer
+ *      The transfer with the queued chunk.
+ * \param sock
+ *      The socket the chunk was sent on.
+ * \param size
+ *      The most bytes the chunk was allowed to send.
+ * \param result
+ *      The result of the send, the bytes sent or minus its errno.
+ * \param[out] sent
+ *      A pointer to the storage location for the number of bytes sent.
+ * \returns 0 in case of successful completion, EAGAIN when the socket would block before anything was sent or any
+ *      other value in case of an error.
+ */
+int VSFTPTransferCompleteChunk(vsftpTransfer_s *transfer, const int sock, const size_t size, const int result,
+                               size_t *sent)
+{
+    vsftpTransferWindow_s *window = NULL;
+    size_t queued = 0;
+    int retval = -1;
+
+    if ((transfer != NULL) && (transfer->isOpen == true) && (transfer->queued > 0) && (sent != NULL)) {
+        queued = transfer->queued;
+        transfer->queued = 0;
+        *sent = 0;
+        retval = 0;
+    }
+
+    if ((retval == 0) && (transfer->path == TRANSFER_PATH_ZEROCOPY)) {
+        /* Nothing was mapped since the chunk was queued, its window is the last one. */
+        window = &transfer->windows[(transfer->windowsHead + transfer->windowsLen - 1U) % ZEROCOPY_WINDOWS];
+    }
+
+    if (retval != 0) {
+        /* Not queued. */
+    } else if ((result == -ECANCELED) || (result == -ENOBUFS)) {
+        retval = VSFTPTransferSendChunk(transfer, sock, size, sent);
+    } else if ((result == -EWOULDBLOCK) || (result == -EAGAIN)) {
+        retval = EAGAIN;
+    } else if ((result < 0) || ((size_t)result > queued)) {
+        retval = -1;
+    } else {
+        if (window != NULL) {
+            /* Each successful send gets the next sequence number, also when it is completed by copying. */
+            transfer->seqNext++;
+            window->seqEnd = transfer->seqNext;
+        }
+        AdvanceChunk(transfer, window, (size_t)result, sent);
+    }
+
+    return retval;
+}
+
+/*!
+ * \brief Check if all bytes of a transfer have been sent.
+ * \param transfer
+ *      The transfer to check.
+ * \returns true if the transfer is complete, otherwise false.
+ */
+bool VSFTPTransferIsComplete(const vsftpTransfer_s *transfer)
+{
+    return (transfer != NULL) && (transfer->isOpen == true) && (transfer->remaining == 0);
+}
+
+/*!
+ * \brief Close a transfer and the file it sends.
+ * \param transfer
+ *      The transfer to close, closing a closed transfer is allowed.
+ */
+void VSFTPTransferClose(vsftpTransfer_s *transfer)
+{
+    if (transfer != NULL) {
+        /* Pages still in flight are pinned by the kernel, they stay valid when they are unmapped. */
+        for (size_t i = 0; i < transfer->windowsLen; i++) {
+            (void)munmap(transfer->windows[(transfer->windowsHead + i) % ZEROCOPY_WINDOWS].map,
+                         transfer->windows[(transfer->windowsHead + i) % ZEROCOPY_WINDOWS].mapLen);
+        }
+        if (transfer->fd != -1) {
+            (void)VSFTPFilesystemCloseFile(transfer->fd, &transfer->fileId);
+        }
+        VSFTPTransferInitialize(transfer);
+    }
+}
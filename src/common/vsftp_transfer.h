@@ -0,0 +1,79 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_TRANSFER_H__
+#define VSFTP_TRANSFER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "vsftp_filesystem.h"
+#include "vsftp_uring.h"
+#include "config.h"
+
+/* How the chunks of a transfer are sent. */
+typedef enum {
+    TRANSFER_PATH_SENDFILE = 0, /* The kernel sends from the page cache, sendfile(). */
+    TRANSFER_PATH_COPY,         /* Read into a buffer and written from it, for files sendfile() refuses. */
+    TRANSFER_PATH_ZEROCOPY,     /* Sent from a mapping of the file with MSG_ZEROCOPY, for large files. */
+    TRANSFER_PATHS
+} vsftpTransferPath_e;
+
+/* A mapped part of a file that is sent with MSG_ZEROCOPY, it is unmapped once the kernel completed its sends. */
+typedef struct {
+    void *map;          /* The mapping, page aligned. */
+    size_t mapLen;
+    const char *data;   /* The first byte of the window in the mapping. */
+    size_t len;         /* Bytes of the window. */
+    size_t sent;        /* Bytes of the window sent. */
+    uint32_t seqStart;  /* Sequence number of the first send of the window. */
+    uint32_t seqEnd;    /* Sequence number after the last send of the window. */
+    uint32_t completed; /* Sends of the window the kernel completed. */
+    bool isCopied;      /* The kernel copied (some of) the window after all. */
+} vsftpTransferWindow_s;
+
+/* A file transfer that is sent one chunk at a time. */
+typedef struct {
+    int fd;             /* Shared with other transfers of the same file, only used with an offset. */
+    vsftpFileId_s fileId;
+    off_t offset;       /* Offset in the file of the next chunk. */
+    size_t remaining;   /* Bytes that remain to be sent. */
+    size_t size;        /* Total bytes to send, the size of the file or of its range. */
+    vsftpTransferPath_e path;
+    bool isOpen;
+    vsftpTransferWindow_s windows[ZEROCOPY_WINDOWS]; /* Ring of windows that wait for completion. */
+    size_t windowsHead;
+    size_t windowsLen;
+    uint32_t seqNext;       /* Sequence number of the next MSG_ZEROCOPY send on the socket. */
+    uint64_t zerocopyBytes; /* Bytes the kernel completed without copying them. */
+    uint64_t copiedBytes;   /* Bytes sent with MSG_ZEROCOPY that the kernel copied after all. */
+    size_t queued;          /* Bytes of the chunk queued on a ring, see VSFTPTransferQueueChunk(). */
+} vsftpTransfer_s;
+
+extern void VSFTPTransferInitialize(vsftpTransfer_s *transfer);
+extern int VSFTPTransferOpen(vsftpTransfer_s *transfer, const char *absPath, size_t absPathLen);
+extern int VSFTPTransferSetRange(vsftpTransfer_s *transfer, uint64_t start, uint64_t end);
+extern int VSFTPTransferEnableZerocopy(vsftpTransfer_s *transfer, int sock);
+extern void VSFTPTransferReapZerocopy(vsftpTransfer_s *transfer, int sock);
+extern int VSFTPTransferSendChunk(vsftpTransfer_s *transfer, int sock, size_t size, size_t *sent);
+extern int VSFTPTransferQueueChunk(vsftpTransfer_s *transfer, vsftpUring_s *ring, int sock, size_t size, char *buf,
+                                   size_t bufLen, void *data);
+extern int VSFTPTransferCompleteChunk(vsftpTransfer_s *transfer, int sock, size_t size, int result, size_t *sent);
+extern bool VSFTPTransferIsComplete(const vsftpTransfer_s *transfer);
+extern void VSFTPTransferClose(vsftpTransfer_s *transfer);
+
+#endif /* VSFTP_TRANSFER_H__ */
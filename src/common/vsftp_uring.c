@@ -0,0 +1,400 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef VSFTP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include "vsftp_uring.h"
+
+#ifdef VSFTP_HAVE_IO_URING
+static struct io_uring_sqe *GetSqe(vsftpUring_s *ring, int sock, void *data);
+#endif
+
+/*!
+ * \brief Set up a ring.
+ * \param ring
+ *      The ring to set up.
+ * \param entries
+ *      The most operations that are queued at a time, the kernel rounds it up to a power of 2.
+ * \returns 0 in case of successful completion or any other value in case of an error (errno is set), f.e. when the
+ *      kernel does not support io_uring or it is disabled (kernel.io_uring_disabled).
+ */
+int VSFTPUringInitialize(vsftpUring_s *ring, const unsigned int entries)
+{
+    int retval = -1;
+#ifdef VSFTP_HAVE_IO_URING
+    struct io_uring_params params;
+
+    if ((ring != NULL) && (entries > 0)) {
+        (void)memset(ring, 0, sizeof(*ring));
+        (void)memset(&params, 0, sizeof(params));
+        ring->sqMap = MAP_FAILED;
+        ring->cqMap = MAP_FAILED;
+        ring->sqes = MAP_FAILED;
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd != -1) {
+            retval = 0;
+        }
+    } else {
+        errno = EINVAL;
+    }
+
+    if (retval == 0) {
+        ring->entries = params.sq_entries;
+        ring->sqMapLen = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+        ring->cqMapLen = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+            /* Both queues are in one mapping. */
+            ring->sqMapLen = (ring->sqMapLen > ring->cqMapLen) ? ring->sqMapLen : ring->cqMapLen;
+            ring->cqMapLen = ring->sqMapLen;
+        }
+
+        ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_SQ_RING);
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+            ring->cqMap = ring->sqMap;
+        } else if (ring->sqMap != MAP_FAILED) {
+            ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+        }
+        ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+        if (ring->cqMap != MAP_FAILED) {
+            ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                              IORING_OFF_SQES);
+        }
+        if (ring->sqes == MAP_FAILED) {
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        ring->sqHead = (unsigned int *)((char *)ring->sqMap + params.sq_off.head);
+        ring->sqTail = (unsigned int *)((char *)ring->sqMap + params.sq_off.tail);
+        ring->sqMask = (unsigned int *)((char *)ring->sqMap + params.sq_off.ring_mask);
+        ring->sqArray = (unsigned int *)((char *)ring->sqMap + params.sq_off.array);
+        ring->cqHead = (unsigned int *)((char *)ring->cqMap + params.cq_off.head);
+        ring->cqTail = (unsigned int *)((char *)ring->cqMap + params.cq_off.tail);
+        ring->cqMask = (unsigned int *)((char *)ring->cqMap + params.cq_off.ring_mask);
+        ring->cqes = (char *)ring->cqMap + params.cq_off.cqes;
+    } else if ((ring != NULL) && (ring->fd != -1)) {
+        VSFTPUringClose(ring);
+    }
+#else
+    (void)ring;
+    (void)entries;
+    errno = ENOSYS;
+#endif
+
+    return retval;
+}
+
+#ifdef VSFTP_HAVE_IO_URING
+/*!
+ * \brief Take the next free entry of the submission queue.
+ * \param ring
+ *      The ring, it must not be full.
+ * \param sock
+ *      The socket of the operation.
+ * \param data
+ *      Returned with the result of the operation, see VSFTPUringReap().
+ * \returns The cleared entry with the socket and the data filled in.
+ */
+static struct io_uring_sqe *GetSqe(vsftpUring_s *ring, const int sock, void *data)
+{
+    /* Only this thread moves the tail. */
+    const unsigned int tail = *ring->sqTail + ring->queued;
+    const unsigned int index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+
+    /* Argument checks are performed by the caller. */
+
+    (void)memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = sock;
+    sqe->user_data = (uint64_t)(uintptr_t)data;
+    ring->sqArray[index] = index;
+    ring->queued++;
+
+    return sqe;
+}
+#endif
+
+/*!
+ * \brief Queue a recvmsg() on a socket.
+ * \param ring
+ *      The ring, it must not be full.
+ * \param sock
+ *      The socket to receive from.
+ * \param msg
+ *      The message to receive into, it must stay valid until the operation is reaped.
+ * \param flags
+ *      The flags of the recvmsg(), MSG_DONTWAIT for sockets that may have no data.
+ * \param data
+ *      Returned with the result, see VSFTPUringReap().
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPUringQueueRecvmsg(vsftpUring_s *ring, const int sock, struct msghdr *msg, const int flags, void *data)
+{
+    int retval = -1;
+#ifdef VSFTP_HAVE_IO_URING
+    struct io_uring_sqe *sqe = NULL;
+
+    if ((ring != NULL) && (msg != NULL) && (VSFTPUringIsFull(ring) == false)) {
+        sqe = GetSqe(ring, sock, data);
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = (uint32_t)flags;
+        retval = 0;
+    }
+#else
+    (void)ring;
+    (void)sock;
+    (void)msg;
+    (void)flags;
+    (void)data;
+#endif
+
+    return retval;
+}
+
+/*!
+ * \brief Queue a send() on a socket.
+ * \param ring
+ *      The ring, it must not be full.
+ * \param sock
+ *      The socket to send on.
+ * \param buf
+ *      The data to send, it must stay valid until the operation is reaped.
+ * \param len
+ *      The length of 'buf'.
+ * \param flags
+ *      The flags of the send(), MSG_DONTWAIT for sockets that may be full.
+ * \param data
+ *      Returned with the result, see VSFTPUringReap().
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPUringQueueSend(vsftpUring_s *ring, const int sock, const void *buf, const size_t len, const int flags,
+                        void *data)
+{
+    int retval = -1;
+#ifdef VSFTP_HAVE_IO_URING
+    struct io_uring_sqe *sqe = NULL;
+
+    if ((ring != NULL) && (buf != NULL) && (len <= UINT32_MAX) && (VSFTPUringIsFull(ring) == false)) {
+        sqe = GetSqe(ring, sock, data);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->msg_flags = (uint32_t)flags;
+        retval = 0;
+    }
+#else
+    (void)ring;
+    (void)sock;
+    (void)buf;
+    (void)len;
+    (void)flags;
+    (void)data;
+#endif
+
+    return retval;
+}
+
+/*!
+ * \brief Queue a pread() from a file and a send() of what it read on a socket.
+ * \details
+ *      The send is linked to the read, it is cancelled (-ECANCELED) when the read fails or reads less than 'len'. The
+ *      read is reaped with NULL data, the result of the send tells what happened to both.
+ * \param ring
+ *      The ring, it must have room for two operations.
+ * \param fd
+ *      The file to read from.
+ * \param offset
+ *      The offset in the file to read at.
+ * \param sock
+ *      The socket to send on.
+ * \param buf
+ *      The buffer to read into and send from, it must stay valid until the operations are reaped.
+ * \param len
+ *      The bytes to read and send, at most the size of 'buf'.
+ * \param flags
+ *      The flags of the send(), MSG_DONTWAIT for sockets that may be full.
+ * \param data
+ *      Returned with the result of the send, see VSFTPUringReap().
+ * \returns 0 in case of successful completion or any other value in case of an error.
+ */
+int VSFTPUringQueueReadSend(vsftpUring_s *ring, const int fd, const off_t offset, const int sock, void *buf,
+                            const size_t len, const int flags, void *data)
+{
+    int retval = -1;
+#ifdef VSFTP_HAVE_IO_URING
+    struct io_uring_sqe *sqe = NULL;
+
+    if ((ring != NULL) && (buf != NULL) && (len <= UINT32_MAX) && (offset >= 0) &&
+        ((ring->queued + 2U) <= ring->entries)) {
+        sqe = GetSqe(ring, fd, NULL);
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->off = (uint64_t)offset;
+
+        sqe = GetSqe(ring, sock, data);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->msg_flags = (uint32_t)flags;
+        retval = 0;
+    }
+#else
+    (void)ring;
+    (void)fd;
+    (void)offset;
+    (void)sock;
+    (void)buf;
+    (void)len;
+    (void)flags;
+    (void)data;
+#endif
+
+    return retval;
+}
+
+/*!
+ * \brief Check if a ring can not queue more operations before they are submitted.
+ * \param ring
+ *      The ring to check.
+ * \returns true if the ring is full, otherwise false.
+ */
+bool VSFTPUringIsFull(const vsftpUring_s *ring)
+{
+    return (ring == NULL) || (ring->queued >= ring->entries);
+}
+
+/*!
+ * \brief Submit the queued operations and wait until all of them have completed.
+ * \details
+ *      Operations with MSG_DONTWAIT complete right away, so this does not block on the sockets. Their results have
+ *      to be reaped before the next submit, see VSFTPUringReap().
+ * \param ring
+ *      The ring to submit.
+ * \returns 0 in case of successful completion or any other value in case of an error (errno is set). Operations that
+ *      completed can still be reaped then.
+ */
+int VSFTPUringSubmit(vsftpUring_s *ring)
+{
+    int retval = -1;
+#ifdef VSFTP_HAVE_IO_URING
+    unsigned int expected = 0;
+    unsigned int toSubmit = 0;
+    int submitted = 0;
+
+    if (ring != NULL) {
+        expected = ring->queued;
+        toSubmit = ring->queued;
+        /* Publish the entries before the kernel reads the tail. */
+        __atomic_store_n(ring->sqTail, *ring->sqTail + ring->queued, __ATOMIC_RELEASE);
+        ring->queued = 0;
+        ring->operations += expected;
+        retval = 0;
+    }
+
+    /* The wait can be interrupted, then wait for the rest. */
+    while ((retval == 0) && ((toSubmit > 0) ||
+           ((__atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead) < expected))) {
+        submitted = (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, expected, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted >= 0) {
+            toSubmit -= ((unsigned int)submitted < toSubmit) ? (unsigned int)submitted : toSubmit;
+            ring->submits++;
+        } else if (errno != EINTR) {
+            retval = -1;
+        }
+    }
+#else
+    (void)ring;
+    errno = ENOSYS;
+#endif
+
+    return retval;
+}
+
+/*!
+ * \brief Take the result of the next completed operation.
+ * \param ring
+ *      The ring to reap.
+ * \param[out] data
+ *      A pointer to the storage location for the data the operation was queued with.
+ * \param[out] result
+ *      A pointer to the storage location for the result: what the system call returned, or minus its errno.
+ * \returns true when an operation was reaped, false when none has completed.
+ */
+bool VSFTPUringReap(vsftpUring_s *ring, void **data, int *result)
+{
+    bool isReaped = false;
+#ifdef VSFTP_HAVE_IO_URING
+    const struct io_uring_cqe *cqe = NULL;
+    unsigned int head = 0;
+
+    if ((ring != NULL) && (data != NULL) && (result != NULL)) {
+        head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = &((const struct io_uring_cqe *)ring->cqes)[head & *ring->cqMask];
+            *data = (void *)(uintptr_t)cqe->user_data;
+            *result = cqe->res;
+            /* The entry may be reused by the kernel from here. */
+            __atomic_store_n(ring->cqHead, head + 1U, __ATOMIC_RELEASE);
+            isReaped = true;
+        }
+    }
+#else
+    (void)ring;
+    (void)data;
+    (void)result;
+#endif
+
+    return isReaped;
+}
+
+/*!
+ * \brief Close a ring that was set up, operations in flight are cancelled.
+ * \param ring
+ *      The ring to close.
+ */
+void VSFTPUringClose(vsftpUring_s *ring)
+{
+    if ((ring != NULL) && (ring->fd != -1)) {
+        if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED)) {
+            (void)munmap(ring->sqes, ring->sqesLen);
+        }
+        if ((ring->cqMap != NULL) && (ring->cqMap != MAP_FAILED) && (ring->cqMap != ring->sqMap)) {
+            (void)munmap(ring->cqMap, ring->cqMapLen);
+        }
+        if ((ring->sqMap != NULL) && (ring->sqMap != MAP_FAILED)) {
+            (void)munmap(ring->sqMap, ring->sqMapLen);
+        }
+        (void)close(ring->fd);
+        ring->fd = -1;
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the vs-ftp distribution (https://github.com/baskapteijn/vs-ftp).
+ * Copyright (c) 2020 Bas Kapteijn.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VSFTP_URING_H__
+#define VSFTP_URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* An io_uring instance that batches socket (and file) operations into one system call.
+ * The operations are queued, then submitted together and waited for, see VSFTPUringSubmit(). Without io_uring support
+ * at build time (VSFTP_HAVE_IO_URING) it can not be set up, the user keeps the plain system calls then.
+ * A ring is not thread-safe, it is meant to be used by one worker only.
+ */
+typedef struct {
+    int fd;
+    unsigned int entries;       /* Entries of the submission queue. */
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqArray;
+    void *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    void *cqes;
+    void *sqMap;
+    size_t sqMapLen;
+    void *cqMap;                /* The same as 'sqMap' when the kernel maps both queues at once. */
+    size_t cqMapLen;
+    size_t sqesLen;
+    unsigned int queued;        /* Operations queued and not submitted yet. */
+    uint64_t operations;        /* Operations submitted. */
+    uint64_t submits;           /* System calls that submitted them. */
+} vsftpUring_s;
+
+extern int VSFTPUringInitialize(vsftpUring_s *ring, unsigned int entries);
+extern int VSFTPUringQueueRecvmsg(vsftpUring_s *ring, int sock, struct msghdr *msg, int flags, void *data);
+extern int VSFTPUringQueueSend(vsftpUring_s *ring, int sock, const void *buf, size_t len, int flags, void *data);
+extern int VSFTPUringQueueReadSend(vsftpUring_s *ring, int fd, off_t offset, int sock, void *buf, size_t len,
+                                   int flags, void *data);
+extern bool VSFTPUringIsFull(const vsftpUring_s *ring);
+extern int VSFTPUringSubmit(vsftpUring_s *ring);
+extern bool VSFTPUringReap(vsftpUring_s *ring, void **data, int *result);
+extern void VSFTPUringClose(vsftpUring_s *ring);
+
+#endif /* VSFTP_URING_H__ */
@@ -17,14 +17,74 @@
 #ifndef CONFIG_H__
 #define CONFIG_H__
 
-#define HELP_LEN_MAX        256U
 #define PATH_LEN_MAX        256U
 #define REQUEST_LEN_MAX     (256U + 32U) /* Must always be max of HELP/PATH + some more. */
 #define RESPONSE_LEN_MAX    (256U + 32U) /* Must always be max of HELP/PATH + some more. */
+#define REQUEST_RING_SIZE   1024U /* Received control data per session, a power of 2 of at least REQUEST_LEN_MAX. */
+#define REPLY_BUF_SIZE      1024U /* Replies per session not sent yet, at least RESPONSE_LEN_MAX. */
+#define URING_ENTRIES       256U  /* Socket operations a worker submits to io_uring in one system call. */
 
-#define FILE_READ_BUF_SIZE  8192U
+#define FILE_READ_BUF_SIZE  8192U /* Read per write when a file does not support sendfile(). */
+#define TRANSFER_CHUNK_SIZE (256U * 1024U) /* Bytes a transfer may send before yielding to others, one sendfile(). */
+#define URING_COPY_BUFFERS  4U    /* Chunks of copied files a worker reads and sends through io_uring at a time. */
+#define ZEROCOPY_MIN_SIZE_DEFAULT 16U   /* Size (MiB) from which files are sent with MSG_ZEROCOPY, 0 never. */
+#define ZEROCOPY_WINDOW_SIZE    (4U * 1024U * 1024U) /* Bytes of a file that are mapped at a time for MSG_ZEROCOPY. */
+#define ZEROCOPY_WINDOWS        8U      /* Windows per transfer that may wait for the kernel to complete their sends. */
 
-#define PASV_PORT_NUMBER    40000U
+#define PASV_PORT_MIN_DEFAULT   40000U  /* First port of the passive port pool. */
+#define PASV_PORT_MAX_DEFAULT   40255U  /* Last port of the passive port pool. */
+
+#define SESSIONS_MAX            4096U   /* Size of the preallocated session slab, shared out over the workers. */
+#define WORKERS_MAX             64U     /* Maximum number of workers (threads). */
+#define EPOLL_EVENTS_MAX        64U     /* Events handled per event loop iteration. */
+#define EPOLL_WAIT_TIMEOUT_MS   100     /* Upper bound on the time before the handler loops back to the caller. */
+
+#define OFFLOAD_THREADS_DEFAULT 4U      /* Threads that run blocking filesystem calls. */
+#define OFFLOAD_THREADS_MAX     64U
+#define OFFLOAD_QUEUE_LEN       1024U   /* Queued filesystem calls, when full a worker runs the call itself. */
+#define LISTING_BUF_SIZE        2048U   /* Directory listing sent per data connection write. */
+#define MSTAT_FACTS_LEN_MAX     64U     /* The facts (type, size, mtime) SITE MSTAT puts before a path. */
+#define TRANSFER_STEAL_MAX      16U     /* Transfer chunks an idle worker steals from others per iteration. */
+#define TRANSFER_SHORT_SIZE     (1024U * 1024U) /* Transfers with fewer bytes left go before bulk transfers. */
+#define TRANSFER_AGING_MS       200U    /* Bulk transfers waiting longer for short ones get a turn anyway. */
+#define IO_PRIORITY_SHORT       0U      /* Best-effort I/O priority level (0-7) of short transfers and offloads. */
+#define IO_PRIORITY_BULK        7U      /* Best-effort I/O priority level (0-7) of bulk transfers. */
+#define LISTEN_BACKLOG_DEFAULT  1024U   /* Connections the kernel queues per listener, capped by net.core.somaxconn. */
+#define ACCEPT_BATCH_MAX        64U     /* Connections accepted per readable listener before handling other events. */
+#define ACCEPT_RING_LEN         256U    /* Accepted connections the acceptor thread can queue for one worker. */
+#define PASV_PORTS_MAX          SESSIONS_MAX /* Passive ports in the pool, more than one per session is never used. */
+#define PASV_SHARED_EXPIRY_S    10U     /* A PASV on the shared passive port fails when no data connection arrives. */
+#define PASV_SHARED_RETRY_MS    250U    /* A new process retries the shared passive port the previous one still uses. */
+
+#define TIMER_TICK_MS           100U    /* Resolution of the timeouts. */
+#define TIMER_WHEEL_SLOT_BITS   6U
+#define TIMER_WHEEL_SLOTS       (1U << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS      3U      /* Timeouts up to TIMER_WHEEL_SLOTS^3 ticks (7 hours), longer are capped. */
+#define IDLE_TIMEOUT_DEFAULT_S  300U    /* A session without commands is disconnected. */
+#define DATA_TIMEOUT_DEFAULT_S  60U     /* A transfer fails when the client does not open the data connection. */
+#define STALL_TIMEOUT_DEFAULT_S 60U     /* A transfer is aborted when it makes no progress. */
+#define KEEPALIVE_IDLE_S        60U     /* Control connection idle time before keepalive probes are sent. */
+#define KEEPALIVE_INTERVAL_S    10U
+#define KEEPALIVE_COUNT         3U      /* Unanswered probes before the connection is dropped. */
+#define USER_TIMEOUT_MS         30000U  /* Unacknowledged control data drops the connection after this. */
+
+#define CLIENT_TABLE_BITS       13U
+#define CLIENT_TABLE_LEN        (1U << CLIENT_TABLE_BITS) /* Sessions per client address, at least 2 * SESSIONS_MAX. */
+#define OPEN_FILE_TABLE_BITS    13U
+#define OPEN_FILE_TABLE_LEN     (1U << OPEN_FILE_TABLE_BITS) /* Files open for transfers, at least 2 * SESSIONS_MAX. */
+#define SHED_LATENCY_DEFAULT_MS 250U    /* Average worker iteration time above which new sessions are refused. */
+#define SHED_QUEUE_DEPTH        (OFFLOAD_QUEUE_LEN / 2U) /* Offload queue depth above which new sessions are refused. */
+#define HANDOFF_TIMEOUT_MS      5000U   /* Longest wait for the other process while handing over the listeners. */
+#define DRAIN_IDLE_TIMEOUT_MS   10000U  /* Sessions that send nothing while draining are disconnected after this. */
+#define SHAPER_QUANTUM          TRANSFER_CHUNK_SIZE /* Bytes a transfer may send per turn when bandwidth is scarce. */
+#define SHAPER_BURST_MS         200U    /* Bandwidth a limit saves up while unused, as time at its rate. */
+
+#define DATA_LAN_NOTSENT_LOWAT  (128U * 1024U) /* Unsent bytes queued on a LAN data connection before it blocks. */
+#define DATA_WAN_NOTSENT_LOWAT  (512U * 1024U) /* Unsent bytes queued on a WAN data connection before it blocks. */
+#define AUTOTUNE_SAMPLE_BYTES   (256U * 1024U) /* Bytes a transfer sends before its connection is tuned (TCP_INFO). */
+#define AUTOTUNE_WAN_RTT_US     10000U  /* Round trip time from which a data connection gets the WAN profile. */
+#define AUTOTUNE_SNDBUF_GAIN    4U      /* Send buffer per estimated bandwidth-delay product, the estimate is early. */
+#define AUTOTUNE_SNDBUF_MAX     (16U * 1024U * 1024U) /* Largest send buffer requested, capped by net.core.wmem_max. */
 
 #define LOG_FILE_PATH       "/tmp"
 
@@ -18,16 +18,19 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 #include "config.h"
 #include "io.h"
 
 static FILE *logFp = NULL;
+static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*!
  * \brief Logging function for the FTP server.
  * \details
  *      Prints any given output prefixed by a date/time stamp and the filename/line of origin.
  *      Output is printed to stdout and a file in LOG_FILE_PATH.
+ *      This function is thread-safe, lines logged by different workers are not interleaved.
  * \param file
  *      The filename of origin.
  * \param line
@@ -44,6 +47,8 @@ void FTPLog(const char *file, uint32_t line, const char *format, ...)
     struct tm now;
     const time_t now_seconds = time(NULL);
 
+    (void)pthread_mutex_lock(&logMutex);
+
     /* Print to stdio. */
     gmtime_r(&now_seconds, &now);
     sprintf(time_buf, "%d-%02d-%02d_%02d:%02d:%02d",
@@ -68,5 +73,7 @@ void FTPLog(const char *file, uint32_t line, const char *format, ...)
     va_end(args);
     /* Flush immediately so we can tail it. */
     fflush(logFp);
+
+    (void)pthread_mutex_unlock(&logMutex);
 }
 
@@ -17,6 +17,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include "vsftp_server.h"
@@ -34,6 +35,9 @@ static void Terminate(int signum);
 static void ParseDecimal(const char *string, size_t len, uint16_t *number);
 static bool IsDecimalChar(char c);
 static bool IsDecimal(const char *string, size_t len);
+static bool ParseRate(const char *string, unsigned int *rate);
+static bool ParseNumberOption(int argc, char *argv[], int *i, unsigned int *value);
+static int ParseOptions(int argc, char *argv[], vsftpServerOptions_s *options);
 static void PrintHelp(void);
 
 /*!
@@ -142,6 +146,168 @@ static bool IsDecimal(const char *string, size_t len)
     return isDecimal;
 }
 
+/*!
+ * \brief Parse a string that represents a rate in KiB/s, or in MiB/s when it ends with 'M'.
+ * \param string
+ *      The string to parse.
+ * \param[out] rate
+ *      A pointer to the storage location for the rate in KiB/s.
+ * \returns
+ *      true if the string represents a valid rate, otherwise false.
+ */
+static bool ParseRate(const char *string, unsigned int *rate)
+{
+    size_t len = strlen(string);
+    unsigned int scale = 1;
+    uint16_t value = 0;
+    bool isRate = false;
+
+    if ((len > 1) && (string[len - 1] == 'M')) {
+        len--;
+        scale = 1024U;
+    }
+
+    if ((len > 0) && (IsDecimal(string, len) == true)) {
+        ParseDecimal(string, len, &value);
+        *rate = value * scale;
+        isRate = true;
+    }
+
+    return isRate;
+}
+
+/*!
+ * \brief Parse the numeric value of an option.
+ * \param argc
+ *      The number of optional arguments.
+ * \param argv
+ *      A list of optional arguments.
+ * \param[in,out] i
+ *      A pointer to the index of the option in 'argv', it is advanced past the value.
+ * \param[out] value
+ *      A pointer to the storage location for the value, it is only updated when the value is valid.
+ * \returns
+ *      true if the option is followed by a valid numeric value, otherwise false.
+ */
+static bool ParseNumberOption(int argc, char *argv[], int *i, unsigned int *value)
+{
+    uint16_t number = 0;
+    bool isNumber = false;
+
+    if ((*i + 1 < argc) && (IsDecimal(argv[*i + 1], strlen(argv[*i + 1])) == true)) {
+        (*i)++;
+        ParseDecimal(argv[*i], strlen(argv[*i]), &number);
+        *value = number;
+        isNumber = true;
+    } else {
+        printf("Option \"%s\" requires a numeric value\n\n", argv[*i]);
+    }
+
+    return isNumber;
+}
+
+/*!
+ * \brief Parse the optional arguments that follow the mandatory ones.
+ * \param argc
+ *      The number of optional arguments.
+ * \param argv
+ *      A list of optional arguments.
+ * \param[in,out] options
+ *      A pointer to the server options to update, these should be initialized with their defaults.
+ * \returns
+ *      0 in case of successful completion or any other value in case of an error.
+ */
+static int ParseOptions(int argc, char *argv[], vsftpServerOptions_s *options)
+{
+    const char *separator = NULL;
+    unsigned int *rate = NULL;
+    int retval = 0;
+
+    for (int i = 0; (retval == 0) && (i < argc); i++) {
+        if (strcmp(argv[i], "--workers") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->workers) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            options->pinWorkers = true;
+        } else if (strcmp(argv[i], "--offload-threads") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->offloadThreads) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--backlog") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->backlog) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--acceptor") == 0) {
+            options->useAcceptor = true;
+        } else if (strcmp(argv[i], "--max-clients") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->maxClients) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--max-per-ip") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->maxClientsPerIp) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--shed-latency") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->shedLatency) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--idle-timeout") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->idleTimeout) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--data-timeout") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->dataTimeout) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--stall-timeout") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->stallTimeout) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--pasv-ports") == 0) {
+            separator = (i + 1 < argc) ? strchr(argv[i + 1], '-') : NULL;
+            if ((separator != NULL) && (separator != argv[i + 1]) &&
+                (IsDecimal(argv[i + 1], (size_t)(separator - argv[i + 1])) == true) && (separator[1] != '\0') &&
+                (IsDecimal(&separator[1], strlen(&separator[1])) == true)) {
+                i++;
+                ParseDecimal(argv[i], (size_t)(separator - argv[i]), &options->pasvPortMin);
+                ParseDecimal(&separator[1], strlen(&separator[1]), &options->pasvPortMax);
+            } else {
+                printf("Option \"%s\" requires a port range <first>-<last>\n\n", argv[i]);
+                retval = -1;
+            }
+        } else if (strcmp(argv[i], "--pasv-shared") == 0) {
+            options->pasvShared = true;
+        } else if ((strcmp(argv[i], "--rate-limit") == 0) || (strcmp(argv[i], "--rate-limit-ip") == 0) ||
+                   (strcmp(argv[i], "--rate-limit-session") == 0)) {
+            if (strcmp(argv[i], "--rate-limit") == 0) {
+                rate = &options->rateLimit;
+            } else if (strcmp(argv[i], "--rate-limit-ip") == 0) {
+                rate = &options->rateLimitPerIp;
+            } else {
+                rate = &options->rateLimitPerSession;
+            }
+            if ((i + 1 < argc) && (ParseRate(argv[i + 1], rate) == true)) {
+                i++;
+            } else {
+                printf("Option \"%s\" requires a rate in KiB/s, or in MiB/s followed by 'M'\n\n", argv[i]);
+                retval = -1;
+            }
+        } else if (strcmp(argv[i], "--kernel-pacing") == 0) {
+            options->kernelPacing = true;
+        } else if (strcmp(argv[i], "--congestion") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                options->congestion = argv[i];
+            } else {
+                printf("Option \"%s\" requires the name of a congestion control algorithm\n\n", argv[i]);
+                retval = -1;
+            }
+        } else if (strcmp(argv[i], "--no-autotune") == 0) {
+            options->autotune = false;
+        } else if (strcmp(argv[i], "--no-io-uring") == 0) {
+            options->ioUring = false;
+        } else if (strcmp(argv[i], "--zerocopy-min") == 0) {
+            retval = (ParseNumberOption(argc, argv, &i, &options->zerocopyMin) == true) ? 0 : -1;
+        } else if (strcmp(argv[i], "--handoff") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                options->handoffPath = argv[i];
+            } else {
+                printf("Option \"%s\" requires a path\n\n", argv[i]);
+                retval = -1;
+            }
+        } else {
+            printf("Invalid option \"%s\"\n\n", argv[i]);
+            retval = -1;
+        }
+    }
+
+    return retval;
+}
+
 /*!
  * \brief Print the help menu to the console.
  */
@@ -150,15 +316,42 @@ static void PrintHelp(void)
     printf("Version %s\n\n", GetVersionString());
 
     printf("Usage:\n");
-    printf("  vs-ftp <server ip> <port> <root path>\n");
+    printf("  vs-ftp <server ip> <port> <root path> [options]\n\n");
+
+    printf("Options:\n");
+    printf("  --workers <n>           Number of worker threads, each with its own listener on <port> (default 1)\n");
+    printf("  --pin-cpus              Pin each worker thread to its own CPU\n");
+    printf("  --offload-threads <n>   Number of threads for blocking filesystem calls, 0 to disable (default 4)\n");
+    printf("  --backlog <n>           Number of pending connections the kernel queues on <port> (default 1024)\n");
+    printf("  --acceptor              Accept on one thread that hands connections to the least loaded worker\n");
+    printf("  --idle-timeout <s>      Disconnect sessions without commands for <s> seconds, 0 never (default 300)\n");
+    printf("  --data-timeout <s>      Fail transfers not connected within <s> seconds, 0 never (default 60)\n");
+    printf("  --stall-timeout <s>     Abort transfers without progress for <s> seconds, 0 never (default 60)\n");
+    printf("  --max-clients <n>       Refuse sessions beyond <n> in total, 0 for no limit (default 0)\n");
+    printf("  --max-per-ip <n>        Refuse sessions beyond <n> per client address, 0 for no limit (default 0)\n");
+    printf("  --shed-latency <ms>     Refuse sessions while worker iterations take over <ms>, 0 never (default 250)\n");
+    printf("  --pasv-ports <a>-<b>    Ports for passive data connections, one listener each (default 40000-40255)\n");
+    printf("  --pasv-shared           Accept data connections on the first passive port for all sessions\n");
+    printf("  --rate-limit <r>        Limit file transfers of all sessions to <r> KiB/s (<r>M for MiB/s)\n");
+    printf("  --rate-limit-ip <r>     Limit file transfers per client address to <r> KiB/s (<r>M for MiB/s)\n");
+    printf("  --rate-limit-session <r> Limit file transfers per session to <r> KiB/s (<r>M for MiB/s)\n");
+    printf("  --kernel-pacing         Let the kernel pace data connections to the session limit\n");
+    printf("  --congestion <name>     Congestion control of data connections, f.e. bbr (default: kernel default)\n");
+    printf("  --no-autotune           Do not tune data connections to their round trip time and bandwidth\n");
+    printf("  --zerocopy-min <MiB>    Send files of at least <MiB> with MSG_ZEROCOPY, 0 never (default 16)\n");
+    printf("  --no-io-uring           Do not batch socket I/O through io_uring\n");
+    printf("  --handoff <path>        Take the listeners over from the process serving on the Unix socket <path>,\n");
+    printf("                          then serve on it for the next process\n");
 }
 
 /*!
  * \brief This is the program entry.
  * \details
  *      argv[0]: path to this executable
- *      argv[1]: the port used by the VS-FTP server
- *      argv[2]: the root directory used by the VS-FTP server
+ *      argv[1]: the IP address used by the VS-FTP server
+ *      argv[2]: the port used by the VS-FTP server
+ *      argv[3]: the root directory used by the VS-FTP server
+ *      argv[4..]: optional arguments
  * \param argc
  *      The number of string pointed to by argv (argument count).
  * \param argv
@@ -171,9 +364,10 @@ int main(int argc, char *argv[])
     uint16_t port = 0;
     int retval = -1;
     struct sigaction action;
+    vsftpServerOptions_s options;
 
     /* Check input arguments. */
-    if (argc != 4) {
+    if (argc < 4) {
         /* Missing or too many arguments. */
         printf("Invalid number of arguments\n\n");
         PrintHelp();
@@ -200,14 +394,24 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    (void)VSFTPServerGetDefaultOptions(&options);
+    if (ParseOptions(argc - 4, &argv[4], &options) != 0) {
+        PrintHelp();
+        return -1;
+    }
+
     /* Initialize termination on signal. */
     (void)memset(&action, 0, sizeof(struct sigaction));
     action.sa_handler = Terminate;
     sigaction(SIGTERM, &action, NULL);
 
+    /* A client that disconnects while we write to it must not terminate the server for all other clients. */
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
     /* Initialize the VS-FTP Server. */
     ParseDecimal(argv[2], strlen(argv[2]), &port);
-    retval = VSFTPServerInitialize(argv[3], strlen(argv[3]), argv[1], strlen(argv[1]), port);
+    retval = VSFTPServerInitialize(argv[3], strlen(argv[3]), argv[1], strlen(argv[1]), port, &options);
     if (retval != 0) {
         printf("Server initialization failed with error %d\n\n", retval);
         return retval;
@@ -222,9 +426,9 @@ int main(int argc, char *argv[])
             printf("Server handler failed with error %d\n\n", retval);
             break;
         }
-    } while (quit == 0);
+    } while ((quit == 0) && (VSFTPServerIsDrained() == false));
 
-    /* We have been signalled to quit, stop the VS-FTP Server. */
+    /* We have been signalled to quit (or handed over to a new process), stop the VS-FTP Server. */
     if (retval == 0) {
         retval = VSFTPServerStop();
         if (retval != 0) {